@@ -0,0 +1,150 @@
+#include <array>
+#include <algorithm>
+#include <random>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include "generator.h"
+
+
+using namespace BSPFormat;
+
+static constexpr std::array c_classnames{
+	"info_player_start", "info_player_deathmatch", "light", "light_spot", "func_door", "func_button",
+	"func_breakable", "func_wall", "trigger_multiple", "trigger_once", "trigger_changelevel", "multi_manager",
+	"env_sprite", "env_render", "ambient_generic", "monster_scientist", "monster_barney", "monster_headcrab",
+	"monster_gman", "ammo_9mmclip", "weapon_crowbar", "item_healthkit", "path_corner", "info_landmark"
+};
+
+static constexpr std::array c_brushClassnames{
+	"func_door", "func_button", "func_breakable", "func_wall", "trigger_multiple", "trigger_once", "trigger_changelevel"
+};
+
+
+std::vector<std::vector<std::pair<std::string, std::string>>> generateKeyValues(const GeneratorSettings& settings)
+{
+	std::mt19937 rng{ settings.seed };
+	std::uniform_int_distribution<int> coord{ -4096, 4096 };
+	std::uniform_int_distribution<int> angle{ 0, 359 };
+	std::uniform_int_distribution<int> percent{ 0, 99 };
+	std::uniform_int_distribution<std::size_t> classPick{ 0, c_classnames.size() - 1 };
+	std::uniform_int_distribution<unsigned int> vocabPick{ 0, settings.vocabulary ? settings.vocabulary - 1 : 0 };
+
+	std::vector<std::vector<std::pair<std::string, std::string>>> entities;
+	entities.reserve(settings.entities + 1);
+
+	entities.push_back({
+		{ "classname", "worldspawn" },
+		{ "wad", "\\half-life\\valve\\halflife.wad;\\half-life\\valve\\liquids.wad" },
+		{ "mapversion", "220" },
+		{ "skyname", "desert" }
+	});
+
+	unsigned int brushModel = 1;
+	for (unsigned int i = 0; i < settings.entities; ++i)
+	{
+		auto& keyvalues = entities.emplace_back();
+		const std::string classname = c_classnames[classPick(rng)];
+		keyvalues.emplace_back("classname", classname);
+
+		if (std::ranges::find(c_brushClassnames, classname) != c_brushClassnames.end())
+			keyvalues.emplace_back("model", std::format("*{}", brushModel++));
+		else
+			keyvalues.emplace_back("origin", std::format("{} {} {}", coord(rng), coord(rng), coord(rng) / 4));
+
+		if (percent(rng) < 40)
+			keyvalues.emplace_back("targetname", std::format("{}_{}", classname.substr(0, classname.find('_')), i));
+		if (percent(rng) < 30)
+			keyvalues.emplace_back("target", std::format("target_{}", percent(rng)));
+		if (percent(rng) < 50)
+			keyvalues.emplace_back("angles", std::format("0 {} 0", angle(rng)));
+		if (percent(rng) < 50)
+			keyvalues.emplace_back("spawnflags", std::to_string(1u << (percent(rng) % 10) | (percent(rng) % 4)));
+		if (classname.starts_with("monster_"))
+			keyvalues.emplace_back("health", std::to_string(percent(rng) * 10));
+		if (classname.starts_with("env_"))
+		{
+			keyvalues.emplace_back("renderamt", std::to_string(percent(rng) * 255 / 99));
+			keyvalues.emplace_back("model", "sprites/glow01.spr");
+		}
+
+		for (unsigned int k = 0; k < settings.extraKeys && settings.vocabulary; ++k)
+		{
+			const unsigned int vocab = vocabPick(rng);
+			// Alternate between numeric, vector and string values to exercise every query operator
+			switch (vocab % 3)
+			{
+			case 0: keyvalues.emplace_back(std::format("key_{}", vocab), std::to_string(coord(rng))); break;
+			case 1: keyvalues.emplace_back(std::format("key_{}", vocab), std::format("{} {} {}", percent(rng), percent(rng), percent(rng))); break;
+			default: keyvalues.emplace_back(std::format("key_{}", vocab), std::format("value_{}_{}", vocab, percent(rng))); break;
+			}
+		}
+	}
+
+	return entities;
+}
+
+std::string generateEntityLump(const GeneratorSettings& settings)
+{
+	const char* newline = settings.crlf ? "\r\n" : "\n";
+
+	std::string lump;
+	unsigned int index = 0;
+	for (const auto& keyvalues : generateKeyValues(settings))
+	{
+		if (settings.commentHeaders)
+			lump += std::format("// entity {}{}", index, newline);
+
+		lump += '{';
+		lump += newline;
+		for (const auto& [key, value] : keyvalues)
+		{
+			lump += std::format("\"{}\" \"{}\"", key, value);
+			if (settings.trailingComments && key == "classname")
+				lump += " // generated";
+			lump += newline;
+		}
+		lump += '}';
+		lump += newline;
+		++index;
+	}
+	lump.push_back('\0');
+
+	return lump;
+}
+
+std::size_t writeSyntheticBsp(const std::filesystem::path& filepath, const GeneratorSettings& settings)
+{
+	const std::string entityLump = generateEntityLump(settings);
+
+	// A handful of axial planes, the parser only needs it to not look like entity data
+	std::vector<float> planes;
+	for (int i = 0; i < 16; ++i)
+		planes.insert(planes.end(), { 1.f, 0.f, 0.f, static_cast<float>(i * 64), 0.f });
+	const auto* planeData = reinterpret_cast<const char*>(planes.data());
+	const auto planeLength = static_cast<std::int32_t>(planes.size() * sizeof(float));
+
+	BspHeader header{};
+	header.version = settings.version;
+
+	const auto entityOffset = static_cast<std::int32_t>(sizeof(BspHeader));
+	const auto entityLength = static_cast<std::int32_t>(entityLump.size());
+	header.lumps[Entities] = { entityOffset, entityLength };
+	header.lumps[Planes] = { entityOffset + entityLength, planeLength };
+	for (int lump = Textures; lump < Headerlumps; ++lump)
+		header.lumps[lump] = { entityOffset + entityLength + planeLength, 0 };
+
+	// Blue Shift stores planes first, so the Entities index points at plane data
+	if (settings.bshift)
+		std::swap(header.lumps[Entities], header.lumps[Planes]);
+
+	std::ofstream file{ filepath, std::ios::binary | std::ios::trunc };
+	if (!file.is_open())
+		throw std::runtime_error("Could not open " + filepath.string() + " for writing");
+
+	file.write(reinterpret_cast<const char*>(&header), sizeof(BspHeader));
+	file.write(entityLump.data(), entityLength);
+	file.write(planeData, planeLength);
+
+	return entityLump.size();
+}
@@ -0,0 +1,28 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "mer.h"
+
+
+/*
+	Writes synthetic GoldSrc BSP files for benchmarking. Only the header and the lumps
+	the scanner cares about carry data, every other lump is left empty.
+*/
+struct GeneratorSettings
+{
+	int version = 30;
+	unsigned int entities = 150;
+	unsigned int vocabulary = 32;      // Number of distinct extra keys to draw from
+	unsigned int extraKeys = 4;        // Extra keys added per entity on top of the common ones
+	bool commentHeaders = false;       // "// entity N" above every entity, seen in some BSP29 maps
+	bool trailingComments = false;     // Comments after values, seen in some SC maps
+	bool crlf = false;
+	bool bshift = false;               // Swap the Entities and Planes lumps like Blue Shift does
+	std::uint32_t seed = 1;
+};
+
+std::vector<std::vector<std::pair<std::string, std::string>>> generateKeyValues(const GeneratorSettings& settings);
+std::string generateEntityLump(const GeneratorSettings& settings);
+std::size_t writeSyntheticBsp(const std::filesystem::path& filepath, const GeneratorSettings& settings);
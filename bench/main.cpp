@@ -0,0 +1,326 @@
+#include <set>
+#include <array>
+#include <chrono>
+#include <sstream>
+#include <format>
+#include <cstring>
+#include <charconv>
+#include <iostream>
+#include <functional>
+#include "logging.h"
+#include "mer.h"
+#include "generator.h"
+
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
+
+static constexpr auto c_minBenchDuration = std::chrono::milliseconds(300);
+
+
+struct BenchSettings
+{
+	unsigned int maps = 10000;
+	unsigned int entities = 150;
+	bool keep = false;
+	fs::path dir = fs::temp_directory_path() / "mer-bench";
+};
+
+
+// Runs fn until at least c_minBenchDuration has passed, returns nanoseconds per call
+static double measure(const std::function<void()>& fn)
+{
+	std::size_t iterations = 0;
+	const auto start = Clock::now();
+	auto elapsed = Clock::duration::zero();
+	do
+	{
+		fn();
+		++iterations;
+		elapsed = Clock::now() - start;
+	} while (elapsed < c_minBenchDuration);
+
+	return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / iterations;
+}
+
+static void printRow(const std::string& name, const double nsPerOp, const std::string& throughput = "")
+{
+	std::cout << std::format("  {:<40}{:>12.1f} ns/op   {}\n", name, nsPerOp, throughput);
+}
+
+static std::string throughput(const double perSecond, const char* unit)
+{
+	return std::format("{:.1f} {}/s", perSecond, unit);
+}
+
+
+static GeneratorSettings corpusVariant(const unsigned int index, const unsigned int entities)
+{
+	GeneratorSettings settings{ .entities = entities, .seed = index + 1 };
+	switch (index % 8)
+	{
+	case 5: settings.version = 29; settings.commentHeaders = true; break;
+	case 6: settings.bshift = true; break;
+	case 7: settings.trailingComments = true; settings.crlf = true; break;
+	default: break;
+	}
+	return settings;
+}
+
+static std::size_t generateCorpus(const BenchSettings& bench, std::set<fs::path>& globs)
+{
+	fs::create_directories(bench.dir / "maps");
+
+	std::size_t lumpBytes = 0;
+	for (unsigned int i = 0; i < bench.maps; ++i)
+	{
+		const fs::path mapPath = bench.dir / "maps" / std::format("bench{:05}.bsp", i);
+		lumpBytes += writeSyntheticBsp(mapPath, corpusVariant(i, bench.entities));
+		globs.insert(mapPath);
+	}
+	return lumpBytes;
+}
+
+
+static void benchParse(const BenchSettings& bench)
+{
+	std::cout << "Bsp::parse\n";
+
+	const std::array<std::pair<const char*, GeneratorSettings>, 4> variants{ {
+		{ "v30", { .entities = bench.entities } },
+		{ "v29 with comment headers", { .version = 29, .entities = bench.entities, .commentHeaders = true } },
+		{ "v30 bshift lumps", { .entities = bench.entities, .bshift = true } },
+		{ "v30 crlf and trailing comments", { .entities = bench.entities, .trailingComments = true, .crlf = true } },
+	} };
+
+	for (const auto& [name, settings] : variants)
+	{
+		const fs::path mapPath = bench.dir / "parse.bsp";
+		const std::size_t lumpBytes = writeSyntheticBsp(mapPath, settings);
+
+		MapArena arena;
+		const double ns = measure([&] {
+			arena.reset();
+			const BSPFormat::Bsp reader{ mapPath, arena };
+		});
+		printRow(name, ns, std::format("{}, {}, {}",
+			throughput(1e9 / ns, "maps"),
+			throughput(1e9 / ns * (settings.entities + 1), "entities"),
+			throughput(1e9 / ns * lumpBytes / 1e6, "MB")));
+		fs::remove(mapPath);
+	}
+}
+
+static void benchTokenizer(const BenchSettings& bench)
+{
+	std::cout << "Tokenizer::tokenize\n";
+
+	const std::string lump = generateEntityLump({ .entities = bench.entities, .trailingComments = true });
+	for (const auto isa : { Tokenizer::Isa::Scalar, Tokenizer::Isa::SSE2, Tokenizer::Isa::AVX2 })
+	{
+		if (!Tokenizer::isaSupported(isa))
+			continue;
+
+		MapArena arena;
+		const double ns = measure([&] {
+			arena.reset();
+			Tokenizer::Result result{ &arena };
+			Tokenizer::tokenize(lump, 0, result, isa);
+		});
+		printRow(Tokenizer::isaName(isa), ns, throughput(1e9 / ns * lump.size() / 1e6, "MB"));
+	}
+}
+
+static void benchQueries(const BenchSettings& bench)
+{
+	std::cout << "Query::testEntity\n";
+
+	const auto generated = generateKeyValues({ .entities = bench.entities });
+	std::vector<Entity> entities;
+	for (const auto& keyvalues : generated)
+	{
+		Entity& entity = entities.emplace_back();
+		for (const auto& [key, value] : keyvalues)
+			entity.insert_or_assign(key, value);
+	}
+
+	const std::array<std::pair<const char*, const char*>, 12> terms{ {
+		{ "=  (key and value)", "classname=monster" },
+		{ "=  (key only)", "target=" },
+		{ "=  (value only)", "=*glow*" },
+		{ "== (exact)", "classname==monster_gman" },
+		{ "!= (not equals)", "classname!=light" },
+		{ "<  (numeric)", "health<100" },
+		{ ">  (numeric)", "health>500" },
+		{ "<= (numeric)", "renderamt<=128" },
+		{ ">= (numeric)", "renderamt>=128" },
+		{ "[] (element)", "origin[2]<-500" },
+		{ "[] (second element)", "angles[1]>=180" },
+		{ "spawnflags", "spawnflags==3" },
+	} };
+
+	for (const auto& [name, term] : terms)
+	{
+		const Query query{ term };
+		std::size_t matches = 0;
+		const double ns = measure([&] {
+			for (unsigned int i = 0; i < entities.size(); ++i)
+				matches += query.testEntity(entities[i], i).matched;
+		});
+		printRow(name, ns / entities.size(), throughput(1e9 / ns * entities.size(), "entities"));
+	}
+
+	std::cout << "Query::testChain\n";
+
+	const std::array<std::pair<const char*, std::vector<std::string>>, 3> chains{ {
+		{ "OR  x3", { "classname==monster_gman", "or", "targetname=light", "or", "health>500" } },
+		{ "AND x3", { "classname=monster", "and", "health>=100", "and", "origin[2]<0" } },
+		{ "mixed x4", { "classname=func", "and", "spawnflags=1", "or", "=*glow*", "or", "renderamt<100" } },
+	} };
+
+	for (const auto& [name, chainTerms] : chains)
+	{
+		std::vector<std::unique_ptr<Query>> chain;
+		for (const auto& term : chainTerms)
+		{
+			if (term == "or")
+				continue;
+			if (term == "and")
+			{
+				chain.back()->type = Query::QueryAnd;
+				continue;
+			}
+			chain.push_back(std::make_unique<Query>(term));
+			if (chain.size() > 1)
+				chain[chain.size() - 2]->next = chain.back().get();
+		}
+
+		std::size_t matches = 0;
+		const double ns = measure([&] {
+			for (unsigned int i = 0; i < entities.size(); ++i)
+				matches += chain.front()->testChain(entities[i], i).matched;
+		});
+		printRow(name, ns / entities.size(), throughput(1e9 / ns * entities.size(), "entities"));
+	}
+}
+
+static void benchCheckMaps(const BenchSettings& bench)
+{
+	std::cout << std::format("Options::checkMaps ({} maps, {} entities each)\n", bench.maps, bench.entities + 1);
+
+	const auto generateStart = Clock::now();
+	std::set<fs::path> globs;
+	const std::size_t lumpBytes = generateCorpus(bench, globs);
+	std::cout << std::format("  generated corpus in {:.2f} s\n",
+		std::chrono::duration<double>(Clock::now() - generateStart).count());
+
+	Query query{ "classname==monster_gman" };
+	g_options.absoluteDir = true;
+	g_options.globs = std::move(globs);
+	g_options.firstQuery = &query;
+
+	// Silence the progress output of checkMaps
+	std::ostringstream sink;
+	std::streambuf* coutBuffer = std::cout.rdbuf(sink.rdbuf());
+	const auto start = Clock::now();
+	g_options.checkMaps();
+	const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+	std::cout.rdbuf(coutBuffer);
+
+	printRow("end-to-end", seconds * 1e9 / bench.maps, std::format("{}, {}, {}",
+		throughput(bench.maps / seconds, "maps"),
+		throughput(static_cast<double>(bench.maps) * (bench.entities + 1) / seconds, "entities"),
+		throughput(lumpBytes / seconds / 1e6, "MB")));
+	std::cout << std::format("  {} matches\n", g_options.foundEntries);
+
+	g_options.firstQuery = nullptr;
+}
+
+
+// Removes the generated maps and the directories the bench created, leaving anything else in --dir alone
+static void removeCorpus(const BenchSettings& bench, const bool createdDir)
+{
+	const fs::path mapsDir = bench.dir / "maps";
+	for (unsigned int i = 0; i < bench.maps; ++i)
+		fs::remove(mapsDir / std::format("bench{:05}.bsp", i));
+
+	// Only removed when empty
+	std::error_code error;
+	fs::remove(mapsDir, error);
+	if (createdDir)
+		fs::remove(bench.dir, error);
+}
+
+// Positive count of a --maps or --entities argument, like readCountArg of mer
+static bool readCount(const char* arg, const char* value, unsigned int& count)
+{
+	const std::string_view text{ value };
+	const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), count);
+	if (text.empty() || error != std::errc{} || end != text.data() + text.size() || count == 0)
+	{
+		logger.error("%s is not a valid number for %s", value, arg);
+		return false;
+	}
+	return true;
+}
+
+static void printBenchUsage()
+{
+	std::cout << "Usage: bench [options...]\n\n"
+		<< "  --maps N        number of maps in the generated corpus (default 10000)\n"
+		<< "  --entities N    number of entities per generated map (default 150)\n"
+		<< "  --dir DIR       directory to generate the corpus in (default temp directory)\n"
+		<< "  --keep          keep the generated corpus after running\n"
+		<< std::endl;
+}
+
+int main(const int argc, char* argv[])
+{
+	logger.setFileHandler(nullptr);
+	logger.setLevel(Logging::LogLevel::Error);
+
+	BenchSettings bench;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--help") == 0 || strcmp(argv[i], "-h") == 0)
+		{
+			printBenchUsage();
+			return EXIT_SUCCESS;
+		}
+		if (strcmp(argv[i], "--keep") == 0)
+		{
+			bench.keep = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			logger.error("Missing parameter for %s argument", argv[i]);
+			return EXIT_FAILURE;
+		}
+		if (strcmp(argv[i], "--maps") == 0 || strcmp(argv[i], "--entities") == 0)
+		{
+			if (!readCount(argv[i], argv[i + 1], strcmp(argv[i], "--maps") == 0 ? bench.maps : bench.entities))
+				return EXIT_FAILURE;
+			++i;
+		}
+		else if (strcmp(argv[i], "--dir") == 0)
+			bench.dir = argv[++i];
+		else
+		{
+			logger.error("Unknown argument %s", argv[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	const bool createdDir = !fs::exists(bench.dir);
+	fs::create_directories(bench.dir);
+
+	benchParse(bench);
+	benchTokenizer(bench);
+	benchQueries(bench);
+	benchCheckMaps(bench);
+
+	if (!bench.keep)
+		removeCorpus(bench, createdDir);
+}
@@ -0,0 +1,200 @@
+#include <cmath>
+#include <ranges>
+#include <charconv>
+#include <algorithm>
+#include "aggregation.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+
+std::string Aggregation::scopeOf(const fs::path& map) const
+{
+    if (m_scope == Scope::Map)
+        return g_options.displayPath(map).generic_string();
+    if (m_scope == Scope::All)
+        return {};
+
+    // game/mod, copies of a map in the SteamPipe folders of a mod count towards the mod
+    const fs::path modDir = map.parent_path().parent_path();
+    return (modDir.parent_path().filename() / unSteampipe(modDir.filename().string())).generic_string();
+}
+
+std::string Aggregation::keyOf(const fs::path& map) const
+{
+    // Paths and scopes never hold a NUL, it can separate them like it separates the value
+    return m_countCopies ? map.string() + '\0' + scopeOf(map) : scopeOf(map);
+}
+
+void Aggregation::add(const std::string& mapKey, const Entity& entity)
+{
+    if (!m_key.empty() && !entity.contains(m_key))
+        return;
+
+    // Scope and value in one key, so a single lookup counts the match
+    thread_local std::string key;
+    key.assign(mapKey);
+    if (!m_key.empty())
+    {
+        key += '\0';
+        key += entity.at(m_key);
+    }
+
+    Table& table = m_tables.local();
+    if (const auto count = table.find(key); count != table.end())
+        ++count->second;
+    else
+        table.emplace(key, 1);
+}
+
+void Aggregation::addCopy(const fs::path& copy, const fs::path& original)
+{
+    m_copyScopes[original.string()].push_back(scopeOf(copy));
+}
+
+Aggregation::Counts Aggregation::merged() const
+{
+    static const std::vector<std::string> noCopies;
+
+    Counts counts;
+    for (const auto& table : m_tables.values())
+    {
+        for (const auto& [mapKey, count] : *table)
+        {
+            std::string_view key = mapKey;
+            const std::vector<std::string>* copyScopes = &noCopies;
+            if (m_countCopies)
+            {
+                const std::size_t mapEnd = key.find('\0');
+                if (const auto copies = m_copyScopes.find(std::string(key.substr(0, mapEnd))); copies != m_copyScopes.end())
+                    copyScopes = &copies->second;
+                key.remove_prefix(mapEnd + 1);
+            }
+
+            const std::size_t separator = m_key.empty() ? key.size() : key.find('\0');
+            const std::string value{ separator < key.size() ? key.substr(separator + 1) : std::string_view{} };
+            counts[std::string(key.substr(0, separator))][value] += count;
+            for (const std::string& scope : *copyScopes)
+                counts[scope][value] += count;
+        }
+    }
+    return counts;
+}
+
+void Aggregation::print(std::ostream& out, const Counts& counts) const
+{
+    using Row = std::pair<std::string_view, std::uint64_t>;
+    const auto byCount = [](const Row& a, const Row& b) { return a.second != b.second ? a.second > b.second : a.first < b.first; };
+
+    // Only counting by map or mod, one line each
+    if (m_key.empty())
+    {
+        std::vector<Row> rows;
+        for (const auto& [scope, values] : counts)
+            rows.emplace_back(scope, values.begin()->second);
+        std::ranges::sort(rows, byCount);
+
+        for (const auto& [scope, count] : rows)
+            out << scope << ": " << count << '\n';
+        return;
+    }
+
+    for (const auto& [scope, values] : counts)
+    {
+        if (m_distinct)
+        {
+            out << scope << (scope.empty() ? "" : " (") << values.size() << " distinct values of " << m_key << (scope.empty() ? "\n" : "): [\n");
+            for (const std::string& value : values | std::views::keys)
+                out << "  " << value << '\n';
+        }
+        else
+        {
+            std::vector<Row> rows{ values.begin(), values.end() };
+            std::ranges::sort(rows, byCount);
+
+            if (!scope.empty())
+                out << scope << ": [\n";
+            for (const auto& [value, count] : rows)
+                out << "  " << value << ": " << count << '\n';
+        }
+
+        if (!scope.empty())
+            out << "]\n";
+    }
+}
+
+
+TopMatches::TopMatches(const std::size_t count, const bool bottom, const std::string_view by) : m_count(count), m_bottom(bottom), m_by(by), m_key(by)
+{
+    if (const std::size_t pos = m_key.find('['), posEnd = m_key.find(']'); pos != std::string::npos && posEnd == m_key.size() - 1 && pos < posEnd)
+    {
+        const std::string_view rawIndex = std::string_view(m_key).substr(pos + 1, posEnd - pos - 1);
+        const auto [end, error] = std::from_chars(rawIndex.data(), rawIndex.data() + rawIndex.size(), m_index);
+        valid = !rawIndex.empty() && error == std::errc{} && end == rawIndex.data() + rawIndex.size();
+        m_key.resize(pos);
+        m_elementAccess = true;
+    }
+    valid = valid && !m_key.empty();
+}
+
+std::optional<double> TopMatches::valueOf(const Entity& entity) const
+{
+    if (!entity.contains(m_key))
+        return std::nullopt;
+
+    const std::string_view value = m_elementAccess ? elementAt(entity.at(m_key), m_index) : entity.at(m_key);
+    if (double numeric = 0.; !value.empty() && isValueNumeric(value, numeric) && !std::isnan(numeric))
+        return numeric;
+    return std::nullopt;
+}
+
+bool TopMatches::better(const double value, const fs::path& map, const unsigned int index, const Match& than) const
+{
+    if (value != than.value)
+        return m_bottom ? value < than.value : value > than.value;
+    if (map != than.map)
+        return map < than.map;
+    return index < than.entry.index;
+}
+
+bool TopMatches::wants(const double value, const fs::path& map, const unsigned int index)
+{
+    Heap& heap = m_heaps.local();
+    ++heap.ranked;
+    return heap.matches.size() < m_count || better(value, map, index, heap.matches.front());
+}
+
+void TopMatches::add(const double value, const fs::path& map, EntityEntry entry)
+{
+    // The worst match is on top of the heap, and makes room for the new one once there are K
+    const auto ranksBefore = [this](const Match& a, const Match& b) { return better(a.value, a.map, a.entry.index, b); };
+    std::vector<Match>& matches = m_heaps.local().matches;
+    if (matches.size() == m_count)
+    {
+        std::ranges::pop_heap(matches, ranksBefore);
+        matches.pop_back();
+    }
+    matches.push_back({ value, map, std::move(entry) });
+    std::ranges::push_heap(matches, ranksBefore);
+}
+
+std::vector<TopMatches::Match> TopMatches::merged() const
+{
+    std::vector<Match> matches;
+    for (const auto& heap : m_heaps.values())
+        matches.insert(matches.end(), heap->matches.begin(), heap->matches.end());
+
+    const auto ranksBefore = [this](const Match& a, const Match& b) { return better(a.value, a.map, a.entry.index, b); };
+    std::ranges::sort(matches, ranksBefore);
+    if (matches.size() > m_count)
+        matches.resize(m_count);
+    return matches;
+}
+
+std::uint64_t TopMatches::rankedCount() const
+{
+    std::uint64_t ranked = 0;
+    for (const auto& heap : m_heaps.values())
+        ranked += heap->ranked;
+    return ranked;
+}
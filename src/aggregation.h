@@ -0,0 +1,146 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <optional>
+#include <string_view>
+#include <filesystem>
+#include <unordered_map>
+#include "mer.h"
+
+
+/*
+	One T for every thread that asks for it, so scan threads can fold results without sharing anything
+	but the lock taken the first time each of them shows up. The values are read once the scan is done.
+*/
+template <typename T>
+class PerThread
+{
+public:
+	T& local()
+	{
+		thread_local std::uint64_t owner = 0;
+		thread_local T* value = nullptr;
+		if (owner != m_id)
+		{
+			std::lock_guard lock{ m_mutex };
+			value = m_values.emplace_back(std::make_unique<T>()).get();
+			owner = m_id;
+		}
+		return *value;
+	}
+
+	// Not thread-safe, only once every thread is done
+	[[nodiscard]] const std::vector<std::unique_ptr<T>>& values() const { return m_values; }
+private:
+	static inline std::atomic<std::uint64_t> s_nextId = 1;
+
+	const std::uint64_t m_id = s_nextId++;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<T>> m_values;
+};
+
+/*
+	Counts of the matches of a scan instead of the matches themselves, for --group-by, --distinct and --count-by.
+	Matched entities are folded into a hash table of the matcher thread they're found on, keyed by the map or mod
+	they're in and their value of the grouping key, and the tables are merged when the report is printed.
+	With copies counted, for --dedup, matches are also keyed by their map, so the copies it didn't scan
+	can be counted again under their own scope when the tables are merged.
+*/
+class Aggregation
+{
+public:
+	enum class Scope
+	{
+		All,
+		Map,
+		Mod
+	};
+
+	// An empty key only counts by scope
+	Aggregation(std::string key, bool distinct, Scope scope, bool countCopies = false)
+		: m_key(std::move(key)), m_distinct(distinct), m_scope(scope), m_countCopies(countCopies) {}
+
+	[[nodiscard]] std::string scopeOf(const std::filesystem::path& map) const;
+	// What matches in the map are counted under, worked out once per map
+	[[nodiscard]] std::string keyOf(const std::filesystem::path& map) const;
+	// Thread-safe, entities without the grouping key aren't counted
+	void add(const std::string& mapKey, const Entity& entity);
+	// Not thread-safe, counts the matches of the original again for a copy of it that wasn't scanned
+	void addCopy(const std::filesystem::path& copy, const std::filesystem::path& original);
+
+	// Counts by value by scope, the value is empty when only counting by scope
+	using Counts = std::map<std::string, std::map<std::string, std::uint64_t>>;
+
+	// Not thread-safe, once the scan is done
+	[[nodiscard]] Counts merged() const;
+	void print(std::ostream& out, const Counts& counts) const;
+	[[nodiscard]] const std::string& key() const { return m_key; }
+private:
+	using Table = std::unordered_map<std::string, std::uint64_t>;
+
+	std::string m_key;
+	bool m_distinct;
+	Scope m_scope;
+	bool m_countCopies;
+	PerThread<Table> m_tables;
+	std::unordered_map<std::string, std::vector<std::string>> m_copyScopes;  // Of the copies of each original
+};
+
+/*
+	The K matches with the highest or lowest value of a numeric key, for --top and --bottom. Each matcher thread
+	keeps a heap of the best K matches it has come across with the worst of them on top, so a match is only copied
+	out of its map when it makes the cut. The heaps are merged when the report is printed. Ties are broken by map
+	and entity index, so the result doesn't depend on which thread matched what.
+*/
+class TopMatches
+{
+public:
+	struct Match
+	{
+		double value = 0.;
+		std::filesystem::path map;
+		EntityEntry entry;
+	};
+
+	bool valid = true;
+
+	// by is a key with an optional element index, e.g. origin[2]
+	TopMatches(std::size_t count, bool bottom, std::string_view by);
+
+	// Value matches are ranked by, none when the entity lacks the key or its value isn't numeric
+	[[nodiscard]] std::optional<double> valueOf(const Entity& entity) const;
+	// Thread-safe, whether a match would make the cut of the calling thread, counting it as ranked
+	[[nodiscard]] bool wants(double value, const std::filesystem::path& map, unsigned int index);
+	// Thread-safe, only for matches the calling thread wants
+	void add(double value, const std::filesystem::path& map, EntityEntry entry);
+
+	// Not thread-safe, once the scan is done. Best first
+	[[nodiscard]] std::vector<Match> merged() const;
+	[[nodiscard]] std::uint64_t rankedCount() const;
+
+	[[nodiscard]] const std::string& key() const { return m_key; }
+	[[nodiscard]] const std::string& by() const { return m_by; }
+	[[nodiscard]] std::size_t count() const { return m_count; }
+	[[nodiscard]] bool bottom() const { return m_bottom; }
+private:
+	struct Heap
+	{
+		std::vector<Match> matches;
+		std::uint64_t ranked = 0;
+	};
+
+	std::size_t m_count;
+	bool m_bottom;
+	std::string m_by, m_key;
+	bool m_elementAccess = false;
+	int m_index = 0;
+	PerThread<Heap> m_heaps;
+
+	[[nodiscard]] bool better(double value, const std::filesystem::path& map, unsigned int index, const Match& than) const;
+};
@@ -0,0 +1,59 @@
+#include <cstdint>
+#include <algorithm>
+#include "arena.h"
+
+
+static std::size_t alignUp(const std::size_t offset, const std::size_t alignment)
+{
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+
+MapArena::MapArena(const std::size_t capacity)
+    : m_block(std::make_unique<std::byte[]>(capacity)), m_capacity(capacity) {}
+
+void MapArena::reset()
+{
+    if (!m_overflow.empty())
+    {
+        // Grow the main block to fit the largest map seen so far, with some headroom
+        m_capacity = alignUp(m_used + m_used / 2, alignof(std::max_align_t));
+        m_block = std::make_unique<std::byte[]>(m_capacity);
+        m_overflow.clear();
+        m_overflowOffset = m_overflowCapacity = 0;
+    }
+
+    m_offset = 0;
+    m_used = 0;
+}
+
+void* MapArena::do_allocate(const std::size_t bytes, const std::size_t alignment)
+{
+    const auto base = reinterpret_cast<std::uintptr_t>(m_block.get());
+    if (const std::size_t offset = alignUp(base + m_offset, alignment) - base; offset + bytes <= m_capacity)
+    {
+        m_used += offset + bytes - m_offset;
+        m_offset = offset + bytes;
+        return m_block.get() + offset;
+    }
+
+    if (!m_overflow.empty())
+    {
+        const auto overflowBase = reinterpret_cast<std::uintptr_t>(m_overflow.back().get());
+        if (const std::size_t offset = alignUp(overflowBase + m_overflowOffset, alignment) - overflowBase;
+            offset + bytes <= m_overflowCapacity)
+        {
+            m_used += offset + bytes - m_overflowOffset;
+            m_overflowOffset = offset + bytes;
+            return m_overflow.back().get() + offset;
+        }
+    }
+
+    m_overflowCapacity = std::max(bytes + alignment, m_capacity);
+    m_overflow.push_back(std::make_unique<std::byte[]>(m_overflowCapacity));
+    const auto overflowBase = reinterpret_cast<std::uintptr_t>(m_overflow.back().get());
+    const std::size_t offset = alignUp(overflowBase, alignment) - overflowBase;
+    m_used += offset + bytes;
+    m_overflowOffset = offset + bytes;
+    return m_overflow.back().get() + offset;
+}
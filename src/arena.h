@@ -0,0 +1,36 @@
+#pragma once
+#include <memory>
+#include <vector>
+#include <cstddef>
+#include <memory_resource>
+
+
+/*
+	Monotonic arena for everything transient while scanning a single map: the entity lump,
+	the parsed entities and their escaped tokens. Deallocation is a no-op, reset() frees it all at once.
+	Requests that don't fit the main block spill into overflow chunks, and the next reset grows
+	the main block to the high-water mark, so after a few maps scanning runs without heap allocations.
+*/
+class MapArena final : public std::pmr::memory_resource
+{
+public:
+	static constexpr std::size_t c_initialCapacity = 256 * 1024;
+
+	explicit MapArena(std::size_t capacity = c_initialCapacity);
+
+	void reset();
+	[[nodiscard]] std::size_t capacity() const { return m_capacity; }
+	[[nodiscard]] std::size_t used() const { return m_used; }
+private:
+	std::unique_ptr<std::byte[]> m_block;
+	std::size_t m_capacity;
+	std::size_t m_offset = 0;
+	std::size_t m_used = 0;
+	std::vector<std::unique_ptr<std::byte[]>> m_overflow;
+	std::size_t m_overflowOffset = 0;
+	std::size_t m_overflowCapacity = 0;
+
+	void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+	void do_deallocate(void*, std::size_t, std::size_t) override {}
+	[[nodiscard]] bool do_is_equal(const memory_resource& other) const noexcept override { return this == &other; }
+};
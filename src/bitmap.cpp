@@ -0,0 +1,215 @@
+#include <bit>
+#include <iterator>
+#include <algorithm>
+#include "bitmap.h"
+
+
+using Container = EntityBitmap::Container;
+
+namespace
+{
+    enum class SetOperation { And, Or, AndNot };
+
+    std::vector<std::uint64_t> toBits(const Container& container)
+    {
+        if (!container.bits.empty())
+            return container.bits;
+
+        std::vector<std::uint64_t> bits(EntityBitmap::c_bitmapWords);
+        for (const std::uint16_t low : container.array)
+            bits[low >> 6] |= std::uint64_t{ 1 } << (low & 63);
+        return bits;
+    }
+
+    // Back to an array if it got sparse enough, the container is left empty when no bits are set
+    void shrink(Container& container)
+    {
+        if (container.bits.empty() || container.count() > EntityBitmap::c_maxArray)
+            return;
+
+        for (std::size_t word = 0; word < container.bits.size(); ++word)
+        {
+            for (std::uint64_t bits = container.bits[word]; bits; bits &= bits - 1)
+                container.array.push_back(static_cast<std::uint16_t>(word << 6 | std::countr_zero(bits)));
+        }
+        container.bits.clear();
+        container.bits.shrink_to_fit();
+    }
+
+    Container combine(const Container& a, const Container& b, const SetOperation operation)
+    {
+        Container result;
+        result.high = a.high;
+        if (a.bits.empty() && b.bits.empty())
+        {
+            const auto out = std::back_inserter(result.array);
+            if (operation == SetOperation::And)
+                std::ranges::set_intersection(a.array, b.array, out);
+            else if (operation == SetOperation::Or)
+                std::ranges::set_union(a.array, b.array, out);
+            else
+                std::ranges::set_difference(a.array, b.array, out);
+
+            if (result.array.size() > EntityBitmap::c_maxArray)
+            {
+                result.bits = toBits(result);
+                result.array.clear();
+            }
+            return result;
+        }
+
+        if (b.bits.empty() && operation == SetOperation::And)
+            return combine(b, a, operation);
+
+        // Only an array remains an array when anything is taken out of it
+        if (a.bits.empty() && operation != SetOperation::Or)
+        {
+            const std::vector<std::uint64_t>& bits = b.bits;
+            const bool keepSet = operation == SetOperation::And;
+            std::ranges::copy_if(a.array, std::back_inserter(result.array), [&bits, keepSet](const std::uint16_t low) {
+                return ((bits[low >> 6] >> (low & 63) & 1) != 0) == keepSet;
+            });
+            return result;
+        }
+
+        result.bits = toBits(a);
+        const std::vector<std::uint64_t> other = toBits(b);
+        for (std::size_t word = 0; word < result.bits.size(); ++word)
+        {
+            if (operation == SetOperation::And)
+                result.bits[word] &= other[word];
+            else if (operation == SetOperation::Or)
+                result.bits[word] |= other[word];
+            else
+                result.bits[word] &= ~other[word];
+        }
+        shrink(result);
+        return result;
+    }
+
+    bool isEmpty(const Container& container)
+    {
+        return container.array.empty() && std::ranges::all_of(container.bits, [](const std::uint64_t word) { return word == 0; });
+    }
+
+    // Walks both container lists in order of their high bits
+    std::vector<Container> merge(const std::vector<Container>& a, const std::vector<Container>& b, const SetOperation operation)
+    {
+        std::vector<Container> result;
+        auto first = a.begin(), second = b.begin();
+        while (first != a.end() || second != b.end())
+        {
+            if (second == b.end() || (first != a.end() && first->high < second->high))
+            {
+                if (operation != SetOperation::And)
+                    result.push_back(*first);
+                ++first;
+            }
+            else if (first == a.end() || second->high < first->high)
+            {
+                if (operation == SetOperation::Or)
+                    result.push_back(*second);
+                ++second;
+            }
+            else
+            {
+                if (Container combined = combine(*first, *second, operation); !isEmpty(combined))
+                    result.push_back(std::move(combined));
+                ++first;
+                ++second;
+            }
+        }
+        return result;
+    }
+}
+
+
+std::size_t Container::count() const
+{
+    if (bits.empty())
+        return array.size();
+
+    std::size_t set = 0;
+    for (const std::uint64_t word : bits)
+        set += static_cast<std::size_t>(std::popcount(word));
+    return set;
+}
+
+EntityBitmap EntityBitmap::fromSorted(const std::span<const std::uint64_t> refs)
+{
+    std::vector<Container> containers;
+    for (const std::uint64_t ref : refs)
+    {
+        const std::uint64_t high = ref >> 16;
+        const auto low = static_cast<std::uint16_t>(ref & 0xFFFF);
+        if (containers.empty() || containers.back().high != high)
+            containers.emplace_back().high = high;
+
+        Container& container = containers.back();
+        if (!container.bits.empty())
+        {
+            container.bits[low >> 6] |= std::uint64_t{ 1 } << (low & 63);
+            continue;
+        }
+        if (!container.array.empty() && container.array.back() == low)
+            continue;
+
+        container.array.push_back(low);
+        if (container.array.size() > c_maxArray)
+        {
+            container.bits = toBits(container);
+            container.array.clear();
+        }
+    }
+    return EntityBitmap{ std::move(containers) };
+}
+
+EntityBitmap& EntityBitmap::operator&=(const EntityBitmap& other)
+{
+    m_containers = merge(m_containers, other.m_containers, SetOperation::And);
+    return *this;
+}
+
+EntityBitmap& EntityBitmap::operator|=(const EntityBitmap& other)
+{
+    m_containers = merge(m_containers, other.m_containers, SetOperation::Or);
+    return *this;
+}
+
+EntityBitmap& EntityBitmap::operator-=(const EntityBitmap& other)
+{
+    m_containers = merge(m_containers, other.m_containers, SetOperation::AndNot);
+    return *this;
+}
+
+std::size_t EntityBitmap::count() const
+{
+    std::size_t set = 0;
+    for (const Container& container : m_containers)
+        set += container.count();
+    return set;
+}
+
+std::vector<std::uint64_t> EntityBitmap::toVector() const
+{
+    std::vector<std::uint64_t> refs;
+    refs.reserve(count());
+    forEach([&refs](const std::uint64_t ref) { refs.push_back(ref); });
+    return refs;
+}
+
+void EntityBitmap::forEach(const std::function<void(std::uint64_t ref)>& visit) const
+{
+    for (const Container& container : m_containers)
+    {
+        const std::uint64_t high = container.high << 16;
+        for (const std::uint16_t low : container.array)
+            visit(high | low);
+
+        for (std::size_t word = 0; word < container.bits.size(); ++word)
+        {
+            for (std::uint64_t bits = container.bits[word]; bits; bits &= bits - 1)
+                visit(high | word << 6 | static_cast<std::uint64_t>(std::countr_zero(bits)));
+        }
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <span>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+
+/*
+	Compressed set of 64-bit entity references, laid out like a Roaring bitmap: references are grouped
+	into containers by their upper 48 bits, and each container holds the lower 16 bits either as a sorted
+	array while it's sparse or as a 65536-bit bitmap once it has more than c_maxArray of them.
+	Set operations work container by container, so sets of entities from different maps never meet.
+*/
+class EntityBitmap
+{
+public:
+	static constexpr std::size_t c_maxArray = 4096;
+	static constexpr std::size_t c_bitmapWords = 65536 / 64;
+
+	struct Container
+	{
+		std::uint64_t high = 0;
+		std::vector<std::uint16_t> array;  // Sorted lower bits, when bits is empty
+		std::vector<std::uint64_t> bits;
+
+		[[nodiscard]] std::size_t count() const;
+	};
+
+	EntityBitmap() = default;
+	explicit EntityBitmap(std::vector<Container> containers) : m_containers(std::move(containers)) {}
+
+	// References have to be sorted, duplicates are kept once
+	static EntityBitmap fromSorted(std::span<const std::uint64_t> refs);
+
+	EntityBitmap& operator&=(const EntityBitmap& other);
+	EntityBitmap& operator|=(const EntityBitmap& other);
+	EntityBitmap& operator-=(const EntityBitmap& other);  // And not
+
+	[[nodiscard]] bool empty() const { return m_containers.empty(); }
+	[[nodiscard]] std::size_t count() const;
+	[[nodiscard]] std::vector<std::uint64_t> toVector() const;
+	void forEach(const std::function<void(std::uint64_t ref)>& visit) const;
+	[[nodiscard]] const std::vector<Container>& containers() const { return m_containers; }
+private:
+	std::vector<Container> m_containers;  // Sorted by high, never empty
+};
@@ -0,0 +1,121 @@
+#include <map>
+#include <unordered_map>
+#include <format>
+#include <fstream>
+#include <algorithm>
+#include "devices.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+
+namespace fs = std::filesystem;
+
+
+#ifdef __linux__
+static std::string readSysfs(const fs::path& path)
+{
+    std::ifstream file{ path };
+    std::string line;
+    std::getline(file, line);
+    return line;
+}
+
+// Partitions don't have a queue directory of their own, their disk is the parent in sysfs
+static bool isRotational(const unsigned int major, const unsigned int minor)
+{
+    const fs::path device = std::format("/sys/dev/block/{}:{}", major, minor);
+    for (const auto& queue : { device / "queue/rotational", device / "../queue/rotational" })
+    {
+        if (const std::string rotational = readSysfs(queue); !rotational.empty())
+            return rotational == "1";
+    }
+    return false;
+}
+
+static std::string deviceName(const unsigned int major, const unsigned int minor)
+{
+    std::ifstream uevent{ std::format("/sys/dev/block/{}:{}/uevent", major, minor) };
+    for (std::string line; std::getline(uevent, line);)
+    {
+        if (line.starts_with("DEVNAME="))
+            return line.substr(8);
+    }
+    return std::format("{}:{}", major, minor);
+}
+#endif
+
+
+std::vector<DeviceLane> Devices::groupByDevice(const std::vector<fs::path>& paths, const unsigned int queueDepth)
+{
+#ifdef _WIN32
+    DeviceLane lane{ "disk", false, queueDepth, {} };
+    lane.maps.resize(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i)
+        lane.maps[i] = i;
+    return { std::move(lane) };
+#else
+    TraceSpan span{ "devices" };
+
+    struct Entry
+    {
+        std::size_t index;
+        ino_t inode;
+    };
+    std::map<dev_t, std::vector<Entry>> devices;
+
+    // Every map in a directory is on its device, one stat per directory rather than a metadata round trip per map
+    std::unordered_map<fs::path, dev_t> directories;
+    for (std::size_t i = 0; i < paths.size(); ++i)
+    {
+        const auto [directory, inserted] = directories.try_emplace(paths[i].parent_path(), 0);
+        if (inserted)
+        {
+            // Directories that can't be stat'ed still go through a lane, the reader reports the error
+            struct stat info{};
+            const fs::path& dir = directory->first;
+            if (stat(dir.empty() ? "." : dir.c_str(), &info) == 0)
+                directory->second = info.st_dev;
+        }
+        devices[directory->second].push_back({ i, 0 });
+    }
+
+    std::vector<DeviceLane> lanes;
+    lanes.reserve(devices.size());
+    for (auto& [device, entries] : devices)
+    {
+        DeviceLane& lane = lanes.emplace_back();
+        lane.queueDepth = queueDepth;
+#ifdef __linux__
+        lane.name = deviceName(major(device), minor(device));
+        lane.rotational = isRotational(major(device), minor(device));
+#else
+        lane.name = std::to_string(device);
+#endif
+
+        // Only spinning disks need the inodes of the maps themselves
+        if (lane.rotational)
+        {
+            lane.queueDepth = std::min(queueDepth ? queueDepth : c_rotationalQueueDepth, c_rotationalQueueDepth);
+            for (Entry& entry : entries)
+            {
+                if (struct stat info{}; stat(paths[entry.index].c_str(), &info) == 0)
+                    entry.inode = info.st_ino;
+            }
+            std::ranges::stable_sort(entries, {}, &Entry::inode);
+        }
+
+        lane.maps.reserve(entries.size());
+        for (const Entry& entry : entries)
+            lane.maps.push_back(entry.index);
+    }
+
+    return lanes;
+#endif
+}
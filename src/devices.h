@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+
+
+// Maps on one storage device, in the order they should be read
+struct DeviceLane
+{
+	std::string name;
+	bool rotational = false;
+	unsigned int queueDepth = 0;
+	std::vector<std::size_t> maps;  // Indices into the scanned paths
+};
+
+/*
+	Groups maps by the device their directory lives on (st_dev), so every disk gets its own readers and
+	queue depth. Spinning disks get a shallow queue and their maps ordered by inode, which roughly follows
+	their layout on disk, instead of seeking back and forth between directories in path order.
+*/
+namespace Devices
+{
+	static constexpr unsigned int c_rotationalQueueDepth = 2;
+
+	std::vector<DeviceLane> groupByDevice(const std::vector<std::filesystem::path>& paths, unsigned int queueDepth);
+}
@@ -0,0 +1,878 @@
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <stdexcept>
+#include "io.h"
+#include "stats.h"
+#include "trace.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define MER_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+
+namespace fs = std::filesystem;
+using namespace BSPFormat;
+
+static constexpr unsigned c_maxWorkers = 64;
+
+
+static bool isSupportedVersion(const BspHeader& header)
+{
+    return header.version == 30 || header.version == 29;
+}
+
+static bool isValidLump(const BspLump& lump)
+{
+    return lump.offset >= 0 && lump.length >= 0;
+}
+
+// Lump lengths are only trusted up to the end of the file, any buffer is sized from the clamped length
+static void clampLumps(BspHeader& header, const std::int64_t fileSize)
+{
+    for (BspLump& lump : header.lumps)
+    {
+        if (lump.offset >= 0 && lump.length >= 0)
+            lump.length = static_cast<std::int32_t>(std::clamp<std::int64_t>(fileSize - lump.offset, 0, lump.length));
+    }
+}
+
+static bool hasModels(const BspHeader& header)
+{
+    const BspLump& lump = header.lumps[Models];
+    return lump.offset >= 0 && lump.length >= static_cast<std::int32_t>(sizeof(BspModel));
+}
+
+static bool hasTextures(const BspHeader& header)
+{
+    const BspLump& lump = header.lumps[Textures];
+    return lump.offset >= 0 && lump.length >= static_cast<std::int32_t>(sizeof(std::int32_t));
+}
+
+// The Textures lump starts with a count and the offsets of the textures in it, only the offsets that fit in the lump count
+static std::size_t textureCount(const BspLump& lump, const std::int32_t count)
+{
+    return static_cast<std::size_t>(std::clamp(count, 0, static_cast<std::int32_t>((lump.length - sizeof(count)) / sizeof(std::int32_t))));
+}
+
+static bool isTextureInLump(const BspLump& lump, const std::int32_t offset)
+{
+    return offset >= 0 && offset <= lump.length - static_cast<std::int32_t>(sizeof(BspMipTexture));
+}
+
+
+namespace
+{
+#ifdef _WIN32
+    class MapFile
+    {
+    public:
+        MapFile() = default;
+        explicit MapFile(const fs::path& path) { open(path); }
+
+        void open(const fs::path& path)
+        {
+            m_file.open(path, std::ios::binary);
+            if (!m_file.is_open() || !m_file.good())
+                throw std::runtime_error("Could not open file for reading");
+
+            m_file.seekg(0, std::ios::end);
+            m_size = static_cast<std::int64_t>(m_file.tellg());
+        }
+
+        [[nodiscard]] std::int64_t size() const { return m_size; }
+
+        std::size_t read(const std::int64_t offset, const std::size_t length, char* buffer)
+        {
+            m_file.clear();
+            m_file.seekg(offset, std::ios::beg);
+            m_file.read(buffer, static_cast<std::streamsize>(length));
+            return static_cast<std::size_t>(m_file.gcount());
+        }
+
+        void advise(std::int64_t, std::size_t) {}
+    private:
+        std::ifstream m_file;
+        std::int64_t m_size = 0;
+    };
+#else
+    class MapFile
+    {
+    public:
+        MapFile() = default;
+        explicit MapFile(const fs::path& path) { open(path); }
+        ~MapFile()
+        {
+            if (m_fd >= 0)
+                ::close(m_fd);
+        }
+        MapFile(const MapFile&) = delete;
+        MapFile& operator=(const MapFile&) = delete;
+
+        void open(const fs::path& path)
+        {
+            m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (m_fd < 0)
+                throw std::runtime_error("Could not open file for reading");
+        }
+
+        [[nodiscard]] std::int64_t size() const
+        {
+            struct stat status{};
+            if (::fstat(m_fd, &status) != 0)
+                throw std::runtime_error(std::string("Could not read file: ") + std::strerror(errno));
+            return static_cast<std::int64_t>(status.st_size);
+        }
+
+        std::size_t read(const std::int64_t offset, const std::size_t length, char* buffer) const
+        {
+            std::size_t total = 0;
+            while (total < length)
+            {
+                const ssize_t count = ::pread(m_fd, buffer + total, length - total, static_cast<off_t>(offset + total));
+                if (count == 0)
+                    break;
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::runtime_error(std::string("Could not read file: ") + std::strerror(errno));
+                }
+                total += static_cast<std::size_t>(count);
+            }
+            return total;
+        }
+
+        void advise(const std::int64_t offset, const std::size_t length) const
+        {
+            posix_fadvise(m_fd, static_cast<off_t>(offset), static_cast<off_t>(length), POSIX_FADV_WILLNEED);
+        }
+    private:
+        int m_fd = -1;
+    };
+#endif
+
+    void readModels(MapFile& file, MapBuffer& map)
+    {
+        const BspLump& lump = map.header.lumps[Models];
+        map.models.resize(lump.length / sizeof(BspModel));
+        const std::size_t length = file.read(lump.offset, map.models.size() * sizeof(BspModel), reinterpret_cast<char*>(map.models.data()));
+        map.models.resize(length / sizeof(BspModel));
+        g_stats.bytesRead += length;
+    }
+
+    void readTextures(MapFile& file, MapBuffer& map)
+    {
+        const BspLump& lump = map.header.lumps[Textures];
+        std::int32_t count = 0;
+        g_stats.bytesRead += file.read(lump.offset, sizeof(count), reinterpret_cast<char*>(&count));
+
+        std::vector<std::int32_t> offsets(textureCount(lump, count));
+        const std::size_t length = file.read(lump.offset + sizeof(count), offsets.size() * sizeof(std::int32_t), reinterpret_cast<char*>(offsets.data()));
+        offsets.resize(length / sizeof(std::int32_t));
+        g_stats.bytesRead += length;
+
+        // Only the name and mip offsets of each texture are read, never the pixels
+        map.textures.assign(offsets.size(), {});
+        for (std::size_t i = 0; i < offsets.size(); ++i)
+        {
+            if (isTextureInLump(lump, offsets[i]))
+                g_stats.bytesRead += file.read(std::int64_t{ lump.offset } + offsets[i], sizeof(BspMipTexture), reinterpret_cast<char*>(&map.textures[i]));
+        }
+    }
+
+    void readMapInto(const fs::path& path, MapBuffer& map, const MapExtras extras, const bool adviseLump = false)
+    {
+        MapFile file;
+        {
+            PhaseTimer timer{ Phase::Open, &path };
+            file.open(path);
+
+            map.header = {};
+            g_stats.bytesRead += file.read(0, sizeof(BspHeader), reinterpret_cast<char*>(&map.header));
+            clampLumps(map.header, file.size());
+        }
+
+        // Leave the version check and its error to the parser
+        if (!isSupportedVersion(map.header))
+            return;
+
+        const BspLump& lump = map.header.lumps[Entities];
+        if (!isValidLump(lump))
+            throw std::runtime_error("Invalid lump offset or length");
+
+        PhaseTimer timer{ Phase::Read, &path };
+        if (adviseLump)
+            file.advise(lump.offset, lump.length);
+        map.lump.resize(lump.length);
+        map.lump.resize(file.read(lump.offset, lump.length, map.lump.data()));
+        g_stats.bytesRead += map.lump.size();
+
+        if (extras.models && hasModels(map.header))
+            readModels(file, map);
+        if (extras.textures && hasTextures(map.header))
+            readTextures(file, map);
+    }
+}
+
+
+#ifdef MER_IO_URING
+/*
+	Minimal io_uring driven through the raw syscalls, every slot reads one map at a time:
+	openat, then the header, then the entity lump, then the models and texture headers when asked for,
+	with at most one request in flight per slot.
+*/
+struct IoEngine::Ring
+{
+    enum class Stage
+    {
+        Open,
+        Header,
+        Lump,
+        Models,
+        TextureCount,
+        TextureOffsets,
+        TextureHeader
+    };
+    struct Slot
+    {
+        Stage stage = Stage::Open;
+        int fd = -1;
+        std::int64_t fileSize = 0;
+        std::size_t lumpRead = 0;
+        std::int32_t textureCount = 0;
+        std::vector<std::int32_t> textureOffsets;
+        std::size_t texture = 0;  // Header being read
+        MapBuffer map;
+
+        // Opening takes the header read, reading the lumps after it, like the PhaseTimers of the thread pool
+        Phase phase = Phase::Open;
+        bool timing = false;
+        std::chrono::steady_clock::time_point phaseStart;
+    };
+
+    int fd = -1;
+    void* sqRing = MAP_FAILED;
+    void* cqRing = MAP_FAILED;
+    std::size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    io_uring_cqe* cqes = nullptr;
+    unsigned toSubmit = 0;
+
+    std::vector<Slot> slots;
+    std::vector<unsigned> freeSlots;
+
+    static std::unique_ptr<Ring> create(unsigned entries);
+    ~Ring();
+
+    [[nodiscard]] bool busy() const { return freeSlots.size() != slots.size(); }
+    void push(const io_uring_sqe& sqe);
+    void enter(unsigned minComplete);
+};
+
+std::unique_ptr<IoEngine::Ring> IoEngine::Ring::create(const unsigned entries)
+{
+    io_uring_params params{};
+    const int ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+    if (ringFd < 0)
+        return nullptr;
+
+    auto ring = std::make_unique<Ring>();
+    ring->fd = ringFd;
+
+    // IORING_OP_OPENAT and IORING_OP_READ arrived in the same kernel release as this feature
+    if (!(params.features & IORING_FEAT_RW_CUR_POS))
+        return nullptr;
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap)
+        ring->sqRingSize = ring->cqRingSize = std::max(ring->sqRingSize, ring->cqRingSize);
+
+    ring->sqRing = mmap(nullptr, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+    if (ring->sqRing == MAP_FAILED)
+        return nullptr;
+
+    if (!singleMmap)
+    {
+        ring->cqRing = mmap(nullptr, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+        if (ring->cqRing == MAP_FAILED)
+            return nullptr;
+    }
+
+    ring->sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES));
+    if (ring->sqes == MAP_FAILED)
+        return nullptr;
+
+    auto* sq = static_cast<char*>(ring->sqRing);
+    auto* cq = static_cast<char*>(singleMmap ? ring->sqRing : ring->cqRing);
+    ring->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    ring->slots.resize(entries);
+    for (unsigned slot = entries; slot > 0; --slot)
+        ring->freeSlots.push_back(slot - 1);
+
+    return ring;
+}
+
+IoEngine::Ring::~Ring()
+{
+    for (const Slot& slot : slots)
+    {
+        if (slot.fd >= 0)
+            ::close(slot.fd);
+    }
+
+    if (sqes != MAP_FAILED)
+        munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED)
+        munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+        munmap(sqRing, sqRingSize);
+    if (fd >= 0)
+        ::close(fd);
+}
+
+void IoEngine::Ring::push(const io_uring_sqe& sqe)
+{
+    // Only this thread writes the tail, the kernel picks it up on the next enter
+    const unsigned tail = *sqTail;
+    const unsigned index = tail & *sqMask;
+    sqes[index] = sqe;
+    sqArray[index] = index;
+    std::atomic_ref{ *sqTail }.store(tail + 1, std::memory_order_release);
+    ++toSubmit;
+}
+
+void IoEngine::Ring::enter(const unsigned minComplete)
+{
+    while (toSubmit || minComplete)
+    {
+        const int submitted = static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete,
+            minComplete ? IORING_ENTER_GETEVENTS : 0u, nullptr, 0));
+        if (submitted >= 0)
+        {
+            toSubmit -= static_cast<unsigned>(submitted);
+            return;
+        }
+        if (errno != EINTR)
+            throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+    }
+}
+#else
+struct IoEngine::Ring {};
+#endif
+
+
+IoEngine::IoEngine(std::vector<fs::path> paths, const unsigned queueDepth, const Backend backend, const bool adviseLumps,
+    const MapExtras extras)
+    : m_paths(std::move(paths)), m_queueDepth(queueDepth ? std::min(queueDepth, c_maxQueueDepth) : c_defaultQueueDepth),
+      m_adviseLumps(adviseLumps), m_extras(extras)
+{
+#ifdef MER_IO_URING
+    if (backend != Backend::ThreadPool)
+        m_ring = Ring::create(m_queueDepth);
+#endif
+
+    if (!m_ring)
+        startWorkers();
+}
+
+IoEngine::~IoEngine()
+{
+    {
+        std::lock_guard lock{ m_mutex };
+        m_stopping = true;
+    }
+    m_condition.notify_all();
+
+    for (auto& worker : m_workers)
+        worker.join();
+
+#ifdef MER_IO_URING
+    // The kernel may still be writing into our buffers, wait for everything in flight to land
+    if (m_ring)
+    {
+        try
+        {
+            while (m_ring->busy())
+            {
+                m_ring->enter(1);
+                reap();
+            }
+        }
+        catch (const std::runtime_error&) {}
+    }
+#endif
+}
+
+const char* IoEngine::backendName() const
+{
+    return m_ring ? "io_uring" : "thread pool";
+}
+
+MapBuffer IoEngine::readMap(const fs::path& path, const MapExtras extras)
+{
+    MapBuffer map;
+    try
+    {
+        readMapInto(path, map, extras);
+    }
+    catch (const std::runtime_error& e)
+    {
+        map.error = e.what();
+    }
+    return map;
+}
+
+std::size_t IoEngine::readRange(const fs::path& path, const std::int64_t offset, const std::size_t length, char* buffer)
+{
+    MapFile file{ path };
+    const std::size_t count = file.read(offset, length, buffer);
+    g_stats.bytesRead += count;
+    return count;
+}
+
+
+
+std::vector<char> IoEngine::takeLump()
+{
+    if (m_freeLumps.empty())
+        return {};
+
+    std::vector<char> lump = std::move(m_freeLumps.back());
+    m_freeLumps.pop_back();
+    return lump;
+}
+
+void IoEngine::recycle(MapBuffer& map)
+{
+    if (map.lump.capacity() && m_freeLumps.size() < m_queueDepth)
+        m_freeLumps.push_back(std::move(map.lump));
+
+    map.lump = {};
+    map.error.clear();
+}
+
+bool IoEngine::next(MapBuffer& map)
+{
+    std::unique_lock lock{ m_mutex };
+    recycle(map);
+
+#ifdef MER_IO_URING
+    if (m_ring)
+    {
+        try
+        {
+            if (!m_ringFailed)
+            {
+                reap();
+                while (true)
+                {
+                    // Keep the ring topped up, the kernel works on it while the caller parses what we hand out
+                    while (m_pending < m_queueDepth && m_nextIndex < m_paths.size())
+                        startRead(m_nextIndex++);
+
+                    if (!m_completed.empty())
+                    {
+                        m_ring->enter(0);
+                        break;
+                    }
+                    if (!m_ring->busy())
+                        return false;
+
+                            ++m_metrics.emptyWaits;
+                    m_ring->enter(1);
+                    reap();
+                }
+            }
+        }
+        catch (const std::runtime_error& e)
+        {
+            failRing(e.what());
+        }
+
+        // Once the ring failed, every map left was completed with its error
+        if (m_completed.empty())
+            return false;
+
+        deliver(map);
+        return true;
+    }
+#endif
+
+    if (m_delivered == m_paths.size())
+        return false;
+
+    // Claim a map before waiting so several consumers never wait on the same last one
+    ++m_delivered;
+    if (m_completed.empty())
+        ++m_metrics.emptyWaits;
+    m_condition.wait(lock, [this] { return !m_completed.empty(); });
+
+    deliver(map);
+    lock.unlock();
+    m_condition.notify_all();
+    return true;
+}
+
+void IoEngine::deliver(MapBuffer& map)
+{
+    // Occupancy counts the maps in flight or waiting to be picked up, including this one
+    ++m_metrics.pushes;
+    m_metrics.occupancySum += m_pending;
+    m_metrics.maxOccupancy = std::max<std::uint64_t>(m_metrics.maxOccupancy, m_pending);
+
+    map = std::move(m_completed.front());
+    m_completed.pop_front();
+    --m_pending;
+}
+
+QueueMetrics IoEngine::metrics()
+{
+    std::lock_guard lock{ m_mutex };
+    return m_metrics;
+}
+
+
+void IoEngine::startWorkers()
+{
+    const auto count = static_cast<unsigned>(std::min<std::size_t>({ m_queueDepth, m_paths.size(), c_maxWorkers }));
+    for (unsigned id = 1; id <= count; ++id)
+        m_workers.emplace_back(&IoEngine::worker, this, id);
+}
+
+void IoEngine::worker(const unsigned id)
+{
+    if (g_trace.enabled)
+        g_trace.setThreadName("io " + std::to_string(id));
+
+    while (true)
+    {
+        std::unique_lock lock{ m_mutex };
+        m_condition.wait(lock, [this] { return m_stopping || m_pending < m_queueDepth; });
+        if (m_stopping || m_nextIndex >= m_paths.size())
+            return;
+
+        MapBuffer map;
+        map.index = m_nextIndex++;
+        map.lump = takeLump();
+        ++m_pending;
+        lock.unlock();
+
+        try
+        {
+            TraceSpan span{ "read", &m_paths[map.index] };
+            readMapInto(m_paths[map.index], map, m_extras, m_adviseLumps);
+        }
+        catch (const std::runtime_error& e)
+        {
+            map.lump.clear();
+            map.models.clear();
+            map.textures.clear();
+            map.error = e.what();
+        }
+
+        lock.lock();
+        m_completed.push_back(std::move(map));
+        lock.unlock();
+        m_condition.notify_all();
+    }
+}
+
+
+#ifdef MER_IO_URING
+void IoEngine::startRead(const std::size_t index)
+{
+    const unsigned slotIndex = m_ring->freeSlots.back();
+    m_ring->freeSlots.pop_back();
+    ++m_pending;
+
+    Ring::Slot& slot = m_ring->slots[slotIndex];
+    slot.stage = Ring::Stage::Open;
+    slot.lumpRead = 0;
+    slot.texture = 0;
+    slot.map = {};
+    slot.map.index = index;
+    slot.phase = Phase::Open;
+    slot.timing = true;
+    slot.phaseStart = std::chrono::steady_clock::now();
+
+    io_uring_sqe sqe{};
+    sqe.opcode = IORING_OP_OPENAT;
+    sqe.fd = AT_FDCWD;
+    sqe.addr = reinterpret_cast<std::uint64_t>(m_paths[index].c_str());
+    sqe.open_flags = O_RDONLY | O_CLOEXEC;
+    sqe.user_data = slotIndex;
+    m_ring->push(sqe);
+}
+
+void IoEngine::failRing(const std::string& error)
+{
+    m_ringFailed = true;
+    const auto fail = [&](const std::size_t index) {
+        MapBuffer& map = m_completed.emplace_back();
+        map.index = index;
+        map.error = error;
+    };
+
+    // The kernel may still write into the buffers of the maps in flight, they're reported with fresh ones
+    std::vector<bool> inFlight(m_ring->slots.size(), true);
+    for (const unsigned slotIndex : m_ring->freeSlots)
+        inFlight[slotIndex] = false;
+
+    for (unsigned slotIndex = 0; slotIndex < inFlight.size(); ++slotIndex)
+    {
+        if (!inFlight[slotIndex])
+            continue;
+
+        Ring::Slot& slot = m_ring->slots[slotIndex];
+        if (slot.fd >= 0)
+            ::close(slot.fd);
+        slot.fd = -1;
+        fail(slot.map.index);
+    }
+
+    for (; m_nextIndex < m_paths.size(); ++m_nextIndex)
+    {
+        fail(m_nextIndex);
+        ++m_pending;
+    }
+}
+
+void IoEngine::reap()
+{
+    Ring& ring = *m_ring;
+    unsigned head = *ring.cqHead;
+    while (head != std::atomic_ref{ *ring.cqTail }.load(std::memory_order_acquire))
+    {
+        const io_uring_cqe& cqe = ring.cqes[head & *ring.cqMask];
+        const auto slotIndex = static_cast<unsigned>(cqe.user_data);
+        const int result = cqe.res;
+        std::atomic_ref{ *ring.cqHead }.store(++head, std::memory_order_release);
+
+        advance(slotIndex, result);
+    }
+}
+
+void IoEngine::advance(const unsigned slotIndex, const int result)
+{
+    Ring::Slot& slot = m_ring->slots[slotIndex];
+    MapBuffer& map = slot.map;
+
+    const auto endPhase = [&] {
+        if (slot.timing)
+            recordPhase(slot.phase, slot.phaseStart, &m_paths[map.index]);
+        slot.timing = false;
+    };
+    const auto finish = [&](const std::string& error = {}) {
+        endPhase();
+        if (!error.empty())
+        {
+            map.lump.clear();
+            map.models.clear();
+            map.textures.clear();
+            map.error = error;
+        }
+        if (slot.fd >= 0)
+            ::close(slot.fd);
+        slot.fd = -1;
+
+        m_completed.push_back(std::move(map));
+        m_ring->freeSlots.push_back(slotIndex);
+    };
+    const auto read = [&](char* buffer, const std::size_t length, const std::int64_t offset) {
+        io_uring_sqe sqe{};
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = slot.fd;
+        sqe.addr = reinterpret_cast<std::uint64_t>(buffer);
+        sqe.len = static_cast<std::uint32_t>(length);
+        sqe.off = static_cast<std::uint64_t>(offset);
+        sqe.user_data = slotIndex;
+        m_ring->push(sqe);
+    };
+
+    // Texture headers outside the lump are skipped and stay zeroed, the map is done after the last one
+    const auto readTextureHeader = [&] {
+        const BspLump& lump = map.header.lumps[Textures];
+        while (slot.texture < slot.textureOffsets.size() && !isTextureInLump(lump, slot.textureOffsets[slot.texture]))
+            ++slot.texture;
+        if (slot.texture == slot.textureOffsets.size())
+        {
+            finish();
+            return;
+        }
+
+        slot.stage = Ring::Stage::TextureHeader;
+        read(reinterpret_cast<char*>(&map.textures[slot.texture]), sizeof(BspMipTexture), std::int64_t{ lump.offset } + slot.textureOffsets[slot.texture]);
+    };
+    const auto readTextures = [&] {
+        if (!m_extras.textures || !hasTextures(map.header))
+        {
+            finish();
+            return;
+        }
+
+        slot.stage = Ring::Stage::TextureCount;
+        slot.textureCount = 0;
+        read(reinterpret_cast<char*>(&slot.textureCount), sizeof(slot.textureCount), map.header.lumps[Textures].offset);
+    };
+    const auto readModels = [&] {
+        if (!m_extras.models || !hasModels(map.header))
+        {
+            readTextures();
+            return;
+        }
+
+        const BspLump& lump = map.header.lumps[Models];
+        slot.stage = Ring::Stage::Models;
+        map.models.resize(lump.length / sizeof(BspModel));
+        read(reinterpret_cast<char*>(map.models.data()), map.models.size() * sizeof(BspModel), lump.offset);
+    };
+
+    if (result < 0 && slot.stage != Ring::Stage::Open)
+    {
+        finish(std::string("Could not read file: ") + std::strerror(-result));
+        return;
+    }
+
+    switch (slot.stage)
+    {
+    case Ring::Stage::Open:
+    {
+        if (result < 0)
+        {
+            finish("Could not open file for reading");
+            return;
+        }
+
+        slot.fd = result;
+        struct stat status{};
+        if (::fstat(slot.fd, &status) != 0)
+        {
+            finish(std::string("Could not read file: ") + std::strerror(errno));
+            return;
+        }
+
+        slot.fileSize = static_cast<std::int64_t>(status.st_size);
+        slot.stage = Ring::Stage::Header;
+        read(reinterpret_cast<char*>(&map.header), sizeof(BspHeader), 0);
+        return;
+    }
+    case Ring::Stage::Header:
+    {
+        g_stats.bytesRead += result;
+        clampLumps(map.header, slot.fileSize);
+        endPhase();
+
+        const BspLump& lump = map.header.lumps[Entities];
+        if (!isSupportedVersion(map.header))
+        {
+            finish();
+            return;
+        }
+        if (lump.length != 0 && !isValidLump(lump))
+        {
+            finish("Invalid lump offset or length");
+            return;
+        }
+
+        slot.phase = Phase::Read;
+        slot.timing = true;
+        slot.phaseStart = std::chrono::steady_clock::now();
+        if (lump.length == 0)
+        {
+            readModels();
+            return;
+        }
+
+        if (m_adviseLumps)
+            posix_fadvise(slot.fd, lump.offset, lump.length, POSIX_FADV_WILLNEED);
+
+        slot.stage = Ring::Stage::Lump;
+        map.lump = takeLump();
+        map.lump.resize(lump.length);
+        read(map.lump.data(), map.lump.size(), lump.offset);
+        return;
+    }
+    case Ring::Stage::Lump:
+    {
+        g_stats.bytesRead += result;
+        slot.lumpRead += static_cast<std::size_t>(result);
+
+        // Short reads only end at the end of the file, otherwise ask for the rest
+        if (result > 0 && slot.lumpRead < map.lump.size())
+        {
+            read(map.lump.data() + slot.lumpRead, map.lump.size() - slot.lumpRead, map.header.lumps[Entities].offset + slot.lumpRead);
+            return;
+        }
+
+        map.lump.resize(slot.lumpRead);
+        readModels();
+        return;
+    }
+    case Ring::Stage::Models:
+    {
+        g_stats.bytesRead += result;
+        map.models.resize(static_cast<std::size_t>(result) / sizeof(BspModel));
+        readTextures();
+        return;
+    }
+    case Ring::Stage::TextureCount:
+    {
+        g_stats.bytesRead += result;
+        const std::size_t count = result == sizeof(slot.textureCount) ? textureCount(map.header.lumps[Textures], slot.textureCount) : 0;
+        if (count == 0)
+        {
+            finish();
+            return;
+        }
+
+        slot.stage = Ring::Stage::TextureOffsets;
+        slot.textureOffsets.resize(count);
+        read(reinterpret_cast<char*>(slot.textureOffsets.data()), count * sizeof(std::int32_t), map.header.lumps[Textures].offset + sizeof(std::int32_t));
+        return;
+    }
+    case Ring::Stage::TextureOffsets:
+    {
+        g_stats.bytesRead += result;
+        slot.textureOffsets.resize(static_cast<std::size_t>(result) / sizeof(std::int32_t));
+        map.textures.assign(slot.textureOffsets.size(), {});
+        slot.texture = 0;
+        readTextureHeader();
+        return;
+    }
+    case Ring::Stage::TextureHeader:
+    {
+        g_stats.bytesRead += result;
+        ++slot.texture;
+        readTextureHeader();
+        return;
+    }
+    }
+}
+#endif
@@ -0,0 +1,92 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+#include <condition_variable>
+#include "mer.h"
+#include "queue.h"
+
+
+// Header and entity lump of a map as read from disk, or the reason it couldn't be read
+struct MapBuffer
+{
+	std::size_t index = 0;  // Position of the map in the list handed to the engine
+	BSPFormat::BspHeader header{};
+	std::vector<char> lump;
+	std::vector<BSPFormat::BspModel> models;  // Only read with MapExtras::models
+	std::vector<BSPFormat::BspMipTexture> textures;  // Only read with MapExtras::textures, zeroed where the offset is outside the lump
+	std::string error;
+};
+
+/*
+	Reads the headers and entity lumps of many maps ahead of the parser. On Linux the reads are
+	batched through io_uring, keeping up to queueDepth maps in flight, elsewhere or when io_uring
+	isn't available a pool of threads does blocking preads instead. The models and texture headers
+	some queries need are read the same way, right after the entity lump. Maps are handed out in
+	completion order, next() can be called from several threads.
+*/
+class IoEngine
+{
+public:
+	static constexpr unsigned c_defaultQueueDepth = 32;
+	static constexpr unsigned c_maxQueueDepth = 4096;
+
+	enum class Backend
+	{
+		Auto,
+		IoUring,
+		ThreadPool
+	};
+
+	// A queue depth of 0 picks c_defaultQueueDepth, adviseLumps hints the kernel to fetch each entity lump in one go
+	IoEngine(std::vector<std::filesystem::path> paths, unsigned queueDepth = c_defaultQueueDepth, Backend backend = Backend::Auto,
+		bool adviseLumps = false, MapExtras extras = {});
+	~IoEngine();
+	IoEngine(const IoEngine&) = delete;
+	IoEngine& operator=(const IoEngine&) = delete;
+
+	// Blocks until the next map has been read, the previous buffer in map is recycled
+	bool next(MapBuffer& map);
+	[[nodiscard]] const char* backendName() const;
+	[[nodiscard]] unsigned queueDepth() const { return m_queueDepth; }
+	[[nodiscard]] QueueMetrics metrics();
+
+	// Synchronous reads for single maps and the rare Blue Shift planes lump
+	static MapBuffer readMap(const std::filesystem::path& path, MapExtras extras = {});
+	static std::size_t readRange(const std::filesystem::path& path, std::int64_t offset, std::size_t length, char* buffer);
+private:
+	struct Ring;
+
+	std::vector<std::filesystem::path> m_paths;
+	unsigned m_queueDepth;
+	bool m_adviseLumps;
+	MapExtras m_extras;
+	std::unique_ptr<Ring> m_ring;
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<MapBuffer> m_completed;
+	std::vector<std::vector<char>> m_freeLumps;
+	std::vector<std::thread> m_workers;
+	std::size_t m_nextIndex = 0;
+	std::size_t m_delivered = 0;
+	unsigned m_pending = 0;  // Maps being read or waiting in m_completed
+	bool m_stopping = false;
+	bool m_ringFailed = false;  // After io_uring_enter failed, the maps left are reported with its error
+	QueueMetrics m_metrics;
+
+	void startWorkers();
+	void worker(unsigned id);
+	std::vector<char> takeLump();
+	void recycle(MapBuffer& map);
+	void deliver(MapBuffer& map);
+	void startRead(std::size_t index);
+	void failRing(const std::string& error);
+	void reap();
+	void advance(unsigned slotIndex, int result);
+};
@@ -0,0 +1,181 @@
+#include <ranges>
+#include "levelgraph.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+
+static const char* statusName(const LevelGraph::Link::Status status)
+{
+    switch (status)
+    {
+    case LevelGraph::Link::MissingMap:
+        return "missing map";
+    case LevelGraph::Link::UnreadableMap:
+        return "unreadable map";
+    case LevelGraph::Link::MissingLandmark:
+        return "missing landmark";
+    default:
+        return "ok";
+    }
+}
+
+
+std::string LevelGraph::levelName(const fs::path& map)
+{
+    const fs::path modDir = map.parent_path().parent_path();
+    return (modDir.parent_path().filename() / unSteampipe(modDir.filename().string()) / toLowerCase(map.stem().string())).generic_string();
+}
+
+void LevelGraph::add(const fs::path& map, const std::span<const Entity> entities)
+{
+    Level level;
+    for (const Entity& entity : entities)
+    {
+        if (!entity.contains("classname"))
+            continue;
+
+        const std::string_view classname = entity.at("classname");
+        if (classname == "trigger_changelevel" && entity.contains("map") && !entity.at("map").empty())
+        {
+            const std::string landmark{ entity.contains("landmark") ? entity.at("landmark") : "" };
+            level.transitions.emplace(toLowerCase(std::string(entity.at("map"))), landmark);
+        }
+        else if (classname == "info_landmark" && entity.contains("targetname"))
+            level.landmarks.emplace(entity.at("targetname"));
+    }
+
+    const std::string name = levelName(map);
+    std::lock_guard lock{ m_mutex };
+    Level& merged = m_levels[name];
+    merged.transitions.merge(level.transitions);
+    merged.landmarks.merge(level.landmarks);
+}
+
+void LevelGraph::addCopy(const fs::path& copy, const fs::path& original)
+{
+    std::string copyName = levelName(copy);
+    std::string originalName = levelName(original);
+    if (copyName == originalName)
+        return;
+
+    std::lock_guard lock{ m_mutex };
+    m_copies.emplace(std::move(copyName), std::move(originalName));
+}
+
+void LevelGraph::addUnreadable(const fs::path& map)
+{
+    std::string name = levelName(map);
+    std::lock_guard lock{ m_mutex };
+    m_unreadable.insert(std::move(name));
+}
+
+std::map<std::string, LevelGraph::Level> LevelGraph::withCopies() const
+{
+    if (m_copies.empty())
+        return m_levels;
+
+    std::map<std::string, Level> levels = m_levels;
+    for (const auto& [copy, original] : m_copies)
+    {
+        Level& merged = levels[copy];
+        if (const auto found = m_levels.find(original); found != m_levels.end())
+        {
+            merged.transitions.insert(found->second.transitions.begin(), found->second.transitions.end());
+            merged.landmarks.insert(found->second.landmarks.begin(), found->second.landmarks.end());
+        }
+    }
+    return levels;
+}
+
+std::size_t LevelGraph::levelCount() const
+{
+    std::lock_guard lock{ m_mutex };
+    return withCopies().size();
+}
+
+std::vector<LevelGraph::Link> LevelGraph::links() const
+{
+    std::lock_guard lock{ m_mutex };
+    const std::map<std::string, Level> all = withCopies();
+
+    std::vector<Link> found;
+    for (const auto& [name, level] : all)
+    {
+        // Destinations are in the same game and mod as the map leading there
+        const std::string modDir = name.substr(0, name.rfind('/') + 1);
+        for (const auto& [map, landmark] : level.transitions)
+        {
+            Link& link = found.emplace_back(name, modDir + map, landmark);
+            const auto destination = all.find(link.to);
+            if (destination == all.end())
+                link.status = m_unreadable.contains(link.to) ? Link::UnreadableMap : Link::MissingMap;
+            else if (!landmark.empty() && !destination->second.landmarks.contains(landmark))
+                link.status = Link::MissingLandmark;
+        }
+    }
+    return found;
+}
+
+void LevelGraph::write(std::ostream& out, const Format format) const
+{
+    const std::vector<Link> found = links();
+
+    std::set<std::string> levels;
+    {
+        std::lock_guard lock{ m_mutex };
+        const std::map<std::string, Level> all = withCopies();
+        for (const std::string& name : all | std::views::keys)
+            levels.insert(name);
+    }
+
+    if (format == Format::Json)
+        writeJson(out, found, levels);
+    else
+        writeDot(out, found, levels);
+}
+
+void LevelGraph::writeDot(std::ostream& out, const std::vector<Link>& links, const std::set<std::string>& levels)
+{
+    out << "digraph levels {\n";
+    for (const std::string& level : levels)
+        out << "  \"" << jsonEscape(level) << "\";\n";
+
+    // Maps that were never found or couldn't be read only show up as the destination of broken links
+    for (const Link& link : links)
+    {
+        if (link.status == Link::MissingMap && !levels.contains(link.to))
+            out << "  \"" << jsonEscape(link.to) << "\" [style=dashed, color=red];\n";
+        else if (link.status == Link::UnreadableMap)
+            out << "  \"" << jsonEscape(link.to) << "\" [style=dashed, color=orange];\n";
+    }
+
+    for (const Link& link : links)
+    {
+        out << "  \"" << jsonEscape(link.from) << "\" -> \"" << jsonEscape(link.to) << "\" [label=\"" << jsonEscape(link.landmark) << '"';
+        if (link.status != Link::Ok)
+            out << ", color=red, tooltip=\"" << statusName(link.status) << '"';
+        out << "];\n";
+    }
+    out << "}\n";
+}
+
+void LevelGraph::writeJson(std::ostream& out, const std::vector<Link>& links, const std::set<std::string>& levels)
+{
+    out << R"({"maps":[)";
+    bool first = true;
+    for (const std::string& level : levels)
+    {
+        out << (first ? "" : ",") << '"' << jsonEscape(level) << '"';
+        first = false;
+    }
+
+    out << R"(],"links":[)";
+    for (std::size_t i = 0; i < links.size(); ++i)
+    {
+        const Link& link = links[i];
+        out << (i ? "," : "") << R"({"from":")" << jsonEscape(link.from) << R"(","to":")" << jsonEscape(link.to)
+            << R"(","landmark":")" << jsonEscape(link.landmark) << R"(","status":")" << statusName(link.status) << "\"}";
+    }
+    out << "]}\n";
+}
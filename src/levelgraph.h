@@ -0,0 +1,75 @@
+#pragma once
+#include <set>
+#include <map>
+#include <span>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <ostream>
+#include <filesystem>
+#include "mer.h"
+
+
+/*
+	Level transitions of a set of maps for the graph subcommand. Each trigger_changelevel leads to the map
+	in its map key, and arrives at the info_landmark of that map named in its landmark key. Maps are added
+	from the scan threads as they're parsed, keeping only their transitions and landmarks, and the links
+	are joined against all of them once the scan is done. Maps are named game/mod/map, so their copies
+	in the SteamPipe folders of a mod are one level. Copies that weren't parsed, like those --dedup skips,
+	are added as such and take the transitions and landmarks of their original. Maps that couldn't be read
+	are only added by name, so links to them are told apart from links to maps that don't exist.
+*/
+class LevelGraph
+{
+public:
+	enum class Format
+	{
+		Dot,
+		Json
+	};
+
+	struct Link
+	{
+		enum Status
+		{
+			Ok,
+			MissingMap,
+			UnreadableMap,
+			MissingLandmark
+		};
+
+		std::string from, to;
+		std::string landmark;  // Empty when the transition has none
+		Status status = Ok;
+	};
+
+	// Thread-safe
+	void add(const std::filesystem::path& map, std::span<const Entity> entities);
+	void addCopy(const std::filesystem::path& copy, const std::filesystem::path& original);
+	void addUnreadable(const std::filesystem::path& map);
+
+	// Sorted by the map they leave, broken links flagged
+	[[nodiscard]] std::vector<Link> links() const;
+	[[nodiscard]] std::size_t levelCount() const;
+	void write(std::ostream& out, Format format) const;
+
+	// game/mod/map of a map file, without the SteamPipe suffix and in lowercase like the engine looks it up
+	static std::string levelName(const std::filesystem::path& map);
+private:
+	struct Level
+	{
+		std::set<std::pair<std::string, std::string>> transitions;  // Destination map and landmark
+		std::set<std::string> landmarks;
+	};
+
+	mutable std::mutex m_mutex;
+	std::map<std::string, Level> m_levels;
+	std::set<std::pair<std::string, std::string>> m_copies;  // Level of a copy and of its original
+	std::set<std::string> m_unreadable;  // Levels of maps that couldn't be read
+
+	// With the copies, called with the mutex held
+	[[nodiscard]] std::map<std::string, Level> withCopies() const;
+
+	static void writeDot(std::ostream& out, const std::vector<Link>& links, const std::set<std::string>& levels);
+	static void writeJson(std::ostream& out, const std::vector<Link>& links, const std::set<std::string>& levels);
+};
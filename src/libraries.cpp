@@ -0,0 +1,189 @@
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <optional>
+#include <algorithm>
+#include "logging.h"
+#include "libraries.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
+
+
+namespace
+{
+    enum class TokenType { String, Open, Close };
+
+    // Splits KeyValues text into quoted or bare strings and braces, dropping comments and [$PLATFORM] conditionals
+    class VdfLexer
+    {
+    public:
+        explicit VdfLexer(const std::string_view text) : m_text(text) {}
+
+        bool next(TokenType& type, std::string& value)
+        {
+            while (m_cursor < m_text.size())
+            {
+                const char c = m_text[m_cursor];
+                if (std::isspace(static_cast<unsigned char>(c)))
+                {
+                    ++m_cursor;
+                    continue;
+                }
+                if (m_text.substr(m_cursor).starts_with("//"))
+                {
+                    const std::size_t lineEnd = m_text.find('\n', m_cursor);
+                    m_cursor = lineEnd == std::string_view::npos ? m_text.size() : lineEnd + 1;
+                    continue;
+                }
+                if (c == '[')
+                {
+                    const std::size_t end = m_text.find(']', m_cursor);
+                    m_cursor = end == std::string_view::npos ? m_text.size() : end + 1;
+                    continue;
+                }
+
+                ++m_cursor;
+                if (c == '{' || c == '}')
+                {
+                    type = c == '{' ? TokenType::Open : TokenType::Close;
+                    return true;
+                }
+
+                type = TokenType::String;
+                value.clear();
+                if (c == '"')
+                    readQuoted(value);
+                else
+                    readBare(c, value);
+                return true;
+            }
+            return false;
+        }
+    private:
+        std::string_view m_text;
+        std::size_t m_cursor = 0;
+
+        void readQuoted(std::string& value)
+        {
+            while (m_cursor < m_text.size() && m_text[m_cursor] != '"')
+            {
+                char c = m_text[m_cursor++];
+                if (c == '\\' && m_cursor < m_text.size())
+                {
+                    c = m_text[m_cursor++];
+                    if (c == 'n')
+                        c = '\n';
+                    else if (c == 't')
+                        c = '\t';
+                }
+                value += c;
+            }
+            ++m_cursor;  // Closing quote
+        }
+
+        void readBare(const char first, std::string& value)
+        {
+            value += first;
+            while (m_cursor < m_text.size())
+            {
+                const char c = m_text[m_cursor];
+                if (std::isspace(static_cast<unsigned char>(c)) || c == '"' || c == '{' || c == '}')
+                    break;
+                value += c;
+                ++m_cursor;
+            }
+        }
+    };
+
+    bool isNumber(const std::string& str)
+    {
+        return !str.empty() && std::ranges::all_of(str, [](const char c) { return c >= '0' && c <= '9'; });
+    }
+}
+
+
+std::vector<fs::path> SteamLibraries::parseLibraryFolders(const std::string_view vdf)
+{
+    std::vector<fs::path> libraries;
+    std::vector<std::string> blocks;
+    std::optional<std::string> key;
+
+    VdfLexer lexer{ vdf };
+    TokenType type;
+    std::string value;
+    while (lexer.next(type, value))
+    {
+        if (type == TokenType::Open)
+        {
+            blocks.push_back(toLowerCase(key.value_or("")));
+            key.reset();
+            continue;
+        }
+        if (type == TokenType::Close)
+        {
+            if (!blocks.empty())
+                blocks.pop_back();
+            key.reset();
+            continue;
+        }
+
+        if (!key)
+        {
+            key = std::move(value);
+            continue;
+        }
+
+        if (!blocks.empty() && blocks.front() == "libraryfolders")
+        {
+            // "libraryfolders" { "1" "D:\\Games" } in older files, "libraryfolders" { "1" { "path" "D:\\Games" } } now
+            if (blocks.size() == 1 && isNumber(*key))
+                libraries.emplace_back(value);
+            else if (blocks.size() == 2 && isNumber(blocks.back()) && toLowerCase(*key) == "path")
+                libraries.emplace_back(value);
+        }
+        key.reset();
+    }
+
+    return libraries;
+}
+
+std::vector<fs::path> SteamLibraries::findCommonDirs(const fs::path& steamDir)
+{
+    std::vector<fs::path> commonDirs;
+    const auto addLibrary = [&commonDirs](const fs::path& library) {
+        const fs::path commonDir = library / "steamapps/common";
+        std::error_code error;
+        if (!fs::is_directory(commonDir, error))
+        {
+            logger.warning("Steam library \"" + library.string() + "\" has no steamapps/common directory");
+            return;
+        }
+
+        // The library Steam itself is installed in is usually listed as well
+        for (const auto& existing : commonDirs)
+        {
+            if (fs::equivalent(existing, commonDir, error))
+                return;
+        }
+        commonDirs.push_back(commonDir);
+    };
+
+    addLibrary(steamDir);
+    for (const auto& vdfPath : { steamDir / "steamapps/libraryfolders.vdf", steamDir / "config/libraryfolders.vdf" })
+    {
+        std::ifstream file{ vdfPath };
+        if (!file.is_open())
+            continue;
+
+        std::stringstream contents;
+        contents << file.rdbuf();
+        for (const auto& library : parseLibraryFolders(contents.str()))
+            addLibrary(library);
+        break;
+    }
+
+    return commonDirs;
+}
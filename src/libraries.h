@@ -0,0 +1,19 @@
+#pragma once
+#include <vector>
+#include <string_view>
+#include <filesystem>
+
+
+/*
+	Steam can install games into several library folders, typically one per drive. They're listed in
+	steamapps/libraryfolders.vdf, a Valve KeyValues text file which is either the current format with
+	a "path" key in a block per library, or the older one with the path as the value of a numbered key.
+*/
+namespace SteamLibraries
+{
+	// Library root directories listed in the contents of a libraryfolders.vdf, in file order
+	std::vector<std::filesystem::path> parseLibraryFolders(std::string_view vdf);
+
+	// The steamapps/common directory of every library, starting with the one in steamDir itself
+	std::vector<std::filesystem::path> findCommonDirs(const std::filesystem::path& steamDir);
+}
@@ -1,10 +1,26 @@
+#include <map>
+#include <set>
+#include <format>
+#include <ranges>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <charconv>
+#include <cstdio>
 #include <cstring>
 #include <csignal>
 #include "logging.h"
 #include "utils.h"
 #include "mer.h"
+#include "stats.h"
+#include "trace.h"
+#include "memstats.h"
+#include "shard.h"
+#include "watch.h"
+#include "mapindex.h"
+#include "levelgraph.h"
+#include "aggregation.h"
+#include "sampling.h"
 
 int _CRT_glob = 0;
 
@@ -16,6 +32,45 @@ using namespace Styling;
 static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
 
 
+// Reads the positive count following argv[i], exits if it's missing or invalid
+static unsigned int readCountArg(const int argc, char* argv[], int& i)
+{
+    ++i;
+    if (i >= argc)
+    {
+        logger.error("Missing number parameter for %s argument", argv[i - 1]);
+        exit(EXIT_FAILURE);
+    }
+
+    const int count = atoi(argv[i]);
+    if (count <= 0)
+    {
+        logger.error("%s is not a valid number for %s", argv[i], argv[i - 1]);
+        exit(EXIT_FAILURE);
+    }
+    return static_cast<unsigned int>(count);
+}
+
+static std::uint64_t readSeedArg(const int argc, char* argv[], int& i)
+{
+    ++i;
+    if (i >= argc)
+    {
+        logger.error("Missing number parameter for %s argument", argv[i - 1]);
+        exit(EXIT_FAILURE);
+    }
+
+    // Any 64-bit value is a seed, 0 included, but nothing may follow it
+    std::uint64_t seed = 0;
+    const char* end = argv[i] + strlen(argv[i]);
+    if (const auto [last, error] = std::from_chars(argv[i], end, seed); error != std::errc{} || last != end)
+    {
+        logger.error("%s is not a valid number for %s", argv[i], argv[i - 1]);
+        exit(EXIT_FAILURE);
+    }
+    return seed;
+}
+
 static void handleArgs(const int argc, char* argv[])
 {
     // Eager args
@@ -34,6 +89,15 @@ static void handleArgs(const int argc, char* argv[])
     }
 
     int verbosity = 0;
+    std::string aggregateKey;
+    bool aggregate = false, distinct = false;
+    Aggregation::Scope aggregateScope = Aggregation::Scope::All;
+    std::size_t rankCount = 0;
+    bool rankBottom = false;
+    const char* rankBy = nullptr;
+    double sampleFraction = 1.;
+    std::uint64_t sampleSeed = 0;
+    bool sample = false;
 
     Query* currentQuery = nullptr;
     for (int i = 1; i < argc; ++i)
@@ -86,6 +150,233 @@ static void handleArgs(const int argc, char* argv[])
             continue;
         }
 
+        if (strcmp(argv[i], "--dedup") == 0)
+        {
+            g_options.dedup = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--effective") == 0)
+        {
+            g_options.effective = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--shard") == 0)
+        {
+            ++i;
+            if (i >= argc)
+            {
+                logger.error("Missing I/N parameter for %s argument", argv[i - 1]);
+                exit(EXIT_FAILURE);
+            }
+
+            unsigned int index = 0, count = 0;
+            char end = '\0';
+            if (sscanf(argv[i], "%u/%u%c", &index, &count, &end) != 2 || index >= count || count > Shards::c_maxShards)
+            {
+                logger.error("%s is not a valid shard for %s, expected e.g. 0/4 for the first of 4 shards", argv[i], argv[i - 1]);
+                exit(EXIT_FAILURE);
+            }
+            g_options.shardIndex = index;
+            g_options.shardCount = count;
+            g_options.showProgress = false;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--files-from") == 0)
+        {
+            ++i;
+            if (i < argc)
+            {
+                g_options.filesFrom = argv[i];
+                g_options.listedMaps = true;
+                continue;
+            }
+
+            logger.error("Missing file parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--watch") == 0)
+        {
+            g_options.watch = true;
+            continue;
+        }
+
+        if (i == 1 && strcmp(argv[i], "graph") == 0)
+        {
+            g_options.levelGraph = std::make_shared<LevelGraph>();
+            g_options.showProgress = false;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--format") == 0)
+        {
+            ++i;
+            if (i < argc && (strcmp(argv[i], "dot") == 0 || strcmp(argv[i], "json") == 0))
+            {
+                g_options.graphJson = strcmp(argv[i], "json") == 0;
+                continue;
+            }
+
+            logger.error("Missing dot or json parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--dangling-targets") == 0)
+        {
+            g_options.danglingTargets = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--group-by") == 0 || strcmp(argv[i], "--distinct") == 0)
+        {
+            ++i;
+            if (i < argc)
+            {
+                if (!aggregateKey.empty())
+                {
+                    logger.error("Only one of --group-by and --distinct can be given");
+                    exit(EXIT_FAILURE);
+                }
+                aggregateKey = argv[i];
+                distinct = strcmp(argv[i - 1], "--distinct") == 0;
+                aggregate = true;
+                continue;
+            }
+
+            logger.error("Missing key parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--count-by") == 0)
+        {
+            ++i;
+            if (i < argc && (strcmp(argv[i], "map") == 0 || strcmp(argv[i], "mod") == 0))
+            {
+                aggregateScope = strcmp(argv[i], "map") == 0 ? Aggregation::Scope::Map : Aggregation::Scope::Mod;
+                aggregate = true;
+                continue;
+            }
+
+            logger.error("Missing map or mod parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--top") == 0 || strcmp(argv[i], "--bottom") == 0)
+        {
+            if (rankCount)
+            {
+                logger.error("Only one of --top and --bottom can be given");
+                exit(EXIT_FAILURE);
+            }
+            rankBottom = strcmp(argv[i], "--bottom") == 0;
+            rankCount = readCountArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--by") == 0)
+        {
+            ++i;
+            if (i < argc)
+            {
+                rankBy = argv[i];
+                continue;
+            }
+
+            logger.error("Missing key parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--sample") == 0)
+        {
+            ++i;
+            if (i >= argc)
+            {
+                logger.error("Missing fraction parameter for %s argument", argv[i - 1]);
+                exit(EXIT_FAILURE);
+            }
+
+            sampleFraction = MapSample::parseFraction(argv[i]);
+            if (std::isnan(sampleFraction))
+            {
+                logger.error("%s is not a valid fraction for %s, expected e.g. 0.05 or 5%%", argv[i], argv[i - 1]);
+                exit(EXIT_FAILURE);
+            }
+            sample = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--seed") == 0)
+        {
+            sampleSeed = readSeedArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--estimate") == 0)
+        {
+            g_options.estimate = true;
+            continue;
+        }
+
+        if (strcmp(argv[i], "--index") == 0 || strcmp(argv[i], "--build-index") == 0)
+        {
+            ++i;
+            if (i < argc)
+            {
+                g_options.indexFile = argv[i];
+                g_options.buildIndex = strcmp(argv[i - 1], "--build-index") == 0;
+                continue;
+            }
+
+            logger.error("Missing file parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp(argv[i], "--queue-depth") == 0)
+        {
+            g_options.queueDepth = readCountArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--io-threads") == 0)
+        {
+            g_options.ioThreads = readCountArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--parse-threads") == 0)
+        {
+            g_options.parseThreads = readCountArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--match-threads") == 0)
+        {
+            g_options.matchThreads = readCountArg(argc, argv, i);
+            continue;
+        }
+
+        if (strcmp(argv[i], "--stats") == 0)
+        {
+            g_stats.enable();
+            continue;
+        }
+
+        if (strcmp(argv[i], "--trace") == 0)
+        {
+            ++i;
+            if (i < argc)
+            {
+                g_trace.enable(argv[i]);
+                continue;
+            }
+
+            logger.error("Missing file parameter for %s argument", argv[i - 1]);
+            exit(EXIT_FAILURE);
+        }
+
         if (currentQuery && strcmp(toLowerCase(argv[i]).c_str(), "or") == 0)
             continue;
         if (currentQuery && strcmp(toLowerCase(argv[i]).c_str(), "and") == 0)
@@ -108,7 +399,8 @@ static void handleArgs(const int argc, char* argv[])
     }
 
 
-    if (g_options.steamDir.empty())
+    // Listed maps don't need a Steam directory, and asking for one would eat the list on stdin
+    if (g_options.steamDir.empty() && g_options.filesFrom.empty())
         g_options.steamDir = getSteamDir();
 
     if (std::filesystem::is_directory(g_options.steamDir / "steamapps/common"))
@@ -123,6 +415,86 @@ static void handleArgs(const int argc, char* argv[])
         logger.setLevel(Logging::LogLevel::Warning);
 
 
+    if (g_options.watch && g_options.shardCount)
+    {
+        logger.error("--watch can't be combined with --shard");
+        exit(EXIT_FAILURE);
+    }
+
+    // Partial results and deltas are made of individual matches, which aggregates don't keep
+    if (aggregate)
+    {
+        if (g_options.watch || g_options.shardCount || g_options.levelGraph)
+        {
+            logger.error("--group-by, --distinct and --count-by can't be combined with --watch, --shard or graph");
+            exit(EXIT_FAILURE);
+        }
+        g_options.aggregation = std::make_shared<Aggregation>(aggregateKey, distinct, aggregateScope, g_options.dedup);
+    }
+
+    if (rankCount || rankBy)
+    {
+        if (!rankCount || !rankBy)
+        {
+            logger.error("--top and --bottom need a --by KEY to rank matches by, and --by needs one of them");
+            exit(EXIT_FAILURE);
+        }
+        if (aggregate || g_options.watch || g_options.shardCount || g_options.levelGraph)
+        {
+            logger.error("--top and --bottom can't be combined with aggregates, --watch, --shard or graph");
+            exit(EXIT_FAILURE);
+        }
+
+        g_options.topMatches = std::make_shared<TopMatches>(rankCount, rankBottom, rankBy);
+        if (!g_options.topMatches->valid)
+        {
+            logger.error("%s is not a valid key for --by, expected e.g. health or origin[2]", rankBy);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Estimates need the number of maps in each mod up front, and count the matches of every map
+    if (sample || g_options.estimate)
+    {
+        if (aggregate || rankCount || g_options.watch || g_options.shardCount || g_options.levelGraph || !g_options.filesFrom.empty())
+        {
+            logger.error("--sample and --estimate can't be combined with aggregates, --top, --bottom, --watch, --shard, --files-from or graph");
+            exit(EXIT_FAILURE);
+        }
+        g_options.sample = std::make_shared<MapSample>(sampleFraction, sampleSeed);
+    }
+
+    // The graph comes from every trigger_changelevel and info_landmark, anything left over is a mod
+    if (g_options.levelGraph)
+    {
+        if (!g_options.queries.empty() || g_options.watch || g_options.shardCount)
+        {
+            logger.error("graph takes no search queries, --watch or --shard");
+            exit(EXIT_FAILURE);
+        }
+        if (g_options.mods.empty())
+            g_options.globalSearch = true;
+        if (logger.getLevel() > Logging::LogLevel::Warning)
+            logger.setLevel(Logging::LogLevel::Warning);
+        return;
+    }
+
+    // The interactive prompts would read from the same stdin as the map list
+    if (g_options.queries.empty() && !g_options.filesFrom.empty() && !g_options.buildIndex && !g_options.danglingTargets && !aggregate && !rankCount)
+    {
+        logger.error("Search queries are required with --files-from");
+        exit(EXIT_FAILURE);
+    }
+
+    // Building an index scans every map anyway, queries are only evaluated along the way if there are any,
+    // and dangling targets are looked for, aggregates taken and matches ranked over every entity unless queries narrow them down
+    if (g_options.queries.empty() && (g_options.buildIndex || g_options.danglingTargets || aggregate || rankCount))
+    {
+        if (g_options.mods.empty())
+            g_options.globalSearch = true;
+        return;
+    }
+
     if (g_options.queries.empty())
     {
         g_options.interactiveMode = true;
@@ -203,99 +575,488 @@ static void handleArgs(const int argc, char* argv[])
         g_options.globalSearch = true;
 }
 
-extern "C" void signalHandler(int sig)
+// Prints a matched entity, marked in the --watch deltas with + for new, - for removed and ~ for changed matches
+static void printEntry(const EntityEntry& entry, const char marker = ' ')
 {
-    g_receivedSignal.store(sig);
+    const auto& [matched, index, flags, classname, targetname, queryMatches, fullEnt] = entry;
+    if (g_options.printFullEnt)
+    {
+        std::cout << "// ";
+        if (marker != ' ')
+            std::cout << marker << ' ';
+        std::cout << "Matched term(s): " << queryMatches << ":\n{\n";
+        for (const auto& [key, value] : fullEnt)
+            std::cout << '"' << key << "\" \"" << value << "\"\n";
+
+        std::cout << "}\n";
+        return;
+    }
+
+    std::cout << marker << ' ' << classname << " (index " << index;
+    if (!targetname.empty())
+        std::cout << ", targetname '" << targetname << "'";
+    if (!queryMatches.empty())
+        std::cout << ", " << queryMatches;
+    std::cout << ")\n";
 }
 
+// Identical copies share the result of the one that was scanned
+static std::vector<std::filesystem::path> mapNames(const std::filesystem::path& map)
+{
+    std::vector<std::filesystem::path> names{ g_options.displayPath(map) };
+    if (const auto copies = g_options.duplicates.find(map); copies != g_options.duplicates.end())
+    {
+        for (const auto& copy : copies->second)
+            names.push_back(g_options.displayPath(copy));
+        std::ranges::sort(names);
+    }
+    return names;
+}
 
-int main(const int argc, char* argv[])
+static void printReport()
 {
-    logger.setFileHandler(nullptr);
-    logger.setLevel(Logging::LogLevel::Error);
+    MER_MEMORY_SITE("printReport");
+    PhaseTimer timer{ Phase::Report };
 
-    handleArgs(argc, argv);
+    // Flatten to vector and sort our entries by map name, maps from every Steam library interleaved
+    std::vector<std::pair<std::vector<std::filesystem::path>, const std::vector<EntityEntry>*>> entEntries;
+    entEntries.reserve(g_options.entries.size());
+    for (const auto& [map, entries] : g_options.entries)
+    {
+        entEntries.emplace_back( mapNames(map), &entries );
+    }
 
-    /*
-      Use a custom handler to break checkMaps loop without stopping application completely,
-      that way we can report on the matches found so far if interrupted early.
-    */
-    std::signal(SIGINT, signalHandler);
+    std::ranges::sort(entEntries, [](const auto& a, const auto& b) { return a.first.front() < b.first.front(); });
 
-    g_options.findGlobs();
 
-    if (g_options.globs.empty())
+    for (const auto& [names, entries] : entEntries)
     {
-        std::cout << style(warning) << "No .bsp files were found.\n"
-            "Is '" << g_options.steamDir.string() << "' your Steam install directory? (y/N) " << style();
-        if (!confirm_dialogue(false))
-        {
-            g_options.steamDir = getSteamDir(true);
-            g_options.steamCommonDir = g_options.steamDir / "steamapps/common";
-            g_options.findGlobs();
-        }
+        for (std::size_t i = 0; i < names.size(); ++i)
+            std::cout << (i ? ", " : "") << names[i].string();
+        std::cout << ": [\n";
+
+        for (const auto& entry : *entries)
+            printEntry(entry);
+
+        std::cout << "]\n";
     }
+}
 
-    if (g_options.globs.empty())
+// Summary and report of the scan or merged partial results
+static void printResults(const std::size_t mapsChecked)
+{
+    if (g_options.entries.empty())
     {
-        std::cerr << style(warning) << "No .bsp files were found.\n" << style() << std::endl;
-        return EXIT_SUCCESS;
+        std::cout << "No matches were found, checked " << mapsChecked << " .bsp files" << std::endl;
+        return;
     }
 
-    g_options.checkMaps();
+    std::cout << "Number of matches found: " << g_options.foundEntries << '\n'
+        << "Checked " << mapsChecked << " .bsp files";
+    if (g_stats.mapsDeduplicated)
+        std::cout << " (" << g_stats.mapsDeduplicated << " identical copies scanned once)";
+    std::cout << "\n" << std::endl;
 
-    // Return signal handler to default
-    std::signal(SIGINT, SIG_DFL);
+    printReport();
+}
 
-    if (g_options.entries.empty())
+// Summary and aggregates of the scan, in place of the report
+static void printAggregation(const std::size_t mapsChecked)
+{
+    const Aggregation::Counts counts = g_options.aggregation->merged();
+    std::uint64_t matches = 0;
+    for (const auto& values : counts | std::views::values)
     {
-        std::cout << "No matches were found, checked " << g_options.globs.size() << " .bsp files" << std::endl;
-        return EXIT_SUCCESS;
+        for (const std::uint64_t count : values | std::views::values)
+            matches += count;
     }
 
-    std::cout << "Number of matches found: " << g_options.foundEntries << '\n'
-        << "Checked " << g_options.globs.size() << " .bsp files\n" << std::endl;
+    if (!matches)
+    {
+        std::cout << "No matches were found, checked " << mapsChecked << " .bsp files" << std::endl;
+        return;
+    }
 
+    std::cout << "Number of matches found: " << matches;
+    if (!g_options.aggregation->key().empty())
+        std::cout << " with a " << g_options.aggregation->key() << " key";
+    std::cout << "\nChecked " << mapsChecked << " .bsp files\n" << std::endl;
 
-    // Flatten to vector and sort our entries by map name
-    std::vector<std::pair<std::filesystem::path, std::vector<EntityEntry>>> entEntries;
-    entEntries.reserve(g_options.entries.size());
-    for (auto& [map, entries] : g_options.entries)
-        entEntries.emplace_back( map, std::move(entries) );
+    g_options.aggregation->print(std::cout, counts);
+}
 
-    std::ranges::sort(entEntries, [](const auto& a, const auto& b) { return a.first < b.first; });
+// Summary and the best ranked matches of the scan, in place of the report
+static void printTopMatches(const std::size_t mapsChecked)
+{
+    const TopMatches& top = *g_options.topMatches;
+    const std::vector<TopMatches::Match> matches = top.merged();
+    if (matches.empty())
+    {
+        std::cout << "No matches with a numeric " << top.by() << " were found, checked " << mapsChecked << " .bsp files" << std::endl;
+        return;
+    }
+
+    std::cout << (top.bottom() ? "Lowest " : "Highest ") << matches.size() << " of " << top.rankedCount()
+        << " matches by " << top.by() << "\nChecked " << mapsChecked << " .bsp files\n" << std::endl;
+
+    for (const auto& [value, map, entry] : matches)
+    {
+        std::cout << top.by() << '=' << std::format("{}", value) << " in ";
+        const std::vector<std::filesystem::path> names = mapNames(map);
+        for (std::size_t i = 0; i < names.size(); ++i)
+            std::cout << (i ? ", " : "") << names[i].string();
+        std::cout << ":\n";
+        printEntry(entry);
+    }
+}
+
+static int mergePartials(const int argc, char* argv[])
+{
+    std::vector<std::filesystem::path> files;
+    for (int i = 2; i < argc; ++i)
+        files.emplace_back(argv[i]);
+
+    if (files.empty())
+    {
+        logger.error("Missing partial result files to merge");
+        return EXIT_FAILURE;
+    }
+
+    // Missing or interrupted shards make for an incomplete report, always warn about them
+    logger.setLevel(Logging::LogLevel::Warning);
+    try
+    {
+        const std::size_t mapsChecked = Shards::mergePartials(files);
+        printResults(mapsChecked);
+    }
+    catch (const std::runtime_error& e)
+    {
+        logger.error(e.what());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
+struct WatchDelta
+{
+    unsigned int added = 0;
+    unsigned int removed = 0;
+    unsigned int changed = 0;
+};
 
-    for (const auto& [map, entries] : entEntries)
+static bool sameMatch(const EntityEntry& a, const EntityEntry& b)
+{
+    return a.flags == b.flags && a.classname == b.classname && a.targetname == b.targetname
+        && a.queryMatches == b.queryMatches && a.fullEnt == b.fullEnt;
+}
+
+// Prints the matches of a map that differ from before it was rescanned, matched up by entity index
+static void printDelta(const std::filesystem::path& map, const bool mapRemoved, const std::vector<EntityEntry>& before,
+    const std::vector<EntityEntry>& after, WatchDelta& delta)
+{
+    std::map<unsigned int, std::pair<const EntityEntry*, const EntityEntry*>> matches;
+    for (const auto& entry : before)
+        matches[entry.index].first = &entry;
+    for (const auto& entry : after)
+        matches[entry.index].second = &entry;
+
+    bool headerShown = false;
+    for (const auto& [old, now] : matches | std::views::values)
     {
-        std::cout << (g_options.absoluteDir ? map.filename() : map).string() << ": [\n";
+        if (old && now && sameMatch(*old, *now))
+            continue;
+
+        if (!headerShown)
+            std::cout << g_options.displayPath(map).string() << (mapRemoved ? " (removed)" : "") << ": [\n";
+        headerShown = true;
 
-        for (const auto& [matched, index, flags, classname, targetname, queryMatches, fullEnt] : entries)
+        if (!now)
         {
-            if (g_options.printFullEnt)
-            {
-                std::cout << "// Matched term(s): " << queryMatches << ":\n{\n";
-                for (const auto& [key, value] : fullEnt)
-                    std::cout << '"' << key << "\" \"" << value << "\"\n";
+            printEntry(*old, '-');
+            ++delta.removed;
+        }
+        else
+        {
+            printEntry(*now, old ? '~' : '+');
+            ++(old ? delta.changed : delta.added);
+        }
+    }
+
+    if (headerShown)
+        std::cout << "]\n";
+}
+
+static std::vector<EntityEntry> takeEntries(const std::filesystem::path& map)
+{
+    auto node = g_options.entries.extract(map);
+    if (node.empty())
+        return {};
+    g_options.foundEntries -= static_cast<unsigned int>(node.mapped().size());
+    return std::move(node.mapped());
+}
+
+// Rescans maps as they're written or deleted after the initial scan, and prints how their matches changed
+static void watchMaps()
+{
+    // Every maps directory that was looked in, so maps also turn up in the ones that had none yet
+    std::set<std::filesystem::path> dirs = g_options.mapsDirs;
+    for (const auto& glob : g_options.globs)
+        dirs.insert(glob.parent_path());
 
-                std::cout << "}\n";
+    try
+    {
+        MapWatcher watcher{ { dirs.begin(), dirs.end() } };
+        std::cout << style(info) << "\nWatching " << dirs.size() << " maps directories for changes, press Ctrl+C to stop"
+            << style() << std::endl;
+
+        while (g_receivedSignal == -1)
+        {
+            const auto [modified, removed] = watcher.wait(g_receivedSignal);
+            if (modified.empty() && removed.empty())
                 continue;
+
+            // Matches from before the change, identical copies of a changed map lose the result they shared
+            std::map<std::filesystem::path, std::vector<EntityEntry>> before;
+            std::set<std::filesystem::path> rescan{ modified.begin(), modified.end() };
+            for (const auto* changed : { &modified, &removed })
+            {
+                for (const auto& map : *changed)
+                {
+                    // A copy had the matches of the map it duplicates, which keeps them
+                    const auto original = std::ranges::find_if(g_options.duplicates, [&map](const auto& copies) {
+                        return std::ranges::find(copies.second, map) != copies.second.end();
+                    });
+                    if (original != g_options.duplicates.end())
+                    {
+                        const auto entries = g_options.entries.find(original->first);
+                        before.try_emplace(map, entries != g_options.entries.end() ? entries->second : std::vector<EntityEntry>{});
+                        std::erase(original->second, map);
+                        continue;
+                    }
+
+                    // Copies of a map that changed earlier in the batch already have its matches
+                    before.try_emplace(map, takeEntries(map));
+                    if (auto copies = g_options.duplicates.extract(map); !copies.empty())
+                    {
+                        for (const auto& copy : copies.mapped())
+                        {
+                            before.try_emplace(copy, before.at(map));
+                            rescan.insert(copy);
+                        }
+                    }
+                }
+            }
+            for (const auto& map : removed)
+            {
+                rescan.erase(map);
+                g_options.globs.erase(map);
+            }
+
+            g_options.rescanMaps({ rescan.begin(), rescan.end() });
+
+            WatchDelta delta;
+            const std::set<std::filesystem::path> removedMaps{ removed.begin(), removed.end() };
+            for (const auto& [map, entries] : before)
+            {
+                const auto after = g_options.entries.find(map);
+                printDelta(map, removedMaps.contains(map), entries, after == g_options.entries.end() ? std::vector<EntityEntry>{} : after->second, delta);
             }
 
-            std::cout << "  " << classname << " (index " << index;
-            if (!targetname.empty())
-                std::cout << ", targetname '" << targetname << "'";
-            if (!queryMatches.empty())
-                std::cout << ", " << queryMatches;
-            std::cout << ")\n";
+            std::cout << style(info) << "Rescanned " << rescan.size() << " maps (" << removed.size() << " removed): "
+                << delta.added << " new, " << delta.removed << " removed and " << delta.changed << " changed matches"
+                << style() << '\n' << std::endl;
         }
+    }
+    catch (const std::runtime_error& e)
+    {
+        logger.error(e.what());
+    }
+}
 
-        std::cout << "]\n";
+static void writeIndex()
+{
+    try
+    {
+        g_options.index->write(g_options.indexFile);
+        std::cerr << style(info) << "Indexed " << g_options.index->mapCount() << " maps into " << g_options.indexFile.string()
+            << style() << std::endl;
+    }
+    catch (const std::runtime_error& e)
+    {
+        logger.error(e.what());
     }
 
+    // Maps rescanned by --watch aren't indexed, the file is already written
+    g_options.buildIndex = false;
+    g_options.index.reset();
+}
+
+static void writeGraph()
+{
+    const std::vector<LevelGraph::Link> links = g_options.levelGraph->links();
+    g_options.levelGraph->write(std::cout, g_options.graphJson ? LevelGraph::Format::Json : LevelGraph::Format::Dot);
+
+    // Summary and broken links on stderr, out of the way of the graph
+    const auto broken = std::ranges::count_if(links, [](const LevelGraph::Link& link) { return link.status != LevelGraph::Link::Ok; });
+    for (const LevelGraph::Link& link : links)
+    {
+        if (link.status == LevelGraph::Link::MissingMap)
+            logger.warning(std::format("{} leads to {}, which wasn't found", link.from, link.to));
+        else if (link.status == LevelGraph::Link::UnreadableMap)
+            logger.warning(std::format("{} leads to {}, which couldn't be read", link.from, link.to));
+        else if (link.status == LevelGraph::Link::MissingLandmark)
+            logger.warning(std::format("{} leads to {} at landmark {}, which it doesn't have", link.from, link.to, link.landmark));
+    }
+    std::cerr << style(info) << links.size() << " level transitions between " << g_options.levelGraph->levelCount() << " maps, "
+        << broken << " broken" << style() << std::endl;
+}
+
+// Writes the partial result of a shard, the level graph, the aggregates, the ranked matches, the estimate or the report
+static int finishScan()
+{
+    if (g_options.buildIndex)
+        writeIndex();
+
+    if (g_options.levelGraph)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        writeGraph();
+        return EXIT_SUCCESS;
+    }
+
+    if (g_options.shardCount)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        Shards::writePartial(std::cout);
+        return EXIT_SUCCESS;
+    }
+
+    if (g_options.aggregation)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        printAggregation(g_options.globs.size());
+        return EXIT_SUCCESS;
+    }
+
+    if (g_options.topMatches)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        printTopMatches(g_options.globs.size());
+        return EXIT_SUCCESS;
+    }
+
+    if (g_options.estimate)
+    {
+        std::signal(SIGINT, SIG_DFL);
+        g_options.sample->print(std::cout);
+        return EXIT_SUCCESS;
+    }
+
+    printResults(g_options.globs.size());
+    if (g_options.sample)
+    {
+        std::cout << '\n';
+        g_options.sample->print(std::cout);
+    }
+    if (g_options.watch)
+        watchMaps();
+
+    // Return signal handler to default
+    std::signal(SIGINT, SIG_DFL);
+
     if (g_options.interactiveMode)
     {
         std::cout << "\nPress any key to close this window...";
         confirm_dialogue();
     }
+    return EXIT_SUCCESS;
+}
+
+extern "C" void signalHandler(int sig)
+{
+    g_receivedSignal.store(sig);
+}
+
+
+int main(const int argc, char* argv[])
+{
+    logger.setFileHandler(nullptr);
+    logger.setLevel(Logging::LogLevel::Error);
+
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+        return mergePartials(argc, argv);
+
+    handleArgs(argc, argv);
+
+    // Printed to stderr on exit so it never mixes with the report on stdout
+    if (g_stats.enabled)
+        std::atexit([] { g_stats.print(std::cerr); });
+    if (g_trace.enabled)
+        std::atexit([] { g_trace.write(); });
+
+    /*
+      Use a custom handler to break checkMaps loop without stopping application completely,
+      that way we can report on the matches found so far if interrupted early.
+    */
+    std::signal(SIGINT, signalHandler);
+
+    try
+    {
+        if (g_options.buildIndex)
+            g_options.index = std::make_shared<MapIndex>();
+        else if (!g_options.indexFile.empty())
+            g_options.loadIndex();
+    }
+    catch (const std::runtime_error& e)
+    {
+        logger.error(e.what());
+        return EXIT_FAILURE;
+    }
+
+    if (!g_options.filesFrom.empty())
+    {
+        if (g_options.effective)
+            logger.warning("--effective has no effect on maps from --files-from");
+
+        try
+        {
+            g_options.checkListedMaps();
+        }
+        catch (const std::runtime_error& e)
+        {
+            logger.error(e.what());
+            return EXIT_FAILURE;
+        }
+        return finishScan();
+    }
+
+    g_options.findGlobs();
+
+    if (g_options.globs.empty())
+    {
+        std::cout << style(warning) << "No .bsp files were found.\n"
+            "Is '" << g_options.steamDir.string() << "' your Steam install directory? (y/N) " << style();
+        if (!confirm_dialogue(false))
+        {
+            g_options.steamDir = getSteamDir(true);
+            g_options.steamCommonDir = g_options.steamDir / "steamapps/common";
+            g_options.findGlobs();
+        }
+    }
+
+    if (g_options.globs.empty())
+    {
+        std::cerr << style(warning) << "No .bsp files were found.\n" << style() << std::endl;
+        return EXIT_SUCCESS;
+    }
+
+    // A shard may well be empty, it still writes its partial result
+    if (g_options.shardCount)
+        g_options.keepShard();
+
+    if (g_options.sample)
+        g_options.sample->choose(g_options.globs);
+
+    g_options.checkMaps();
+    return finishScan();
 }
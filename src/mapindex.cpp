@@ -0,0 +1,626 @@
+#include <cmath>
+#include <format>
+#include <ranges>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <algorithm>
+#include "mapindex.h"
+
+
+namespace fs = std::filesystem;
+
+static constexpr char c_magic[8] = { 'M', 'E', 'R', 'I', 'N', 'D', 'E', 'X' };
+static constexpr std::uint32_t c_version = 2;
+
+
+namespace
+{
+    using Posting = MapIndex::Posting;
+    using EntityRef = MapIndex::EntityRef;
+
+    bool compare(const double a, const Query::QueryOperator op, const double b)
+    {
+        switch (op)
+        {
+        case Query::QueryGreater: return a > b;
+        case Query::QueryLess: return a < b;
+        case Query::QueryGreaterEquals: return a >= b;
+        case Query::QueryLessEquals: return a <= b;
+        default: return false;
+        }
+    }
+
+    // Postings the operator accepts, postings have to be sorted by value
+    std::span<const Posting> inRange(const std::vector<Posting>& postings, const Query::QueryOperator op, const double value)
+    {
+        const auto lower = std::ranges::lower_bound(postings, value, {}, &Posting::value);
+        const auto upper = std::ranges::upper_bound(postings, value, {}, &Posting::value);
+        switch (op)
+        {
+        case Query::QueryGreater: return { upper, postings.end() };
+        case Query::QueryLess: return { postings.begin(), lower };
+        case Query::QueryGreaterEquals: return { lower, postings.end() };
+        case Query::QueryLessEquals: return { postings.begin(), upper };
+        default: return {};
+        }
+    }
+
+    EntityRef entityRef(const Posting& posting)
+    {
+        return static_cast<EntityRef>(posting.map) << 32 | posting.entity;
+    }
+
+    void sortRefs(std::vector<EntityRef>& refs)
+    {
+        std::ranges::sort(refs);
+        const auto [first, last] = std::ranges::unique(refs);
+        refs.erase(first, last);
+    }
+
+    std::pair<std::uint64_t, std::int64_t> fileStamp(const fs::path& map)
+    {
+        std::error_code error;
+        const std::uintmax_t size = fs::file_size(map, error);
+        if (error)
+            return { 0, 0 };
+        const auto modified = fs::last_write_time(map, error);
+        if (error)
+            return { 0, 0 };
+        return { size, modified.time_since_epoch().count() };
+    }
+
+
+    class IndexWriter
+    {
+    public:
+        explicit IndexWriter(const fs::path& file) : m_file(file), m_out(file, std::ios::binary)
+        {
+            if (!m_out.is_open())
+                throw std::runtime_error("Could not open " + file.string() + " for writing");
+        }
+
+        template<typename T>
+        void put(const T& value) { m_out.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+        void put(const std::string& str)
+        {
+            put(static_cast<std::uint32_t>(str.size()));
+            m_out.write(str.data(), static_cast<std::streamsize>(str.size()));
+        }
+
+        void put(const std::vector<Posting>& postings)
+        {
+            put(static_cast<std::uint64_t>(postings.size()));
+            m_out.write(reinterpret_cast<const char*>(postings.data()), static_cast<std::streamsize>(postings.size() * sizeof(Posting)));
+        }
+
+        void put(const EntityBitmap& bitmap)
+        {
+            put(static_cast<std::uint32_t>(bitmap.containers().size()));
+            for (const EntityBitmap::Container& container : bitmap.containers())
+            {
+                put(container.high);
+                put(static_cast<std::uint8_t>(!container.bits.empty()));
+                if (container.bits.empty())
+                {
+                    put(static_cast<std::uint32_t>(container.array.size()));
+                    m_out.write(reinterpret_cast<const char*>(container.array.data()), static_cast<std::streamsize>(container.array.size() * sizeof(std::uint16_t)));
+                }
+                else
+                    m_out.write(reinterpret_cast<const char*>(container.bits.data()), static_cast<std::streamsize>(container.bits.size() * sizeof(std::uint64_t)));
+            }
+        }
+
+        void finish()
+        {
+            m_out.flush();
+            if (!m_out)
+                throw std::runtime_error("Could not write " + m_file.string());
+        }
+    private:
+        const fs::path& m_file;
+        std::ofstream m_out;
+    };
+
+    class IndexReader
+    {
+    public:
+        explicit IndexReader(const fs::path& file) : m_file(file), m_in(file, std::ios::binary)
+        {
+            if (!m_in.is_open())
+                throw std::runtime_error("Could not open " + file.string() + " for reading");
+
+            std::error_code error;
+            m_remaining = fs::file_size(file, error);
+        }
+
+        template<typename T>
+        T get()
+        {
+            T value{};
+            read(reinterpret_cast<char*>(&value), sizeof(T));
+            return value;
+        }
+
+        std::string getString()
+        {
+            std::string str(get<std::uint32_t>(), '\0');
+            read(str.data(), str.size());
+            return str;
+        }
+
+        std::vector<Posting> getPostings()
+        {
+            const auto count = get<std::uint64_t>();
+            if (count > m_remaining / sizeof(Posting))
+                truncated();
+
+            std::vector<Posting> postings(count);
+            read(reinterpret_cast<char*>(postings.data()), count * sizeof(Posting));
+            return postings;
+        }
+
+        EntityBitmap getBitmap()
+        {
+            std::vector<EntityBitmap::Container> containers(get<std::uint32_t>());
+            for (EntityBitmap::Container& container : containers)
+            {
+                container.high = get<std::uint64_t>();
+                if (get<std::uint8_t>())
+                {
+                    container.bits.resize(EntityBitmap::c_bitmapWords);
+                    read(reinterpret_cast<char*>(container.bits.data()), container.bits.size() * sizeof(std::uint64_t));
+                    continue;
+                }
+
+                const auto count = get<std::uint32_t>();
+                if (count > EntityBitmap::c_maxArray)
+                    truncated();
+                container.array.resize(count);
+                read(reinterpret_cast<char*>(container.array.data()), count * sizeof(std::uint16_t));
+            }
+            return EntityBitmap{ std::move(containers) };
+        }
+
+        [[noreturn]] void truncated() const
+        {
+            throw std::runtime_error(m_file.string() + " is truncated or not a mer index");
+        }
+    private:
+        const fs::path& m_file;
+        std::ifstream m_in;
+        std::uintmax_t m_remaining = 0;
+
+        void read(char* data, const std::size_t size)
+        {
+            if (size > m_remaining || !m_in.read(data, static_cast<std::streamsize>(size)))
+                truncated();
+            m_remaining -= size;
+        }
+    };
+}
+
+
+MapIndex::MapIndex(const fs::path& file)
+{
+    IndexReader in{ file };
+
+    char magic[sizeof(c_magic)];
+    for (char& c : magic)
+        c = in.get<char>();
+    if (!std::ranges::equal(magic, c_magic))
+        throw std::runtime_error(file.string() + " is not a mer index");
+    if (const auto version = in.get<std::uint32_t>(); version != c_version)
+        throw std::runtime_error(std::format("{} is a version {} index, rebuild it with --build-index", file.string(), version));
+
+    m_maps.resize(in.get<std::uint32_t>());
+    for (std::uint32_t id = 0; id < m_maps.size(); ++id)
+    {
+        MapInfo& map = m_maps[id];
+        map.path = in.getString();
+        map.size = in.get<std::uint64_t>();
+        map.modified = in.get<std::int64_t>();
+        m_mapIds.emplace(map.path, id);
+    }
+
+    for (auto keys = in.get<std::uint32_t>(); keys; --keys)
+    {
+        KeyPostings& key = m_keys[in.getString()];
+        key.whole = in.getPostings();
+        key.elements.resize(in.get<std::uint32_t>());
+        for (auto& element : key.elements)
+            element = in.getPostings();
+        key.counts = in.getPostings();
+    }
+
+    for (auto classes = in.get<std::uint32_t>(); classes; --classes)
+    {
+        ClassFlags& flags = m_classes[in.getString()];
+        flags.entities = in.getBitmap();
+        flags.flagged = in.getBitmap();
+        flags.flagLike = in.getBitmap();
+        for (EntityBitmap& bit : flags.bits)
+            bit = in.getBitmap();
+    }
+}
+
+void MapIndex::add(const fs::path& map, const std::span<const Entity> entities)
+{
+    const auto [size, modified] = fileStamp(map);
+    std::uint32_t id;
+    {
+        std::lock_guard lock{ m_mutex };
+        id = static_cast<std::uint32_t>(m_maps.size());
+        m_maps.push_back({ map.generic_string(), size, modified });
+        m_mapIds.emplace(m_maps.back().path, id);
+    }
+
+    // Parsed outside the lock, the value strings are the expensive part
+    std::unordered_map<std::string_view, KeyPostings> local;
+    std::unordered_map<std::string_view, ClassRefs> localClasses;
+    for (std::uint32_t entity = 0; entity < entities.size(); ++entity)
+    {
+        const EntityRef ref = static_cast<EntityRef>(id) << 32 | entity;
+        std::string_view classname, spawnflags;
+        bool hasFlags = false, hasFlagLike = false;
+        for (const auto& [key, value] : entities[entity])
+        {
+            if (key == "classname")
+                classname = value;
+            else if (key == "spawnflags")
+            {
+                spawnflags = value;
+                hasFlags = true;
+            }
+            else
+                hasFlagLike |= key.starts_with("spawnflags");
+        }
+
+        ClassRefs& classRefs = localClasses[classname];
+        classRefs.entities.push_back(ref);
+        if (hasFlagLike && !hasFlags)
+            classRefs.flagLike.push_back(ref);
+        if (const auto flags = static_cast<unsigned int>(toInt(spawnflags)); flags)
+        {
+            classRefs.flagged.push_back(ref);
+            for (unsigned int bit = 0; bit < classRefs.bits.size(); ++bit)
+            {
+                if (flags >> bit & 1)
+                    classRefs.bits[bit].push_back(ref);
+            }
+        }
+
+        for (const auto& [key, value] : entities[entity])
+        {
+            KeyPostings& postings = local[key];
+            const auto elements = static_cast<std::uint32_t>(elementCount(value));
+            postings.counts.push_back({ static_cast<double>(elements), id, entity, elements });
+
+            // NaN never compares true, so it's left out rather than breaking the sort order
+            if (double numeric; isValueNumeric(value, numeric) && !std::isnan(numeric))
+                postings.whole.push_back({ numeric, id, entity, elements });
+
+            if (postings.elements.size() < elements)
+                postings.elements.resize(elements);
+            std::size_t start = 0;
+            for (std::uint32_t position = 0; position < elements; ++position)
+            {
+                const std::size_t end = std::min(value.find(' ', start), value.size());
+                const std::string_view element = value.substr(start, end - start);
+
+                // Empty elements between doubled or after leading spaces compare as 0, as Query::testEntity compares them
+                if (double numeric = 0.; element.empty() || (isValueNumeric(element, numeric) && !std::isnan(numeric)))
+                    postings.elements[position].push_back({ numeric, id, entity, elements });
+                start = end + 1;
+            }
+        }
+    }
+
+    std::lock_guard lock{ m_mutex };
+    for (auto& [key, postings] : local)
+    {
+        KeyPostings& merged = m_keys[std::string(key)];
+        merged.whole.insert(merged.whole.end(), postings.whole.begin(), postings.whole.end());
+        merged.counts.insert(merged.counts.end(), postings.counts.begin(), postings.counts.end());
+        if (merged.elements.size() < postings.elements.size())
+            merged.elements.resize(postings.elements.size());
+        for (std::size_t position = 0; position < postings.elements.size(); ++position)
+            merged.elements[position].insert(merged.elements[position].end(), postings.elements[position].begin(), postings.elements[position].end());
+    }
+
+    const auto append = [](std::vector<EntityRef>& to, const std::vector<EntityRef>& from) { to.insert(to.end(), from.begin(), from.end()); };
+    for (auto& [classname, refs] : localClasses)
+    {
+        ClassRefs& merged = m_classRefs[std::string(classname)];
+        append(merged.entities, refs.entities);
+        append(merged.flagged, refs.flagged);
+        append(merged.flagLike, refs.flagLike);
+        for (std::size_t bit = 0; bit < refs.bits.size(); ++bit)
+            append(merged.bits[bit], refs.bits[bit]);
+    }
+}
+
+void MapIndex::write(const fs::path& file)
+{
+    std::lock_guard lock{ m_mutex };
+    const auto byValue = [](const Posting& a, const Posting& b) { return a.value < b.value; };
+
+    IndexWriter out{ file };
+    for (const char c : c_magic)
+        out.put(c);
+    out.put(c_version);
+
+    out.put(static_cast<std::uint32_t>(m_maps.size()));
+    for (const MapInfo& map : m_maps)
+    {
+        out.put(map.path);
+        out.put(map.size);
+        out.put(map.modified);
+    }
+
+    out.put(static_cast<std::uint32_t>(m_keys.size()));
+    for (auto& [key, postings] : m_keys)
+    {
+        std::ranges::sort(postings.whole, byValue);
+        std::ranges::sort(postings.counts, byValue);
+
+        out.put(key);
+        out.put(postings.whole);
+        out.put(static_cast<std::uint32_t>(postings.elements.size()));
+        for (auto& element : postings.elements)
+        {
+            std::ranges::sort(element, byValue);
+            out.put(element);
+        }
+        out.put(postings.counts);
+    }
+
+    // Maps are added in whatever order they finish scanning, refs only come out sorted per map
+    const auto toBitmap = [](std::vector<EntityRef>& refs) {
+        std::ranges::sort(refs);
+        return EntityBitmap::fromSorted(refs);
+    };
+
+    out.put(static_cast<std::uint32_t>(m_classRefs.size()));
+    for (auto& [classname, refs] : m_classRefs)
+    {
+        out.put(classname);
+        out.put(toBitmap(refs.entities));
+        out.put(toBitmap(refs.flagged));
+        out.put(toBitmap(refs.flagLike));
+        for (auto& bit : refs.bits)
+            out.put(toBitmap(bit));
+    }
+    out.finish();
+}
+
+std::optional<EntityBitmap> MapIndex::candidates(const Query& query) const
+{
+    // Bounds of brush entities and textures aren't indexed, and with them read any term without a key could match on them
+    if (chainNeedsBounds(&query) || chainNeedsTextures(&query))
+    {
+        for (const Query* term = &query; term; term = term->next)
+        {
+            if (term->key.empty())
+                return std::nullopt;
+        }
+    }
+
+    return chainCandidates(query, nullptr);
+}
+
+std::optional<EntityBitmap> MapIndex::chainCandidates(const Query& query, const ClassFlags* onlyClass) const
+{
+    std::optional<EntityBitmap> found = termCandidates(query, onlyClass);
+    if (!query.next)
+        return found;
+
+    // Whatever the rest of an AND chain after an exact classname finds is only kept for that class
+    if (query.type == Query::QueryAnd && !query.elementAccess && query.op == Query::QueryExact && query.key == "classname")
+    {
+        if (const auto flags = m_classes.find(query.value); flags != m_classes.end())
+            onlyClass = &flags->second;
+    }
+
+    // Same grouping as Query::testChain, each query applies to the rest of the chain after it
+    std::optional<EntityBitmap> rest = chainCandidates(*query.next, onlyClass);
+    if (query.type == Query::QueryAnd)
+    {
+        if (!found || !rest)
+            return found ? found : rest;
+
+        *found &= *rest;
+        return found;
+    }
+
+    if (!found || !rest)
+        return std::nullopt;
+
+    *found |= *rest;
+    return found;
+}
+
+std::optional<EntityBitmap> MapIndex::termCandidates(const Query& query, const ClassFlags* onlyClass) const
+{
+    if (query.targetQuery || Query::isBoundsKey(query.key) || query.key == Query::c_textureKey)
+        return std::nullopt;
+    if (query.elementAccess)
+        return numericCandidates(query);
+
+    // Spawnflags are compared as integers, and only when set
+    if (query.key == "spawnflags" && query.valueIsNumeric)
+        return flagCandidates(query, onlyClass);
+
+    if (query.op == Query::QueryExact && query.key == "classname" && !query.value.empty())
+    {
+        const auto flags = m_classes.find(query.value);
+        return flags == m_classes.end() ? EntityBitmap{} : flags->second.entities;
+    }
+
+    return numericCandidates(query);
+}
+
+EntityBitmap MapIndex::flagCandidates(const Query& query, const ClassFlags* onlyClass) const
+{
+    const auto flags = static_cast<unsigned int>(query.valueNumeric);
+
+    const auto classCandidates = [&query, flags](const ClassFlags& of) {
+        EntityBitmap anySet;
+        for (unsigned int bit = 0; bit < of.bits.size(); ++bit)
+        {
+            if (flags >> bit & 1)
+                anySet |= of.bits[bit];
+        }
+
+        switch (query.op)
+        {
+        case Query::QueryEquals:
+            // Without spawnflags = is a partial match on the first key starting with spawnflags
+            anySet |= of.flagLike;
+            return anySet;
+        case Query::QueryNotEquals:
+        {
+            EntityBitmap noneSet = of.flagged;
+            noneSet -= anySet;
+            return noneSet;
+        }
+        case Query::QueryExact:
+        {
+            EntityBitmap allSet = of.flagged;
+            for (unsigned int bit = 0; bit < of.bits.size(); ++bit)
+            {
+                if (flags >> bit & 1)
+                    allSet &= of.bits[bit];
+            }
+            return allSet;
+        }
+        default:
+            break;
+        }
+
+        // Bit-sliced comparison from the highest bit down, entities stay equal while their bits agree with the flags
+        EntityBitmap greater, equal = of.flagged;
+        for (int bit = static_cast<int>(of.bits.size()) - 1; bit >= 0 && !equal.empty(); --bit)
+        {
+            if (flags >> bit & 1)
+            {
+                equal &= of.bits[bit];
+                continue;
+            }
+
+            EntityBitmap set = equal;
+            set &= of.bits[bit];
+            greater |= set;
+            equal -= of.bits[bit];
+        }
+
+        if (query.op == Query::QueryGreater || query.op == Query::QueryGreaterEquals)
+        {
+            if (query.op == Query::QueryGreaterEquals)
+                greater |= equal;
+            return greater;
+        }
+
+        EntityBitmap less = of.flagged;
+        less -= greater;
+        if (query.op == Query::QueryLess)
+            less -= equal;
+        return less;
+    };
+
+    if (onlyClass)
+        return classCandidates(*onlyClass);
+
+    EntityBitmap found;
+    for (const ClassFlags& of : m_classes | std::views::values)
+        found |= classCandidates(of);
+    return found;
+}
+
+std::optional<EntityBitmap> MapIndex::numericCandidates(const Query& query) const
+{
+    if (query.op != Query::QueryGreater && query.op != Query::QueryLess
+        && query.op != Query::QueryGreaterEquals && query.op != Query::QueryLessEquals)
+        return std::nullopt;
+
+    if (query.value.empty() && !query.elementAccess)
+        return EntityBitmap{};
+    if (!query.valueIsNumeric || std::isnan(query.valueNumeric))
+        return EntityBitmap{};
+
+    std::vector<EntityRef> found;
+
+    const auto key = m_keys.find(query.key);
+    if (!query.elementAccess)
+    {
+        const auto addKey = [&](const KeyPostings& postings) {
+            for (const Posting& posting : inRange(postings.whole, query.op, query.valueNumeric))
+                found.push_back(entityRef(posting));
+        };
+
+        // Without a key any value can match
+        if (query.key.empty())
+        {
+            for (const KeyPostings& postings : m_keys | std::views::values)
+                addKey(postings);
+        }
+        else if (key != m_keys.end())
+            addKey(key->second);
+
+        sortRefs(found);
+        return EntityBitmap::fromSorted(found);
+    }
+
+    if (query.key.empty() || key == m_keys.end())
+        return EntityBitmap{};
+
+    const KeyPostings& postings = key->second;
+    for (std::size_t position = 0; position < postings.elements.size(); ++position)
+    {
+        if (query.valueIndex >= 0 && position != static_cast<std::size_t>(query.valueIndex))
+            continue;
+
+        for (const Posting& posting : inRange(postings.elements[position], query.op, query.valueNumeric))
+        {
+            if (query.valueIndex >= 0 || elementPosition(query.valueIndex, static_cast<int>(posting.elements)) == static_cast<int>(position))
+                found.push_back(entityRef(posting));
+        }
+    }
+
+    // Elements that don't exist compare as 0, the entities with too few elements are at the front of counts
+    if (compare(0., query.op, query.valueNumeric))
+    {
+        const double lastMissing = query.valueIndex >= 0 ? query.valueIndex : 0.;
+        for (const Posting& posting : inRange(postings.counts, Query::QueryLessEquals, lastMissing))
+            found.push_back(entityRef(posting));
+    }
+
+    sortRefs(found);
+    return EntityBitmap::fromSorted(found);
+}
+
+std::size_t MapIndex::selectMaps(const Query& firstQuery)
+{
+    const std::optional<EntityBitmap> found = candidates(firstQuery);
+    for (MapInfo& map : m_maps)
+        map.selected = !found;
+
+    // Containers never span maps, the map is in the upper half of their high bits
+    if (found)
+    {
+        for (const EntityBitmap::Container& container : found->containers())
+            m_maps[container.high >> 16].selected = true;
+    }
+    return std::ranges::count(m_maps, true, &MapInfo::selected);
+}
+
+bool MapIndex::rulesOut(const fs::path& map) const
+{
+    const auto id = m_mapIds.find(map.generic_string());
+    if (id == m_mapIds.end() || m_maps[id->second].selected)
+        return false;
+
+    const MapInfo& info = m_maps[id->second];
+    return fileStamp(map) == std::pair{ info.size, info.modified };
+}
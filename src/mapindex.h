@@ -0,0 +1,97 @@
+#pragma once
+#include <span>
+#include <array>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <filesystem>
+#include "mer.h"
+#include "bitmap.h"
+
+
+/*
+	Numeric keyvalues of every entity in a set of maps, written to a file by --build-index and read back
+	by --index. Each key has its whole values and the values at each element position sorted, so queries
+	with </>/<=/>= are answered by binary searches and range scans rather than by parsing every value of
+	every map. Spawnflags are bit-sliced instead, with a bitmap of the entities that have each flag set
+	per classname, so their any/all/none and numeric comparisons become bitmap AND, OR and AND NOT.
+	The index only tells which maps can have matches, those are still scanned for the report, and maps
+	that changed on disk since they were indexed are always scanned.
+*/
+class MapIndex
+{
+public:
+	using EntityRef = std::uint64_t;  // Map id in the high and entity index in the low 32 bits
+
+	struct Posting
+	{
+		double value;
+		std::uint32_t map;
+		std::uint32_t entity;
+		std::uint32_t elements;  // Number of elements in the whole value, to resolve negative indices
+		std::uint32_t padding = 0;  // Postings are written to the file as they are in memory
+	};
+
+	MapIndex() = default;
+	explicit MapIndex(const std::filesystem::path& file);
+
+	// Indexes the entities of a map, can be called from several threads at once
+	void add(const std::filesystem::path& map, std::span<const Entity> entities);
+	// Sorts the postings and writes them to the file, an index is queried once read back
+	void write(const std::filesystem::path& file);
+
+	// Entities that can match the query chain starting at query, nullopt when the index can't tell
+	[[nodiscard]] std::optional<EntityBitmap> candidates(const Query& query) const;
+	// Keeps the maps with entities that can match, all of them when the chain can't be answered from the index
+	std::size_t selectMaps(const Query& firstQuery);
+	// Whether the map is indexed as it is on disk and was not selected
+	[[nodiscard]] bool rulesOut(const std::filesystem::path& map) const;
+	[[nodiscard]] std::size_t mapCount() const { return m_maps.size(); }
+private:
+	struct MapInfo
+	{
+		std::string path;
+		std::uint64_t size = 0;
+		std::int64_t modified = 0;
+		bool selected = true;
+	};
+
+	struct KeyPostings
+	{
+		std::vector<Posting> whole;
+		std::vector<std::vector<Posting>> elements;  // By element position
+		std::vector<Posting> counts;  // Every entity with the key, valued by its number of elements
+	};
+
+	struct ClassFlags
+	{
+		EntityBitmap entities;  // Every entity of the class
+		EntityBitmap flagged;  // Those with spawnflags other than 0
+		EntityBitmap flagLike;  // Those without spawnflags but a key starting with it, which = still looks at
+		std::array<EntityBitmap, 32> bits;
+	};
+
+	// The same while the index is built, turned into bitmaps as it's written
+	struct ClassRefs
+	{
+		std::vector<EntityRef> entities;
+		std::vector<EntityRef> flagged;
+		std::vector<EntityRef> flagLike;
+		std::array<std::vector<EntityRef>, 32> bits;
+	};
+
+	std::mutex m_mutex;
+	std::vector<MapInfo> m_maps;
+	std::unordered_map<std::string, std::uint32_t> m_mapIds;
+	std::unordered_map<std::string, KeyPostings> m_keys;
+	std::unordered_map<std::string, ClassFlags> m_classes;  // By classname
+	std::unordered_map<std::string, ClassRefs> m_classRefs;
+
+	[[nodiscard]] std::optional<EntityBitmap> chainCandidates(const Query& query, const ClassFlags* onlyClass) const;
+	[[nodiscard]] std::optional<EntityBitmap> termCandidates(const Query& query, const ClassFlags* onlyClass) const;
+	[[nodiscard]] std::optional<EntityBitmap> numericCandidates(const Query& query) const;
+	[[nodiscard]] EntityBitmap flagCandidates(const Query& query, const ClassFlags* onlyClass) const;
+};
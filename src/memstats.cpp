@@ -0,0 +1,192 @@
+#include <new>
+#include <array>
+#include <atomic>
+#include <format>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+#include "memstats.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+
+std::size_t MemStats::peakResidentBytes()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters{};
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    rusage usage{};
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<std::size_t>(usage.ru_maxrss);
+#else
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+
+#ifndef MER_MEMSTATS
+
+MemStats::Site::Site(const char*) : m_previous(nullptr) {}
+MemStats::Site::~Site() = default;
+int MemStats::setPhase(const int phase) { return phase; }
+
+void MemStats::print(std::ostream& out, std::uint64_t)
+{
+    out << std::format("\n  peak RSS           {:.2f} MB\n", MemStats::peakResidentBytes() / 1e6);
+}
+
+#else
+
+namespace
+{
+    // Everything here is used from inside operator new, so it must never allocate itself
+    constexpr std::size_t c_maxSites = 64;
+    constexpr std::size_t c_phases = static_cast<std::size_t>(Phase::PhaseCount) + 1;  // Last slot is outside any phase
+    constexpr std::size_t c_headerSize = alignof(std::max_align_t);
+
+    struct Counter
+    {
+        std::atomic<std::uint64_t> allocations = 0;
+        std::atomic<std::uint64_t> bytes = 0;
+    };
+
+    std::array<Counter, c_phases> g_phaseCounters;
+    std::array<std::atomic<const char*>, c_maxSites> g_siteNames{};
+    std::array<Counter, c_maxSites> g_siteCounters;
+    Counter g_otherSite;
+    std::atomic<std::int64_t> g_liveBytes = 0;
+    std::atomic<std::int64_t> g_peakBytes = 0;
+
+    thread_local int t_phase = static_cast<int>(Phase::PhaseCount);
+    thread_local const char* t_site = nullptr;
+
+    Counter& siteCounter(const char* site)
+    {
+        if (!site)
+            return g_otherSite;
+
+        for (std::size_t i = 0; i < c_maxSites; ++i)
+        {
+            // On a lost race the exchange leaves the other thread's site in name
+            const char* name = g_siteNames[i].load(std::memory_order_acquire);
+            if (!name && g_siteNames[i].compare_exchange_strong(name, site))
+                return g_siteCounters[i];
+            if (name == site)
+                return g_siteCounters[i];
+        }
+        return g_otherSite;
+    }
+
+    void* allocate(const std::size_t size) noexcept
+    {
+        auto* block = static_cast<unsigned char*>(std::malloc(size + c_headerSize));
+        if (!block)
+            return nullptr;
+        *reinterpret_cast<std::size_t*>(block) = size;
+
+        Counter& phase = g_phaseCounters[t_phase];
+        ++phase.allocations;
+        phase.bytes += size;
+        Counter& site = siteCounter(t_site);
+        ++site.allocations;
+        site.bytes += size;
+
+        const std::int64_t live = g_liveBytes += static_cast<std::int64_t>(size);
+        std::int64_t peak = g_peakBytes.load(std::memory_order_relaxed);
+        while (live > peak && !g_peakBytes.compare_exchange_weak(peak, live)) {}
+
+        return block + c_headerSize;
+    }
+
+    void deallocate(void* ptr) noexcept
+    {
+        if (!ptr)
+            return;
+        auto* block = static_cast<unsigned char*>(ptr) - c_headerSize;
+        g_liveBytes -= static_cast<std::int64_t>(*reinterpret_cast<std::size_t*>(block));
+        std::free(block);
+    }
+
+    void* allocateOrThrow(const std::size_t size)
+    {
+        if (void* ptr = allocate(size ? size : 1))
+            return ptr;
+        throw std::bad_alloc();
+    }
+}
+
+void* operator new(const std::size_t size) { return allocateOrThrow(size); }
+void* operator new[](const std::size_t size) { return allocateOrThrow(size); }
+void* operator new(const std::size_t size, const std::nothrow_t&) noexcept { return allocate(size ? size : 1); }
+void* operator new[](const std::size_t size, const std::nothrow_t&) noexcept { return allocate(size ? size : 1); }
+void operator delete(void* ptr) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { deallocate(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { deallocate(ptr); }
+
+
+MemStats::Site::Site(const char* name) : m_previous(t_site)
+{
+    t_site = name;
+}
+
+MemStats::Site::~Site()
+{
+    t_site = m_previous;
+}
+
+int MemStats::setPhase(const int phase)
+{
+    const int previous = t_phase;
+    t_phase = phase;
+    return previous;
+}
+
+void MemStats::print(std::ostream& out, const std::uint64_t entitiesParsed)
+{
+    out << "\nMemory:\n"
+        << std::format("  peak RSS           {:.2f} MB\n", MemStats::peakResidentBytes() / 1e6)
+        << std::format("  peak heap          {:.2f} MB ({:.2f} MB live)\n", g_peakBytes / 1e6, g_liveBytes / 1e6);
+
+    out << std::format("\n  {:<24}{:>14}{:>14}\n", "phase", "allocations", "MB");
+    for (std::size_t i = 0; i < c_phases; ++i)
+    {
+        const char* name = i < static_cast<std::size_t>(Phase::PhaseCount) ? phaseName(static_cast<Phase>(i)) : "other";
+        out << std::format("  {:<24}{:>14}{:>14.2f}\n", name, g_phaseCounters[i].allocations.load(), g_phaseCounters[i].bytes / 1e6);
+    }
+
+    if (entitiesParsed)
+    {
+        const auto& tokenize = g_phaseCounters[static_cast<std::size_t>(Phase::Tokenize)];
+        const auto& match = g_phaseCounters[static_cast<std::size_t>(Phase::Match)];
+        out << std::format("\n  allocations per parsed entity: {:.1f} tokenizing, {:.1f} matching\n",
+            static_cast<double>(tokenize.allocations) / entitiesParsed, static_cast<double>(match.allocations) / entitiesParsed);
+    }
+
+    std::vector<std::pair<const char*, const Counter*>> sites;
+    for (std::size_t i = 0; i < c_maxSites; ++i)
+        if (const char* name = g_siteNames[i].load())
+            sites.emplace_back(name, &g_siteCounters[i]);
+    sites.emplace_back("(untagged)", &g_otherSite);
+    std::ranges::sort(sites, [](const auto& a, const auto& b) { return a.second->bytes > b.second->bytes; });
+
+    out << std::format("\n  {:<24}{:>14}{:>14}\n", "top allocating sites", "allocations", "MB");
+    for (const auto& [name, counter] : sites)
+        out << std::format("  {:<24}{:>14}{:>14.2f}\n", name, counter->allocations.load(), counter->bytes / 1e6);
+}
+
+#endif
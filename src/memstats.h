@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+#include <ostream>
+
+
+/*
+	Allocation accounting, compiled in with the MER_MEMSTATS CMake option.
+	A global operator new hook counts allocations and bytes per scan phase (see PhaseTimer)
+	and per allocation site tagged with MER_MEMORY_SITE. The report is part of --stats.
+*/
+namespace MemStats
+{
+	class Site
+	{
+	public:
+		explicit Site(const char* name);
+		~Site();
+		Site(const Site&) = delete;
+		Site& operator=(const Site&) = delete;
+	private:
+		const char* m_previous;
+	};
+
+	// Sets the phase allocations on this thread are attributed to, returns the previous one
+	int setPhase(int phase);
+
+	std::size_t peakResidentBytes();
+	void print(std::ostream& out, std::uint64_t entitiesParsed);
+}
+
+#ifdef MER_MEMSTATS
+#define MER_MEMORY_SITE_CONCAT2(a, b) a##b
+#define MER_MEMORY_SITE_CONCAT(a, b) MER_MEMORY_SITE_CONCAT2(a, b)
+#define MER_MEMORY_SITE(name) const MemStats::Site MER_MEMORY_SITE_CONCAT(memorySite, __LINE__){ name }
+#else
+#define MER_MEMORY_SITE(name)
+#endif
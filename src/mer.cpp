@@ -1,3 +1,5 @@
+#include <map>
+#include <array>
 #include <cmath>
 #include <vector>
 #include <format>
@@ -6,9 +8,26 @@
 #include <source_location>
 #include <algorithm>
 #include <ranges>
+#include <charconv>
+#include <mutex>
+#include <deque>
+#include <future>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
 #include "logging.h"
 #include "mer.h"
 #include "utils.h"
+#include "stats.h"
+#include "trace.h"
+#include "memstats.h"
+#include "io.h"
+#include "pipeline.h"
+#include "libraries.h"
+#include "mapindex.h"
+#include "levelgraph.h"
+#include "aggregation.h"
+#include "sampling.h"
 
 
 namespace fs = std::filesystem;
@@ -26,15 +45,21 @@ std::atomic<int> g_receivedSignal = -1;
 void printUsage()
 {
 #ifdef _WIN32
-    std::cout << "Usage: mer.exe [mods... [search queries... [options...]]]\n";
+    std::cout << "Usage: mer.exe [mods... [search queries... [options...]]]\n"
+                 "       mer.exe merge PARTIAL...\n"
+                 "       mer.exe graph [mods... [options...]]\n";
 #else
-    std::cout << "Usage: mer [mods... [search queries... [options...]]]\n";
+    std::cout << "Usage: mer [mods... [search queries... [options...]]]\n"
+                 "       mer merge PARTIAL...\n"
+                 "       mer graph [mods... [options...]]\n";
 #endif
     std::cout
         << style(brightBlack|italic) << "Run without any arguments to start interactive mode\n\n"
 
         << style(bold) << "ARGUMENTS\n" << style()
-        << "  mods                 filter search to these mods only, global search otherwise (e.g. cstrike)\n\n"
+        << "  mods                 filter search to these mods only, global search otherwise (e.g. cstrike)\n"
+        << "  merge PARTIAL...     combine the partial results of --shard runs into one report\n"
+        << "  graph                write the changelevel/landmark graph of the maps as DOT and flag broken links\n\n"
 
         << style(bold) << "SEARCH QUERIES\n" << style() <<
            "  key=value pairs separated by spaces. Implicitly or-chained,\n"
@@ -42,13 +67,41 @@ void printUsage()
            "  Use square brackets on a key with multiple values to access a specific element,\n"
            "  e.g. origin[1] to query the second element.\n"
            "  Use == instead of = for exact matches only, != not matching,\n"
-           "  or </>/>=/<= for numeric comparisons.\n\n"
+           "  or </>/>=/<= for numeric comparisons.\n"
+           "  near=x,y,z,r and inbox=x1,y1,z1,x2,y2,z2 match entities by their origin.\n"
+           "  Brush entities also have mins, maxs and center keys from their model bounds.\n"
+           "  tex=name searches the names of the map's textures instead of its entities.\n"
+           "  targets:query matches entities that target an entity the query matches.\n\n"
 
         << style(bold) << "OPTIONS\n" << style()
         << "  --case       -c      make matches case sensitive\n"
         << "  --help       -h      print this message and exit\n"
         << "  --full       -f      print the full entitiy in the report\n"
         << "  --steamdir   -s      Steam or maps directory to use for this session\n"
+        << "  --dedup              scan byte-identical maps once and list every copy with the result\n"
+        << "  --effective          only scan the copy of each map the game loads (_addon, _hd, base, _downloads)\n"
+        << "  --shard I/N          scan shard I (0 to N-1) of N and write the partial result as JSON lines\n"
+        << "  --files-from FILE    scan the newline or NUL separated .bsp paths in FILE (- for stdin) as they arrive\n"
+        << "  --watch              keep rescanning maps as they change and report new, removed and changed matches\n"
+        << "  --dangling-targets   only report entities that target, killtarget or fire targetnames missing from their map\n"
+        << "  --format dot|json    output format of graph (default dot)\n"
+        << "  --group-by KEY       count matches by their value of KEY instead of listing them\n"
+        << "  --distinct KEY       list the distinct values of KEY among the matches\n"
+        << "  --count-by map|mod   count matches per map or mod, or group them by it with --group-by/--distinct\n"
+        << "  --top K              only report the K matches with the highest value of the --by key\n"
+        << "  --bottom K           only report the K matches with the lowest value of the --by key\n"
+        << "  --by KEY             numeric key, or element of one such as origin[2], to rank matches by\n"
+        << "  --sample P           only scan a share P (0.05 or 5%) of the maps of every mod and estimate the matches in all\n"
+        << "  --seed N             seed of the maps --sample picks (default 0)\n"
+        << "  --estimate           scan the maps in random order and keep refining the estimate of the matches in all of them\n"
+        << "  --build-index FILE   write the numeric keyvalues of every scanned map to FILE, queries are optional\n"
+        << "  --index FILE         only scan maps the index in FILE can't rule out for </>/<=/>=, spawnflags or classname==\n"
+        << "  --queue-depth N      maps to keep reading ahead per SSD or network drive (default 32, HDDs use 2)\n"
+        << "  --io-threads N       threads pulling maps off the I/O engine of each drive (default 1)\n"
+        << "  --parse-threads N    threads tokenizing entity lumps (default: most cores)\n"
+        << "  --match-threads N    threads evaluating the search queries (default: 1 per 8 cores)\n"
+        << "  --stats              print phase timings and throughput to stderr on exit\n"
+        << "  --trace FILE         write a Chrome trace-event JSON of the scan to FILE\n"
         << "  --version    -V      print application version and exit\n"
         << "  --verbose    -v      enable verbose logging\n\n"
 
@@ -58,293 +111,777 @@ void printUsage()
         << std::endl;
 }
 
-void Options::findGlobsInMapsDir(const fs::path& mapsDir)
+void Options::findGlobsInMapsDir(const fs::path& mapsDir, std::set<fs::path>& found) const
 {
+    MER_MEMORY_SITE("Options::findGlobs");
+    TraceSpan span{ "discover", &mapsDir };
+
     for (const auto& entry : fs::directory_iterator(mapsDir))
     {
         if (const fs::path& entryPath = entry.path(); toLowerCase(entryPath.extension().string()) == ".bsp")
-        {
-            if (g_options.absoluteDir)
-            {
-                globs.insert(entryPath);
-                continue;
-            }
-
-            fs::path shortGlob = entryPath.parent_path().parent_path().parent_path().stem()
-                / entryPath.parent_path().parent_path().stem() / entryPath.parent_path().stem() / entryPath.filename();
-            globs.insert(shortGlob);
-        }
+            found.insert(entryPath);
     }
 }
 
-void Options::findGlobsInPipes(fs::path modDir)
+void Options::findGlobsInPipes(const fs::path& modDir, std::set<fs::path>& found, std::set<fs::path>& foundDirs) const
 {
-    std::string baseMod = modDir.stem().string();
-    gamePath = modDir.parent_path();
+    const std::string baseMod = modDir.stem().string();
+    const fs::path gamePath = modDir.parent_path();
 
     if (fs::is_directory(modDir / "maps"))
-        findGlobsInMapsDir(modDir / "maps");
+    {
+        findGlobsInMapsDir(modDir / "maps", found);
+        foundDirs.insert(modDir / "maps");
+    }
 
     for (const auto& pipe : c_SteamPipes)
     {
-        modDir = gamePath / (baseMod + pipe);
-        if (fs::is_directory(modDir / "maps"))
-            findGlobsInMapsDir(modDir / "maps");
+        const fs::path pipeDir = gamePath / (baseMod + pipe);
+        if (fs::is_directory(pipeDir / "maps"))
+        {
+            findGlobsInMapsDir(pipeDir / "maps", found);
+            foundDirs.insert(pipeDir / "maps");
+        }
     }
 }
 
-void Options::findAllMods()
+std::vector<fs::path> Options::findModDirs(const fs::path& commonDir) const
 {
-    if (fs::is_directory(steamCommonDir / "Sven Co-op/svencoop"))
-        modDirs.emplace_back(steamCommonDir / "Sven Co-op/svencoop");
+    std::vector<fs::path> found;
+    if (!globalSearch)
+    {
+        for (const auto& mod : mods)
+        {
+            fs::path modDir = (mod == "svencoop" ? commonDir / "Sven Co-op" : commonDir / "Half-Life") / mod;
+            if (fs::is_directory(modDir))
+                found.push_back(std::move(modDir));
+        }
+        return found;
+    }
 
-    if (!fs::is_directory(steamCommonDir / "Half-Life"))
-        return;
+    if (fs::is_directory(commonDir / "Sven Co-op/svencoop"))
+        found.emplace_back(commonDir / "Sven Co-op/svencoop");
+
+    if (!fs::is_directory(commonDir / "Half-Life"))
+        return found;
 
-    for (const auto& entry : fs::directory_iterator(steamCommonDir / "Half-Life"))
+    for (const auto& entry : fs::directory_iterator(commonDir / "Half-Life"))
     {
-        if (!fs::exists(steamCommonDir / "Half-Life" / entry / "liblist.gam"))
+        if (!fs::exists(entry.path() / "liblist.gam"))
             continue;
 
-        modDirs.emplace_back(steamCommonDir / "Half-Life" / entry);
+        found.emplace_back(entry.path());
     }
+    return found;
 }
 
 void Options::findGlobs()
 {
-    if (fs::is_directory(g_options.steamDir) && !fs::is_directory(g_options.steamCommonDir))
+    PhaseTimer timer{ Phase::Discovery };
+
+    if (fs::is_directory(steamDir) && !fs::is_directory(steamCommonDir))
     {
-        g_options.absoluteDir = true;
-        findGlobsInMapsDir(g_options.steamDir);
+        absoluteDir = true;
+        findGlobsInMapsDir(steamDir, globs);
+        mapsDirs.insert(steamDir);
         return;
     }
 
+    // Libraries tend to be on separate drives, walk them side by side and merge what they found
+    struct LibraryGlobs
+    {
+        std::vector<fs::path> modDirs;
+        std::set<fs::path> globs;
+        std::set<fs::path> mapsDirs;
+    };
+
+    steamCommonDirs = SteamLibraries::findCommonDirs(steamDir);
+    std::vector<std::future<LibraryGlobs>> libraries;
+    for (const auto& commonDir : steamCommonDirs)
+    {
+        libraries.push_back(std::async(std::launch::async, [this, &commonDir] {
+            LibraryGlobs library{ findModDirs(commonDir), {}, {} };
+            for (const auto& modDir : library.modDirs)
+                findGlobsInPipes(modDir, library.globs, library.mapsDirs);
+            return library;
+        }));
+    }
+
+    for (auto& future : libraries)
+    {
+        LibraryGlobs library = future.get();
+        globs.merge(library.globs);
+        mapsDirs.merge(library.mapsDirs);
+        modDirs.insert(modDirs.end(), library.modDirs.begin(), library.modDirs.end());
+    }
+
+    if (effective)
+        keepEffectiveMaps();
+
     if (globalSearch)
-        findAllMods();
-    else
+        return;
+
+    for (const auto& mod : mods)
     {
-        for (const auto& mod : mods)
-        {
-            if (mod == "svencoop")
-                gamePath = g_options.steamCommonDir / "Sven Co-op";
-            else
-                gamePath = g_options.steamCommonDir / "Half-Life";
+        if (std::ranges::none_of(modDirs, [&mod](const fs::path& modDir) { return modDir.filename() == mod; }))
+            logger.warning("\"" + mod + "\" is not a directory in any Steam library");
+    }
+}
 
-            fs::path modDir = gamePath / mod;
-            if (!std::filesystem::is_directory(modDir))
-            {
-                logger.warning("\"" + modDir.string() + "\" is not a directory");
-                continue;
-            }
-            modDirs.push_back(std::move(modDir));
-        }
+void Options::keepEffectiveMaps()
+{
+    // The engine looks maps up in <mod>_addon, <mod>_hd, <mod> and then <mod>_downloads
+    const auto precedence = [](const fs::path& map) {
+        const std::string modDir = map.parent_path().parent_path().filename().string();
+        if (modDir.ends_with("_addon"))
+            return 0;
+        if (modDir.ends_with("_hd"))
+            return 1;
+        if (modDir.ends_with("_downloads"))
+            return 3;
+        return 2;
+    };
+
+    std::map<fs::path, const fs::path*> loaded;  // game/mod/map name to the copy the engine loads
+    for (const auto& glob : globs)
+    {
+        const fs::path modDir = glob.parent_path().parent_path();
+        const fs::path name = modDir.parent_path() / unSteampipe(modDir.filename().string()) / toLowerCase(glob.filename().string());
+
+        if (const auto [copy, inserted] = loaded.try_emplace(name, &glob); !inserted && precedence(glob) < precedence(*copy->second))
+            copy->second = &glob;
     }
 
-    for (const auto& modDir : modDirs)
-        findGlobsInPipes(modDir);
+    std::set<fs::path> effectiveGlobs;
+    for (const auto& copy : loaded | std::views::values)
+        effectiveGlobs.insert(*copy);
+
+    logger.log(std::format("{} of {} maps are overridden by another SteamPipe folder", globs.size() - effectiveGlobs.size(), globs.size()));
+    globs = std::move(effectiveGlobs);
+}
+
+void Options::keepShard()
+{
+    std::erase_if(globs, [this](const fs::path& glob) { return !inShard(glob); });
+}
+
+bool Options::inShard(const fs::path& glob) const
+{
+    /*
+      Hashed by display path, so every process agrees on the partition wherever its Steam directory is,
+      without the SteamPipe suffix to keep the copies of a map together for --dedup.
+    */
+    const fs::path map = displayPath(glob);
+    const std::string mod = unSteampipe(map.parent_path().parent_path().filename().string());
+    const std::string key = (map.parent_path().parent_path().parent_path() / mod / map.filename()).generic_string();
+    return hashBytes(key) % shardCount == shardIndex;
+}
+
+fs::path Options::displayPath(const fs::path& map) const
+{
+    if (listedMaps)
+        return map;
+    if (absoluteDir)
+        return map.filename();
+
+    // game/mod/maps/map.bsp, the same in every library
+    return map.parent_path().parent_path().parent_path().stem()
+        / map.parent_path().parent_path().stem() / map.parent_path().stem() / map.filename();
 }
 
 void Options::checkMaps() const
 {
+    std::vector<const fs::path*> mapGlobs;
+    mapGlobs.reserve(globs.size());
     for (const auto& glob : globs)
+        mapGlobs.push_back(&glob);
+    if (sample)
+        sample->arrange(mapGlobs);
+
+    ScanPipeline pipeline{ { ioThreads, parseThreads, matchThreads, queueDepth, dedup } };
+    scanMaps(pipeline, mapGlobs);
+}
+
+namespace
+{
+    // Paths read off a list by a background thread, for the scan to pick up as they arrive
+    struct PathList
     {
-        std::cout << "Reading "
-            << (g_options.absoluteDir ? glob.filename() : glob).string() << "\nFound " << g_options.foundEntries;
+        std::unique_ptr<std::istream> file;  // stdin when null
+        std::mutex mutex;
+        std::condition_variable arrived;
+        std::deque<fs::path> paths;
+        bool done = false;
+    };
+
+    void readPathList(const std::shared_ptr<PathList>& list)
+    {
+        std::istream& in = list->file ? *list->file : std::cin;
 
-        try { const Bsp reader{ glob }; }
-        catch (const std::runtime_error& e)
+        // Newline separated unless the list turns out to be NUL separated, as from find -print0
+        bool nulSeparated = false;
+        std::string record;
+        for (int c = in.get(); ; c = in.get())
         {
-            if (logger.getLevel() > Logging::LogLevel::Warning)
+            if (c != EOF && c != '\0' && (c != '\n' || nulSeparated))
             {
-                std::cout << c_resetTwoLines;
+                record += static_cast<char>(c);
                 continue;
             }
+            nulSeparated |= c == '\0';
 
-            std::cerr << c_resetTwoLines;  // Insert before WARNING prefix by logger
-            logger.warning("Could not read " + glob.string() + ". Reason: " + e.what(), std::source_location());
-            continue;
+            if (!nulSeparated && record.ends_with('\r'))
+                record.pop_back();
+            if (!record.empty())
+            {
+                std::lock_guard lock{ list->mutex };
+                list->paths.emplace_back(std::move(record));
+                list->arrived.notify_one();
+            }
+            record.clear();
+
+            if (c == EOF)
+                break;
         }
 
-        if ((g_receivedSignal != -1))
-            break;
+        std::lock_guard lock{ list->mutex };
+        list->done = true;
+        list->arrived.notify_one();
+    }
+}
 
-        std::cout << c_resetTwoLines;
+void Options::checkListedMaps()
+{
+    auto list = std::make_shared<PathList>();
+    if (filesFrom != "-")
+    {
+        list->file = std::make_unique<std::ifstream>(filesFrom, std::ios::binary);
+        if (!static_cast<std::ifstream&>(*list->file).is_open())
+            throw std::runtime_error("Could not open " + filesFrom.string() + " for reading");
+    }
+
+    // Detached since a pipe may never close, the list is shared so the reader can outlive the scan
+    std::thread{ readPathList, list }.detach();
+
+    ScanPipeline pipeline{ { ioThreads, parseThreads, matchThreads, queueDepth, dedup } };
+    std::vector<const fs::path*> batch;
+    while (g_receivedSignal == -1)
+    {
+        std::deque<fs::path> arrived;
+        {
+            std::unique_lock lock{ list->mutex };
+            // Woken now and then to notice Ctrl+C while the list's producer is idle
+            const auto ready = [&list] { return !list->paths.empty() || list->done || g_receivedSignal != -1; };
+            while (!list->arrived.wait_for(lock, std::chrono::milliseconds(100), ready)) {}
+            if (list->paths.empty() || g_receivedSignal != -1)
+                break;
+            arrived.swap(list->paths);
+        }
+
+        // Everything that arrived while the last batch was scanned makes up the next one
+        batch.clear();
+        for (auto& path : arrived)
+        {
+            if (shardCount && !inShard(path))
+                continue;
+            if (const auto [glob, inserted] = globs.insert(std::move(path)); inserted)
+                batch.push_back(&*glob);
+        }
+        scanMaps(pipeline, batch);
     }
 }
 
+void Options::rescanMaps(const std::vector<fs::path>& maps)
+{
+    std::vector<const fs::path*> batch;
+    batch.reserve(maps.size());
+    for (const auto& map : maps)
+        batch.push_back(&*globs.insert(map).first);
+
+    // Not deduplicated against the earlier scans, a map rewritten as it was would pass for a copy of itself
+    ScanPipeline pipeline{ { ioThreads, parseThreads, matchThreads, queueDepth, false } };
+    scanMaps(pipeline, batch);
+}
 
-Bsp::Bsp(const std::filesystem::path& filepath) {
-    m_filepath = filepath;
-    m_file.open(g_options.steamCommonDir / filepath, std::ios::binary);
-    if (!m_file.is_open() || !m_file.good())
+void Options::loadIndex()
+{
+    // Without queries only --dangling-targets is looked for, which the index knows nothing about
+    if (!firstQuery)
+        return;
+
+    index = std::make_shared<MapIndex>(indexFile);
+    const std::size_t selected = index->selectMaps(*firstQuery);
+    logger.log(std::format("{} of {} indexed maps can have matches", selected, index->mapCount()));
+}
+
+void Options::scanMaps(ScanPipeline& pipeline, const std::vector<const fs::path*>& allMaps) const
+{
+    // Maps the index rules out have nothing to report, those it doesn't know or that changed are scanned as usual
+    std::vector<const fs::path*> unindexed;
+    const bool useIndex = index && !buildIndex;
+    if (useIndex)
+    {
+        for (const fs::path* map : allMaps)
+        {
+            if (!index->rulesOut(*map))
+                unindexed.push_back(map);
+            else if (sample)
+                sample->add(*map, 0);  // As good as scanned for the estimate
+        }
+    }
+    const std::vector<const fs::path*>& maps = useIndex ? unindexed : allMaps;
+
+    if (buildIndex || levelGraph)
     {
-        m_file.close();
-        throw std::runtime_error("Could not open file for reading");
+        pipeline.setInspector([this, &maps](const std::size_t i, const Bsp& bsp) {
+            if (buildIndex)
+                index->add(*maps[i], bsp.entities());
+            if (levelGraph)
+                levelGraph->add(*maps[i], bsp.entities());
+        });
     }
 
-    m_file.read(reinterpret_cast<char*>(&m_header), sizeof(BspHeader));
+    bool progressShown = false;
 
+    pipeline.run(maps, [&](MapResult& result) {
+        const fs::path& glob = *maps[result.index];
+
+        // Progress of the previous map stays up until the next result is in
+        if (showProgress)
+        {
+            if (progressShown)
+                std::cout << c_resetTwoLines;
+            // Aggregated and ranked matches never reach the results, only the counter of the matcher threads
+            std::cout << "Reading " << displayPath(glob).string() << '\n';
+            if (estimate)
+                std::cout << sample->progress();
+            else
+                std::cout << "Found " << (aggregation || topMatches ? g_stats.matches.load() : g_options.foundEntries);
+            progressShown = true;
+        }
+
+        if (!result.error.empty())
+        {
+            ++g_stats.mapsFailed;
+            const bool quiet = logger.getLevel() > Logging::LogLevel::Warning;
+            if (progressShown)
+                (quiet ? std::cout : std::cerr) << c_resetTwoLines;  // Insert before WARNING prefix by logger
+            progressShown = false;
+
+            if (!quiet)
+                logger.warning("Could not read " + displayPath(glob).string() + ". Reason: " + result.error, std::source_location());
+            if (levelGraph)
+                levelGraph->addUnreadable(glob);
+
+            // Matches before the entity that couldn't be read are still reported, a map without any counts as scanned
+            if (result.entries.empty())
+            {
+                if (sample)
+                    sample->add(glob, 0);
+                return true;
+            }
+        }
+
+        if (result.duplicateOf)
+        {
+            g_options.duplicates[*result.duplicateOf].push_back(glob);
+            if (levelGraph)
+                levelGraph->addCopy(glob, *result.duplicateOf);
+            if (aggregation)
+                aggregation->addCopy(glob, *result.duplicateOf);
+            if (sample)
+                sample->add(glob, result.duplicateMatches);
+            return g_receivedSignal == -1;
+        }
+
+        if (sample)
+            sample->add(glob, result.entries.size());
+        if (!result.entries.empty())
+        {
+            g_options.foundEntries += static_cast<unsigned int>(result.entries.size());
+            g_options.entries[glob] = std::move(result.entries);
+        }
+
+        return g_receivedSignal == -1;
+    });
+
+    if (progressShown && g_receivedSignal == -1)
+        std::cout << c_resetTwoLines;
+}
+
+
+Bsp::Bsp(const std::filesystem::path& filepath, MapArena& arena)
+    : Bsp(filepath, IoEngine::readMap(filepath, scanExtras()), arena) {}
+
+Bsp::Bsp(const std::filesystem::path& filepath, const MapBuffer& map, MapArena& arena) : m_arena(arena), m_entities(&arena), m_textures(&arena) {
+    m_filepath = filepath;
+
+    if (!map.error.empty())
+        throw std::runtime_error(map.error);
+
+    m_header = map.header;
     if (m_header.version != 30 && m_header.version != 29)
         throw std::runtime_error("Unexpected BSP version: " + style(info) + std::to_string(m_header.version) + style());
 
+    readEntityLump(map);
     parse();
-    m_file.close();
+    const MapExtras extras = scanExtras();
+    if (extras.models)
+        readBounds(map);
+    if (extras.textures)
+        readTextures(map);
+
+    ++g_stats.mapsRead;
 }
 
-bool Bsp::readComment()
+void Bsp::readLump(const BspLump& lump)
 {
-    if (m_file.peek() != '/')
-        return false;
+    PhaseTimer timer{ Phase::Read, &m_filepath };
+    if (lump.offset < 0 || lump.length < 0)
+        throw std::runtime_error("Invalid lump offset or length");
+
+    auto* buffer = static_cast<char*>(m_arena.allocate(lump.length, 1));
+    const std::size_t length = IoEngine::readRange(m_filepath, lump.offset, lump.length, buffer);
 
-    m_file.get();  // Consume first slash
+    m_lump = { buffer, length };
+    m_cursor = 0;
+}
+
+void Bsp::readBounds(const MapBuffer& map)
+{
+    const std::vector<BspModel>& models = map.models;
 
-    if (m_file.peek() != '/')  // If next character is not slash, undo and return
+    const auto setVector = [this](Entity& entity, const std::string_view key, const Vec3& vector) {
+        // Keys the mapper set themselves win over the derived ones
+        if (entity.contains(key))
+            return;
+
+        const std::string text = std::format("{} {} {}", vector[0], vector[1], vector[2]);
+        auto* buffer = static_cast<char*>(m_arena.allocate(text.size(), 1));
+        std::ranges::copy(text, buffer);
+        entity.insert_or_assign(key, { buffer, text.size() });
+    };
+
+    for (Entity& entity : m_entities)
     {
-        m_file.unget();
-        return false;
+        // Brush entities refer to their model as *N, N indexing into the Models lump
+        if (!entity.contains("model") || !entity.at("model").starts_with('*'))
+            continue;
+
+        const int model = toInt(entity.at("model").substr(1));
+        if (model < 0 || static_cast<std::size_t>(model) >= models.size())
+            continue;
+
+        // Models of brush entities with an origin brush are built around it, and moved to the origin in game
+        Vec3 offset{};
+        if (const std::optional<Vec3> origin = entityOrigin(entity))
+            offset = *origin;
+
+        Vec3 mins, maxs, center;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            mins[axis] = models[model].mins[axis] + offset[axis];
+            maxs[axis] = models[model].maxs[axis] + offset[axis];
+            center[axis] = (mins[axis] + maxs[axis]) / 2.;
+        }
+        setVector(entity, "mins", mins);
+        setVector(entity, "maxs", maxs);
+        setVector(entity, "center", center);
     }
+}
 
-    char c;
-    while (m_file.get(c))
+void Bsp::readTextures(const MapBuffer& map)
+{
+    // Headers the reader couldn't find in the lump are left zeroed, without a name
+    const std::vector<BspMipTexture>& headers = map.textures;
+    m_textures.reserve(headers.size());
+    for (unsigned int i = 0u; i < headers.size(); ++i)
     {
-        if (c == '\n')
-            break;
+        const std::size_t nameLength = std::ranges::find(headers[i].name, '\0') - std::ranges::begin(headers[i].name);
+        if (nameLength == 0)
+            continue;
+
+        auto* name = static_cast<char*>(m_arena.allocate(nameLength * 2, 1));
+        std::copy_n(headers[i].name, nameLength, name);
+        std::transform(name, name + nameLength, name + nameLength, [](const char c) { return static_cast<char>(std::tolower(static_cast<unsigned char>(c))); });
+        m_textures.push_back({ i, { name, nameLength }, { name + nameLength, nameLength }, headers[i].offsets[0] != 0 });
     }
+}
+
+void Bsp::skipWhitespace()
+{
+    while (m_cursor < m_lump.size() && std::isspace(static_cast<unsigned char>(m_lump[m_cursor])))
+        ++m_cursor;
+}
+
+bool Bsp::readComment()
+{
+    if (!m_lump.substr(m_cursor).starts_with("//"))
+        return false;
+
+    const size_t lineEnd = m_lump.find('\n', m_cursor);
+    m_cursor = lineEnd == std::string_view::npos ? m_lump.size() : lineEnd + 1;
     return true;
 }
 
-void Bsp::parse()
+void Bsp::readEntityLump(const MapBuffer& map)
 {
-    BspLump& entLump = m_header.lumps[Entities];
-    m_file.seekg(entLump.offset, std::ios::beg);
+    m_lump = { map.lump.data(), map.lump.size() };
+    m_cursor = 0;
 
-    while (isspace(m_file.peek()))  // Skip whitepaces
-        m_file.get();
+    skipWhitespace();
 
     // I've found at least one example of BSP29 using comments as headers over each entity, skip these
     while (readComment()) {}
 
 
     // If the next byte isn't {, check if we need to flip planes and entities lumps, we might have a bshift BSP
-    if (m_file.peek() != '{')
+    if (m_cursor >= m_lump.size() || m_lump[m_cursor] != '{')
     {
-        entLump = m_header.lumps[Planes];
-        m_file.seekg(entLump.offset, std::ios::beg);
-        while (isspace(m_file.peek()))  // Skip whitepaces
-            m_file.get();
-        if (m_file.peek() != '{')
+        readLump(m_header.lumps[Planes]);
+        skipWhitespace();
+        if (m_cursor >= m_lump.size() || m_lump[m_cursor] != '{')
             throw std::runtime_error("Unexpected BSP format");
     }
+}
 
+void Bsp::parse()
+{
+    PhaseTimer timer{ Phase::Tokenize, &m_filepath };
+    MER_MEMORY_SITE("Bsp::parse");
 
-    const int lumpEnd = entLump.offset + entLump.length;
+    // Entities up to malformed data are kept, and matched like those of any other map
+    Tokenizer::Result result{ &m_arena };
+    try
+    {
+        Tokenizer::tokenize(m_lump, m_cursor, result);
+    }
+    catch (const std::runtime_error& e)
+    {
+        m_error = e.what();
+    }
 
-    char c;
-    unsigned int i = 0u;
-    while (m_file.get(c) && m_file.tellg() < lumpEnd)
+    m_entities.reserve(result.entityEnds.size());
+    size_t token = 0;
+    for (const uint32_t entityEnd : result.entityEnds)
     {
-        if (c == '{')
-        {
-            Entity entity = readEntity();
-            EntityEntry matchEntry = g_options.firstQuery->testChain(entity, i++);
+        Entity entity{ &m_arena };
+        for (; token + 1 < entityEnd; token += 2)
+            entity.insert_or_assign(tokenText(result.tokens[token]), tokenText(result.tokens[token + 1]));
+
+        token = entityEnd;
+        m_entities.push_back(std::move(entity));
+    }
+
+    g_stats.entitiesParsed += m_entities.size();
+}
 
-            if (!matchEntry.matched)
+std::vector<EntityEntry> Bsp::match() const
+{
+    MER_MEMORY_SITE("Bsp::match");
+    PhaseTimer timer{ Phase::Match, &m_filepath };
+
+    std::vector<EntityEntry> entries;
+    if (!g_options.firstQuery && !g_options.danglingTargets && !g_options.aggregation && !g_options.topMatches)
+        return entries;
+
+    const MatchContext context = matchContext();
+
+    // Aggregated matches are only counted and nothing about them is copied, like ranked matches that don't make the cut
+    const std::string scope = g_options.aggregation ? g_options.aggregation->keyOf(m_filepath) : std::string{};
+    std::size_t counted = 0;
+
+    for (unsigned int i = 0u; i < m_entities.size(); ++i)
+    {
+        const Entity& entity = m_entities[i];
+        EntityEntry matchEntry = g_options.firstQuery ? g_options.firstQuery->testChain(entity, i, &context) : EntityEntry{ .matched = true, .index = i };
+
+        if (!matchEntry.matched)
+            continue;
+
+        if (g_options.danglingTargets)
+        {
+            const std::string dangling = context.danglingTargets(entity);
+            if (dangling.empty())
                 continue;
+            matchEntry.queryMatches += (matchEntry.queryMatches.empty() ? "" : " AND ") + dangling;
+        }
 
-            matchEntry.targetname = entity.contains("targetname") ? entity.at("targetname") : "";
+        if (g_options.aggregation)
+        {
+            g_options.aggregation->add(scope, entity);
+            ++counted;
+            continue;
+        }
 
-            if (g_options.printFullEnt)
-                matchEntry.fullEnt = std::move(entity);
+        // Ranked matches are only copied out when they make the cut
+        std::optional<double> rank;
+        if (g_options.topMatches)
+        {
+            rank = g_options.topMatches->valueOf(entity);
+            if (!rank)
+                continue;
+            ++counted;
+            if (!g_options.topMatches->wants(*rank, m_filepath, i))
+                continue;
+        }
 
-            if (!g_options.entries.contains(m_filepath))
-                g_options.entries.insert_or_assign(m_filepath, std::vector<EntityEntry>{});
+        // Only matches are copied out of the arena
+        matchEntry.classname = entity.contains("classname") ? entity.at("classname") : "";
+        matchEntry.targetname = entity.contains("targetname") ? entity.at("targetname") : "";
 
-            g_options.entries.at(m_filepath).push_back(matchEntry);
-            ++g_options.foundEntries;
+        if (g_options.printFullEnt)
+        {
+            matchEntry.fullEnt.reserve(entity.size());
+            for (const auto& [key, value] : entity)
+                matchEntry.fullEnt.emplace_back(key, value);
         }
-    }
-}
 
-std::string Bsp::readToken(const int maxLength)
-{
-    std::string token;
-    token.reserve(maxLength);
+        if (rank)
+            g_options.topMatches->add(*rank, m_filepath, std::move(matchEntry));
+        else
+            entries.push_back(std::move(matchEntry));
+    }
 
-    char c;
-    int i = 0;
-    while (m_file.get(c))
+    // Textures are matched as entities holding nothing but their name, and reported under it
+    for (const Texture& texture : m_textures)
     {
-        ++i;
+        Entity entity{ &m_arena };
+        entity.insert_or_assign(Query::c_textureKey, texture.lowerName);
+        EntityEntry matchEntry = g_options.firstQuery->testChain(entity, texture.index);
 
-        if (c == '"')
-            break;
+        // Texture names have no numeric keys to rank, nor targets to dangle
+        if (!matchEntry.matched || g_options.topMatches || g_options.danglingTargets)
+            continue;
 
-        if (c == '\n')
+        if (g_options.aggregation)
         {
-            token += "\\n";
+            g_options.aggregation->add(scope, entity);
+            ++counted;
             continue;
         }
 
-        if (c == '\r')
-            continue;
+        matchEntry.classname = texture.name;
+        matchEntry.queryMatches += texture.embedded ? ", embedded" : ", external";
+        if (g_options.printFullEnt)
+        {
+            matchEntry.fullEnt.emplace_back(Query::c_textureKey, texture.name);
+            matchEntry.fullEnt.emplace_back("embedded", texture.embedded ? "1" : "0");
+        }
 
-        token.push_back(c);
+        entries.push_back(std::move(matchEntry));
     }
 
-    return token;
+    g_stats.queriesEvaluated += m_entities.size() + m_textures.size();
+    g_stats.matches += entries.size() + counted;
+    return entries;
 }
 
-Entity Bsp::readEntity()
+MatchContext Bsp::matchContext() const
 {
-    Entity entity;
-    const std::streamoff start = m_file.tellg();
+    MatchContext context{ .entities = m_entities };
 
-    char c;
-    while (m_file.get(c))
+    // Regions are looked up in a grid of the entity origins built once, instead of testing every entity against each
+    std::optional<SpatialGrid> grid;
+    for (const Query* query = g_options.firstQuery; query; query = query->next)
     {
-        if (isspace(c)) continue;
-        if (c == '}') break;
+        if (!query->region)
+            continue;
 
-        if (c == '"')
+        if (!grid)
         {
-            std::string key = readToken(c_MaxKeyLength);
+            std::vector<std::optional<Vec3>> origins;
+            origins.reserve(m_entities.size());
+            for (const Entity& entity : m_entities)
+                origins.push_back(entityOrigin(entity));
+            grid.emplace(origins);
+        }
 
-            while (m_file.get(c))
-            {
-                if (isspace(c)) continue;
+        std::vector<bool>& inside = context.inRegion.emplace_back(query, std::vector<bool>(m_entities.size())).second;
+        grid->find(*query->region, inside);
+    }
 
-                if (c == '"')
-                {
-                    std::string value = readToken(c_MaxValueLength);
-                    entity.insert_or_assign(key, value);
+    // References are resolved through a hash of the targetnames built once, instead of searching the map for each of them
+    bool resolveTargets = g_options.danglingTargets;
+    for (const Query* query = g_options.firstQuery; query; query = query->next)
+        resolveTargets |= query->targetQuery != nullptr;
+    if (!resolveTargets)
+        return context;
 
-                    // Skip comments at end of line (occurs in certain SC maps)
-                    if (m_file.peek() == '/')
-                        while (m_file.get(c))
-                            if (c == '\n')
-                                break;
+    for (unsigned int i = 0u; i < m_entities.size(); ++i)
+        forEachTargetname(m_entities[i], [&context, i](const std::string_view name) { context.targetnames[name].push_back(i); });
 
-                    break;
-                }
+    // Each entity is tested once against what targets: queries look for, whichever entities refer to it
+    for (const Query* query = g_options.firstQuery; query; query = query->next)
+    {
+        if (!query->targetQuery)
+            continue;
 
-                // Print out the rest of the entity before the unexpected data was encountered
-                const std::streamoff offset = m_file.tellg();
-                std::vector<unsigned char> rawEntBuffer;
-                rawEntBuffer.resize(offset - start);
-                m_file.seekg(start);
-                m_file.read(reinterpret_cast<char*>(&rawEntBuffer[0]), offset - start);
+        std::vector<bool> matched(m_entities.size());
+        for (unsigned int i = 0u; i < m_entities.size(); ++i)
+            matched[i] = query->targetQuery->testEntity(m_entities[i], i, &context).matched;
+        context.targeted.emplace_back(query, std::move(matched));
+    }
+    return context;
+}
 
-                throw std::runtime_error("Unexpected entity data near " + style(info|dim) + std::string(rawEntBuffer.begin(), rawEntBuffer.end()) + style());
-            }
+std::string_view Bsp::tokenText(const Tokenizer::Token& token) const
+{
+    const std::string_view text = m_lump.substr(token.begin, token.end - token.begin);
+    if (!token.escaped)
+        return text;
+
+    // Newlines are escaped and carriage returns stripped, the token no longer fits the lump so it goes in the arena
+    auto* escaped = static_cast<char*>(m_arena.allocate(text.size() * 2, 1));
+    size_t length = 0;
+    for (const char c : text)
+    {
+        if (c == '\n')
+        {
+            escaped[length++] = '\\';
+            escaped[length++] = 'n';
+            continue;
         }
+
+        if (c == '\r')
+            continue;
+
+        escaped[length++] = c;
     }
 
-    return entity;
+    return { escaped, length };
 }
 
-static std::string keyStartsWith(const Entity& entity, const std::string_view& prefix)
+
+bool Entity::contains(const std::string_view key) const
 {
-    for (const auto& key: entity | std::views::keys)
+    return std::ranges::any_of(m_keyvalues, [key](const KeyValue& keyvalue) { return keyvalue.key == key; });
+}
+
+std::string_view Entity::at(const std::string_view key) const
+{
+    for (const auto& [entityKey, value] : m_keyvalues)
+        if (entityKey == key)
+            return value;
+    throw std::out_of_range("Entity has no key " + std::string(key));
+}
+
+void Entity::insert_or_assign(const std::string_view key, const std::string_view value)
+{
+    for (auto& keyvalue : m_keyvalues)
+    {
+        if (keyvalue.key == key)
+        {
+            keyvalue.value = value;
+            return;
+        }
+    }
+    m_keyvalues.push_back({ key, value });
+}
+
+static std::string_view keyStartsWith(const Entity& entity, const std::string_view& prefix)
+{
+    for (const auto& [key, value] : entity)
         if (!key.empty() && key.starts_with(prefix))
             return key;
     return "";
@@ -366,7 +903,7 @@ static bool partialMatch(const std::string_view& str, const std::string_view& se
     return str.starts_with(search);
 }
 
-static std::string valueStartsWith(const Entity& entity, const std::string_view& prefix)
+static std::string_view valueStartsWith(const Entity& entity, const std::string_view& prefix)
 {
     for (const auto& [key, value] : entity)
         if (partialMatch(value, prefix))
@@ -374,28 +911,197 @@ static std::string valueStartsWith(const Entity& entity, const std::string_view&
     return "";
 }
 
-static bool isValueNumeric(const std::string_view& value, double& numeric)
+// What Bsp::match tests the texture terms against for each texture
+static bool isTextureEntity(const Entity& entity)
+{
+    return entity.size() == 1 && entity.contains(Query::c_textureKey);
+}
+
+bool isValueNumeric(const std::string_view& value, double& numeric)
 {
-    std::string valueTrimmed;
+    std::string_view valueTrimmed = value;
     if (size_t suffixPos = value.find('#'); suffixPos != std::string::npos)
         valueTrimmed = value.substr(0, suffixPos);
     else if (suffixPos = value.find(' '); suffixPos != std::string::npos)
         valueTrimmed = value.substr(0, suffixPos);
-    else
-        valueTrimmed = std::string{ value };
 
+    // strtod needs a terminated string, copy short values to the stack rather than allocating for every value tested
     char* err;
-    numeric = std::strtod(valueTrimmed.c_str(), &err);
+    if (char buffer[64]; valueTrimmed.size() < sizeof(buffer))
+    {
+        valueTrimmed.copy(buffer, valueTrimmed.size());
+        buffer[valueTrimmed.size()] = '\0';
+        numeric = std::strtod(buffer, &err);
+        return !*err;
+    }
 
-    if (*err)
-        return false;
+    const std::string terminated{ valueTrimmed };
+    numeric = std::strtod(terminated.c_str(), &err);
+    return !*err;
+}
 
-    return true;
+int toInt(std::string_view value)
+{
+    while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front())))
+        value.remove_prefix(1);
+    if (value.starts_with('+'))
+        value.remove_prefix(1);
+
+    int result = 0;
+    std::from_chars(value.data(), value.data() + value.size(), result);
+    return result;
+}
+
+int elementCount(const std::string_view value)
+{
+    if (value.empty())
+        return 0;
+    return static_cast<int>(std::ranges::count(value, ' ') + (value.back() == ' ' ? 0 : 1));
+}
+
+int elementPosition(const int index, const int count)
+{
+    if (index >= 0)
+        return index < count ? index : -1;
+    return count ? (index % count + count) % count : -1;
+}
+
+std::string_view elementAt(const std::string_view value, const int index)
+{
+    const int element = elementPosition(index, elementCount(value));
+    if (element < 0)
+        return {};
+
+    size_t start = 0;
+    for (int i = 0; i < element; ++i)
+        start = value.find(' ', start) + 1;
+
+    return value.substr(start, value.find(' ', start) - start);
+}
+
+bool chainNeedsBounds(const Query* first)
+{
+    for (const Query* query = first; query; query = query->next)
+    {
+        if (query->region || Query::isBoundsKey(query->key) || (query->targetQuery && chainNeedsBounds(query->targetQuery.get())))
+            return true;
+    }
+    return false;
+}
+
+bool chainNeedsTextures(const Query* first)
+{
+    for (const Query* query = first; query; query = query->next)
+    {
+        if (query->key == Query::c_textureKey)
+            return true;
+    }
+    return false;
+}
+
+MapExtras scanExtras()
+{
+    return {
+        chainNeedsBounds(g_options.firstQuery) || (g_options.topMatches && Query::isBoundsKey(g_options.topMatches->key())),
+        chainNeedsTextures(g_options.firstQuery)
+    };
+}
+
+std::optional<Vec3> entityOrigin(const Entity& entity)
+{
+    const std::string_view key = entity.contains("origin") ? "origin" : "center";
+    if (!entity.contains(key))
+        return std::nullopt;
+
+    const std::string_view origin = entity.at(key);
+    if (elementCount(origin) < 3)
+        return std::nullopt;
+
+    Vec3 position;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if (!isValueNumeric(elementAt(origin, axis), position[axis]) || !std::isfinite(position[axis]))
+            return std::nullopt;
+    }
+    return position;
+}
+
+const std::vector<bool>* MatchContext::regionMatches(const Query* query) const
+{
+    const auto found = std::ranges::find(inRegion, query, &std::pair<const Query*, std::vector<bool>>::first);
+    return found == inRegion.end() ? nullptr : &found->second;
+}
+
+const std::vector<bool>* MatchContext::targetMatches(const Query* query) const
+{
+    const auto found = std::ranges::find(targeted, query, &std::pair<const Query*, std::vector<bool>>::first);
+    return found == targeted.end() ? nullptr : &found->second;
+}
+
+std::string MatchContext::danglingTargets(const Entity& entity) const
+{
+    std::string dangling;
+    forEachReference(entity, [this, &dangling](const std::string_view key, const std::string_view name) {
+        // Names like !activator and !player are resolved by the game
+        if (name.starts_with('!') || targetnames.contains(name))
+            return;
+        dangling += std::format("{}{}={} (dangling)", dangling.empty() ? "" : ", ", key, name);
+    });
+    return dangling;
+}
+
+// Keys that name the entities to fire, kill or otherwise use by their targetname
+static constexpr std::array<std::string_view, 9> c_referenceKeys{
+    "target", "killtarget", "master", "TriggerTarget", "m_iszEntity", "m_iszNewTarget",
+    "LightningStart", "LightningEnd", "changetarget"
+};
+// Keys of a multi_manager that aren't the entities it fires
+static constexpr std::array<std::string_view, 5> c_multiManagerKeys{ "classname", "targetname", "origin", "spawnflags", "wait" };
+// The netname of most entities is a name of their own, these fire the entities it names
+static constexpr std::array<std::string_view, 1> c_netnameReferenceClasses{ "path_track" };
+// And these give it as targetname to the monsters they spawn
+static constexpr std::array<std::string_view, 2> c_spawnerClasses{ "monstermaker", "squadmaker" };
+
+void forEachReference(const Entity& entity, const std::function<void(std::string_view key, std::string_view name)>& visit)
+{
+    const std::string_view classname = entity.contains("classname") ? entity.at("classname") : "";
+    const bool multiManager = classname == "multi_manager";
+    const bool netnameReference = std::ranges::find(c_netnameReferenceClasses, classname) != c_netnameReferenceClasses.end();
+    for (const auto& [key, value] : entity)
+    {
+        if (multiManager && std::ranges::find(c_multiManagerKeys, key) == c_multiManagerKeys.end())
+        {
+            if (const std::string_view name = key.substr(0, key.find('#')); !name.empty())
+                visit(key, name);
+            continue;
+        }
+
+        if (!value.empty() && (std::ranges::find(c_referenceKeys, key) != c_referenceKeys.end() || (netnameReference && key == "netname")))
+            visit(key, value);
+    }
+}
+
+void forEachTargetname(const Entity& entity, const std::function<void(std::string_view name)>& visit)
+{
+    if (entity.contains("targetname"))
+        visit(entity.at("targetname"));
+
+    const bool spawner = entity.contains("classname") && std::ranges::find(c_spawnerClasses, entity.at("classname")) != c_spawnerClasses.end();
+    if (spawner && entity.contains("netname") && !entity.at("netname").empty())
+        visit(entity.at("netname"));
 }
 
 
 Query::Query(const std::string_view& rawQuery)
 {
+    // The rest of a targets: query is a query of its own, on the entities referred to
+    if (rawQuery.starts_with(c_targetsPrefix))
+    {
+        targetQuery = std::make_shared<const Query>(rawQuery.substr(c_targetsPrefix.size()));
+        valid = targetQuery->valid;
+        return;
+    }
+
     parse(rawQuery);
 
     if (value == "**")
@@ -410,6 +1116,16 @@ Query::Query(const std::string_view& rawQuery)
 
     checkIndexedKey();
     valueIsNumeric = isValueNumeric(value, valueNumeric);
+
+    if (op == QueryEquals && !elementAccess && Region::isRegionKey(key))
+    {
+        region = Region::parse(key, value);
+        valid = region.has_value();
+    }
+
+    // Like the engine, texture names don't care about case
+    if (key == c_textureKey)
+        value = toLowerCase(value);
 }
 
 void Query::parse(const std::string_view& rawQuery)
@@ -472,10 +1188,15 @@ void Query::checkIndexedKey()
     if (key.empty())
         return;
 
-    if (size_t pos = key.find('['), posEnd = key.find(']'); pos != std::string::npos && posEnd != std::string::npos)
+    if (size_t pos = key.find('['), posEnd = key.find(']'); pos != std::string::npos && posEnd != std::string::npos && pos < posEnd)
     {
-        const std::string& rawIndex = key.substr(pos + 1, key.length() - posEnd);
-        valueIndex = std::stoi(rawIndex);
+        const std::string_view rawIndex = std::string_view(key).substr(pos + 1, posEnd - pos - 1);
+        const auto [end, error] = std::from_chars(rawIndex.data(), rawIndex.data() + rawIndex.size(), valueIndex);
+        if (rawIndex.empty() || error != std::errc{} || end != rawIndex.data() + rawIndex.size())
+        {
+            valid = false;
+            return;
+        }
         key = key.substr(0, pos);
         elementAccess = true;
     }
@@ -483,28 +1204,71 @@ void Query::checkIndexedKey()
 
 
 // TODO: Clean up, make more DRY
-EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
+EntityEntry Query::testEntity(const Entity& entity, unsigned int index, const MatchContext* context) const
 {
-    EntityEntry entry{ .index = index, .classname = entity.at("classname") };
+    MER_MEMORY_SITE("Query::testEntity");
+    EntityEntry entry{ .index = index };
+
+    if (targetQuery)
+    {
+        if (!context)
+            return entry;
+
+        const std::vector<bool>* targeted = context->targetMatches(this);
+        forEachReference(entity, [&](const std::string_view referenceKey, const std::string_view name) {
+            const auto found = context->targetnames.find(name);
+            if (entry.matched || found == context->targetnames.end())
+                return;
+
+            for (const unsigned int target : found->second)
+            {
+                if (targeted && !(*targeted)[target])
+                    continue;
+
+                const EntityEntry targetEntry = targetQuery->testEntity(context->entities[target], target, context);
+                if (!targetEntry.matched)
+                    continue;
+
+                entry.matched = true;
+                entry.queryMatches = std::format("{}={} ({})", referenceKey, name, targetEntry.queryMatches);
+                return;
+            }
+        });
+        return entry;
+    }
 
     // Nothing to test
     if (key.empty() && value.empty())
         return entry;
 
+    // Texture terms never match real entities, not even on keys that merely start with tex, and nothing else matches textures
+    if ((key == c_textureKey) != isTextureEntity(entity))
+        return entry;
+
+    if (region)
+    {
+        if (const std::vector<bool>* inside = context ? context->regionMatches(this) : nullptr)
+            entry.matched = (*inside)[index];
+        else
+        {
+            const std::optional<Vec3> origin = entityOrigin(entity);
+            entry.matched = origin && region->contains(*origin);
+        }
+
+        if (entry.matched)
+        {
+            const std::string_view key = entity.contains("origin") ? "origin" : "center";
+            entry.queryMatches = std::format("{}={}", key, entity.at(key));
+        }
+        return entry;
+    }
+
     if (elementAccess)
     {
         if (key.empty() || !entity.contains(key))
             return entry;
 
-        auto parts = splitString(entity.at(key), ' ');
-
-        std::string needle;
-        if (valueIndex > (parts.size() - 1))
-            needle = "";
-        else if (valueIndex < 0)
-            needle = parts[parts.size() + (valueIndex % parts.size())];
-        else
-            needle = parts[valueIndex];
+        const std::string_view needle = elementAt(entity.at(key), valueIndex);
 
         switch (op)
         {
@@ -629,14 +1393,14 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
     if (key == "spawnflags" && valueIsNumeric && entity.contains(key))
     {
         auto valueUInt = static_cast<unsigned int>(valueNumeric);
-        if (unsigned int spawnflags = std::atoi(entity.at(key).c_str()); spawnflags > 0)
+        if (unsigned int spawnflags = toInt(entity.at(key)); spawnflags > 0)
         {
             switch (op)
             {
             case QueryEquals:
                 if (spawnflags & valueUInt)
                 {
-                    entry.queryMatches = key + '=' + entity.at(key);
+                    entry.queryMatches = std::format("{}={}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -652,7 +1416,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             case QueryExact:
                 if ((spawnflags & valueUInt) == valueUInt)
                 {
-                    entry.queryMatches = key + '=' + entity.at(key);
+                    entry.queryMatches = std::format("{}={}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -660,7 +1424,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             case QueryGreater:
                 if (spawnflags > valueUInt)
                 {
-                    entry.queryMatches = key + ">" + entity.at(key);
+                    entry.queryMatches = std::format("{}>{}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -668,7 +1432,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             case QueryLess:
                 if (spawnflags < valueUInt)
                 {
-                    entry.queryMatches = key + "<" + entity.at(key);
+                    entry.queryMatches = std::format("{}<{}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -676,7 +1440,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             case QueryGreaterEquals:
                 if (spawnflags >= valueUInt)
                 {
-                    entry.queryMatches = key + ">=" + entity.at(key);
+                    entry.queryMatches = std::format("{}>={}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -684,7 +1448,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             case QueryLessEquals:
                 if (spawnflags <= valueUInt)
                 {
-                    entry.queryMatches = key + "<=" + entity.at(key);
+                    entry.queryMatches = std::format("{}<={}", key, entity.at(key));
                     entry.matched = true;
                     return entry;
                 }
@@ -702,18 +1466,20 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
     {
         if (!key.empty())
         {
-            if (const std::string& needle = keyStartsWith(entity, key); !needle.empty())
+            if (const std::string_view needle = keyStartsWith(entity, key); !needle.empty())
             {
                 if (value.empty())
                 {
-                    entry.queryMatches = needle + '=';
+                    entry.queryMatches = std::format("{}=", needle);
                     entry.matched = true;
                     return entry;
                 }
 
-                if (entity.at(needle).starts_with(value))
+                // Texture names take the same wildcards as values searched for without a key
+                const bool matched = key == c_textureKey ? partialMatch(entity.at(needle), value) : entity.at(needle).starts_with(value);
+                if (matched)
                 {
-                    entry.queryMatches = needle + '=' + entity.at(needle);
+                    entry.queryMatches = std::format("{}={}", needle, entity.at(needle));
                     entry.matched = true;
                     return entry;
                 }
@@ -723,9 +1489,9 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
         }
         if (!value.empty())
         {
-            if (const std::string& needle = valueStartsWith(entity, value); !needle.empty())
+            if (const std::string_view needle = valueStartsWith(entity, value); !needle.empty())
             {
-                entry.queryMatches = needle + '=' + entity.at(needle);
+                entry.queryMatches = std::format("{}={}", needle, entity.at(needle));
                 entry.matched = true;
                 return entry;
             }
@@ -752,7 +1518,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
         {
             if (valueStartsWith(entity, value).empty())
             {
-                entry.queryMatches = std::format("!={} ({})", value, entity.at(key));
+                entry.queryMatches = std::format("!={}", value);
                 entry.matched = true;
                 return entry;
             }
@@ -786,7 +1552,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             {
                 if (needle == value)
                 {
-                    entry.queryMatches = needleKey + '=' + needle;
+                    entry.queryMatches = std::format("{}={}", needleKey, needle);
                     entry.matched = true;
                     return entry;
                 }
@@ -805,7 +1571,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
         {
             if (double needleNum; valueIsNumeric && isValueNumeric(entity.at(key), needleNum) && needleNum > valueNumeric)
             {
-                entry.queryMatches = key + '=' + entity.at(key);
+                entry.queryMatches = std::format("{}={}", key, entity.at(key));
                 entry.matched = true;
                 return entry;
             }
@@ -816,7 +1582,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             {
                 if (double needleNum; valueIsNumeric && isValueNumeric(needle, needleNum) && needleNum > valueNumeric)
                 {
-                    entry.queryMatches = needleKey + '=' + needle;
+                    entry.queryMatches = std::format("{}={}", needleKey, needle);
                     entry.matched = true;
                     return entry;
                 }
@@ -835,7 +1601,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
         {
             if (double needleNum; valueIsNumeric && isValueNumeric(entity.at(key), needleNum) && needleNum < valueNumeric)
             {
-                entry.queryMatches = key + '=' + entity.at(key);
+                entry.queryMatches = std::format("{}={}", key, entity.at(key));
                 entry.matched = true;
                 return entry;
             }
@@ -846,7 +1612,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             {
                 if (double needleNum; valueIsNumeric && isValueNumeric(needle, needleNum) && needleNum < valueNumeric)
                 {
-                    entry.queryMatches = needleKey + '=' + needle;
+                    entry.queryMatches = std::format("{}={}", needleKey, needle);
                     entry.matched = true;
                     return entry;
                 }
@@ -866,7 +1632,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             double needleNum;
             if (valueIsNumeric && isValueNumeric(entity.at(key), needleNum) && needleNum >= valueNumeric)
             {
-                entry.queryMatches = key + '=' + entity.at(key);
+                entry.queryMatches = std::format("{}={}", key, entity.at(key));
                 entry.matched = true;
                 return entry;
             }
@@ -877,7 +1643,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             {
                 if (double needleNum; valueIsNumeric && isValueNumeric(needle, needleNum) && needleNum >= valueNumeric)
                 {
-                    entry.queryMatches = needleKey + '=' + needle;
+                    entry.queryMatches = std::format("{}={}", needleKey, needle);
                     entry.matched = true;
                     return entry;
                 }
@@ -895,7 +1661,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
         {
             if (double needleNum; valueIsNumeric && isValueNumeric(entity.at(key), needleNum) && needleNum <= valueNumeric)
             {
-                entry.queryMatches = key + '=' + entity.at(key);
+                entry.queryMatches = std::format("{}={}", key, entity.at(key));
                 entry.matched = true;
                 return entry;
             }
@@ -906,7 +1672,7 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
             {
                 if (double needleNum; valueIsNumeric && isValueNumeric(needle, needleNum) && needleNum <= valueNumeric)
                 {
-                    entry.queryMatches = needleKey + '=' + needle;
+                    entry.queryMatches = std::format("{}={}", needleKey, needle);
                     entry.matched = true;
                     return entry;
                 }
@@ -921,9 +1687,10 @@ EntityEntry Query::testEntity(const Entity& entity, unsigned int index) const
 }
 
 
-EntityEntry Query::testChain(const Entity& entity, unsigned int index) const
+EntityEntry Query::testChain(const Entity& entity, unsigned int index, const MatchContext* context) const
 {
-    EntityEntry entry = testEntity(entity, index);
+    MER_MEMORY_SITE("Query::testChain");
+    EntityEntry entry = testEntity(entity, index, context);
 
     if (next)
     {
@@ -932,7 +1699,7 @@ EntityEntry Query::testChain(const Entity& entity, unsigned int index) const
             if (!entry.matched)
                 return entry;
 
-            if (EntityEntry nextEntry = next->testChain(entity); nextEntry.matched)
+            if (EntityEntry nextEntry = next->testChain(entity, index, context); nextEntry.matched)
             {
                 if (!nextEntry.queryMatches.empty())
                     entry.queryMatches.append(" AND " + nextEntry.queryMatches);
@@ -945,7 +1712,7 @@ EntityEntry Query::testChain(const Entity& entity, unsigned int index) const
         }
         if (!entry.matched && type == QueryOr)
         {
-            if (EntityEntry nextEntry = next->testChain(entity); nextEntry.matched)
+            if (EntityEntry nextEntry = next->testChain(entity, index, context); nextEntry.matched)
             {
                 entry.matched = true;
 
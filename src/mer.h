@@ -1,15 +1,58 @@
 #pragma once
 #include <set>
+#include <span>
 #include <vector>
 #include <string>
 #include <atomic>
 #include <fstream>
+#include <functional>
 #include <unordered_map>
 #include <filesystem>
 #include <memory>
+#include <optional>
+#include <string_view>
+#include <memory_resource>
+#include <initializer_list>
+#include "arena.h"
+#include "tokenizer.h"
+#include "spatial.h"
 
 
-using Entity = std::unordered_map<std::string, std::string>;
+struct MapBuffer;
+class ScanPipeline;
+class MapIndex;
+class LevelGraph;
+class Aggregation;
+class TopMatches;
+class MapSample;
+
+struct KeyValue
+{
+	std::string_view key, value;
+};
+
+/*
+	Keyvalues of a single entity in lump order. Keys and values are views into the entity lump
+	or the map's arena, so entities only live as long as the map they were parsed from.
+*/
+class Entity
+{
+public:
+	Entity() = default;
+	explicit Entity(std::pmr::memory_resource* resource) : m_keyvalues(resource) {}
+	Entity(std::initializer_list<KeyValue> keyvalues) : m_keyvalues(keyvalues) {}
+
+	[[nodiscard]] bool contains(std::string_view key) const;
+	[[nodiscard]] std::string_view at(std::string_view key) const;
+	void insert_or_assign(std::string_view key, std::string_view value);
+
+	[[nodiscard]] auto begin() const { return m_keyvalues.begin(); }
+	[[nodiscard]] auto end() const { return m_keyvalues.end(); }
+	[[nodiscard]] std::size_t size() const { return m_keyvalues.size(); }
+	[[nodiscard]] bool empty() const { return m_keyvalues.empty(); }
+private:
+	std::pmr::vector<KeyValue> m_keyvalues;
+};
 
 struct EntityEntry
 {
@@ -18,14 +61,32 @@ struct EntityEntry
 	unsigned int flags = 0;
 	std::string classname, targetname;
 	std::string queryMatches;
-	Entity fullEnt;
+	std::vector<std::pair<std::string, std::string>> fullEnt;
 };
 
 
+class Query;
+
+// State of the map being matched that its queries share, worked out once per map rather than per entity
+struct MatchContext
+{
+	std::span<const Entity> entities;
+	std::vector<std::pair<const Query*, std::vector<bool>>> inRegion;  // Entities inside the region of each spatial query
+	std::unordered_map<std::string_view, std::vector<unsigned int>> targetnames;  // Entities by targetname, when references are resolved
+	std::vector<std::pair<const Query*, std::vector<bool>>> targeted;  // Entities the query after each targets: prefix matches
+
+	[[nodiscard]] const std::vector<bool>* regionMatches(const Query* query) const;
+	[[nodiscard]] const std::vector<bool>* targetMatches(const Query* query) const;
+	// The references of the entity to targetnames no entity in the map has, e.g. target=door1, empty when there are none
+	[[nodiscard]] std::string danglingTargets(const Entity& entity) const;
+};
+
 class Query
 {
 public:
 	static inline const std::string c_empty = "%";
+	static inline const std::string c_textureKey = "tex";  // Of queries on the names of a map's textures
+	static inline const std::string c_targetsPrefix = "targets:";
 
 	enum QueryType
 	{
@@ -52,17 +113,60 @@ public:
 	std::string key, value;
 	double valueNumeric = 0.;
 	int valueIndex = 0;
+	std::optional<Region> region;  // Of near= and inbox= queries
+	std::shared_ptr<const Query> targetQuery;  // Of targets: queries, what an entity the matched entity refers to has to match
 	Query* next = nullptr;
 
 	explicit Query(const std::string_view& rawQuery);
 
-	[[nodiscard]] EntityEntry testEntity(const Entity& entity, unsigned int index = 0u) const;
-	[[nodiscard]] EntityEntry testChain(const Entity& entity, unsigned int index = 0u) const;
+	// Keys derived from the bounds of brush entities rather than read from the entity lump
+	[[nodiscard]] static bool isBoundsKey(std::string_view key) { return key == "mins" || key == "maxs" || key == "center"; }
+
+	[[nodiscard]] EntityEntry testEntity(const Entity& entity, unsigned int index = 0u, const MatchContext* context = nullptr) const;
+	[[nodiscard]] EntityEntry testChain(const Entity& entity, unsigned int index = 0u, const MatchContext* context = nullptr) const;
 private:
 	void parse(const std::string_view& rawQuery);
 	void checkIndexedKey();
 };
 
+// Numeric value of a keyvalue as compared by </>/<=/>=, anything after a space or # is left out
+bool isValueNumeric(const std::string_view& value, double& numeric);
+// Same as atoi, for values that aren't null terminated
+int toInt(std::string_view value);
+
+/*
+	Elements of a space-separated value, split the same way as splitString. Negative indices count
+	from the end and wrap around, elementPosition is -1 for indices that are out of range.
+*/
+int elementCount(std::string_view value);
+int elementPosition(int index, int count);
+std::string_view elementAt(std::string_view value, int index);
+
+/*
+	Targetnames an entity refers to along with the key they're under: target, killtarget, the netname of a
+	path_track and the like, and for a multi_manager the keys of the entities it fires, without the #n suffix
+	of repeated ones.
+*/
+void forEachReference(const Entity& entity, const std::function<void(std::string_view key, std::string_view name)>& visit);
+// Targetnames an entity answers to, its own and for a monstermaker or squadmaker that of the monsters it spawns
+void forEachTargetname(const Entity& entity, const std::function<void(std::string_view name)>& visit);
+
+// Brush entity bounds are only read from the Models lump when a query in the chain asks for them
+bool chainNeedsBounds(const Query* first);
+// Same for the texture names of the Textures lump
+bool chainNeedsTextures(const Query* first);
+
+// Lumps besides the entity lump that the readers fetch along with it, only when the scan needs them
+struct MapExtras
+{
+	bool models = false;    // Brush entity bounds, for the query chain or the --top key
+	bool textures = false;  // Texture names
+};
+MapExtras scanExtras();
+
+// Position spatial queries test, the origin or else the center of a brush entity, when it has three numeric elements
+std::optional<Vec3> entityOrigin(const Entity& entity);
+
 
 struct Options
 {
@@ -74,23 +178,55 @@ struct Options
 	bool caseSensitive = false;
 	bool interactiveMode = false;
 	bool absoluteDir = false;
+	bool listedMaps = false;  // Maps are shown by the path they were listed with
 	bool printFullEnt = false;
-	Query* firstQuery;
+	bool dedup = false;
+	bool effective = false;
+	bool showProgress = true;
+	bool watch = false;
+	bool danglingTargets = false;  // Only report entities referring to targetnames missing from their map
+	unsigned int shardIndex = 0;
+	unsigned int shardCount = 0;  // Scanning all maps when 0
+	std::filesystem::path filesFrom;  // Map list to scan instead of discovering maps, - for stdin
+	std::filesystem::path indexFile;
+	bool buildIndex = false;  // Writing indexFile rather than reading it
+	unsigned int queueDepth = 0;
+	unsigned int ioThreads = 0;
+	unsigned int parseThreads = 0;
+	unsigned int matchThreads = 0;
+	Query* firstQuery = nullptr;
 	std::vector<std::string> mods;
-	std::filesystem::path gamePath;
 	std::filesystem::path steamDir;
 	std::filesystem::path steamCommonDir;
+	std::vector<std::filesystem::path> steamCommonDirs;  // One per Steam library
 	std::set<std::filesystem::path> globs;
+	std::set<std::filesystem::path> mapsDirs;  // Where globs were looked for, maps may still turn up in the empty ones
 	std::vector<std::unique_ptr<Query>> queries;
 	std::vector<std::filesystem::path> modDirs;
 	std::unordered_map<std::filesystem::path, std::vector<EntityEntry>> entries;
+	std::unordered_map<std::filesystem::path, std::vector<std::filesystem::path>> duplicates;  // Identical copies of scanned maps
+	std::shared_ptr<MapIndex> index;
+	std::shared_ptr<LevelGraph> levelGraph;  // Collecting level transitions for the graph subcommand
+	bool graphJson = false;
+	std::shared_ptr<Aggregation> aggregation;  // Counting matches instead of reporting them
+	std::shared_ptr<TopMatches> topMatches;  // Only reporting the matches ranking highest or lowest
+	std::shared_ptr<MapSample> sample;  // Only scanning a share of the maps of every mod
+	bool estimate = false;  // Streaming estimates of the matches in all maps rather than reporting them
 
 	void findGlobs();
 	void checkMaps() const;
+	void checkListedMaps();
+	void rescanMaps(const std::vector<std::filesystem::path>& maps);
+	void loadIndex();
+	void keepShard();
+	[[nodiscard]] bool inShard(const std::filesystem::path& glob) const;
+	[[nodiscard]] std::filesystem::path displayPath(const std::filesystem::path& map) const;
 private:
-	void findGlobsInPipes(std::filesystem::path modDir);
-	void findGlobsInMapsDir(const std::filesystem::path& mapsDir);
-	void findAllMods();
+	void findGlobsInPipes(const std::filesystem::path& modDir, std::set<std::filesystem::path>& found, std::set<std::filesystem::path>& foundDirs) const;
+	void findGlobsInMapsDir(const std::filesystem::path& mapsDir, std::set<std::filesystem::path>& found) const;
+	[[nodiscard]] std::vector<std::filesystem::path> findModDirs(const std::filesystem::path& commonDir) const;
+	void keepEffectiveMaps();
+	void scanMaps(ScanPipeline& pipeline, const std::vector<const std::filesystem::path*>& maps) const;
 };
 extern Options g_options;
 extern std::atomic<int> g_receivedSignal;
@@ -125,6 +261,7 @@ namespace BSPFormat
 	static constexpr int c_MaxMapVisibility =  0x200000;
 	static constexpr int c_MaxMapPortals =		  65535;
 
+	static constexpr int c_MaxTextureName =   16;
 	static constexpr int c_MaxKeyLength =	  32;
 	static constexpr int c_MaxValueLength =	1024;
 
@@ -161,6 +298,22 @@ namespace BSPFormat
 		std::int32_t version;
 		BspLump lumps[Headerlumps];
 	};
+
+	struct BspModel
+	{
+		float mins[3], maxs[3];
+		float origin[3];
+		std::int32_t headNodes[c_MaxMapHulls];
+		std::int32_t visLeafs;
+		std::int32_t firstFace, faceCount;
+	};
+
+	struct BspMipTexture
+	{
+		char name[c_MaxTextureName];
+		std::uint32_t width, height;
+		std::uint32_t offsets[4];  // Of each mip level, all 0 when the texture is loaded from a WAD
+	};
 #pragma pack(pop)
 
 
@@ -169,14 +322,39 @@ namespace BSPFormat
 	public:
 		std::filesystem::path m_filepath;
 
-		Bsp(const std::filesystem::path& filepath);
-		~Bsp() { if (m_file.is_open()) m_file.close(); }
+		Bsp(const std::filesystem::path& filepath, MapArena& arena);
+		Bsp(const std::filesystem::path& filepath, const MapBuffer& map, MapArena& arena);
+
+		struct Texture
+		{
+			unsigned int index;  // In the Textures lump
+			std::string_view name, lowerName;
+			bool embedded;
+		};
+
+		[[nodiscard]] std::vector<EntityEntry> match() const;
+		[[nodiscard]] const std::pmr::vector<Entity>& entities() const { return m_entities; }
+		[[nodiscard]] const std::pmr::vector<Texture>& textures() const { return m_textures; }
+		[[nodiscard]] std::size_t entityCount() const { return m_entities.size(); }
+		[[nodiscard]] std::size_t lumpSize() const { return m_lump.size(); }
+		// Why the entity lump couldn't be read to its end, the entities before that are still matched
+		[[nodiscard]] const std::string& error() const { return m_error; }
 	private:
 		BspHeader m_header{};
-		std::ifstream m_file;
+		MapArena& m_arena;
+		std::string_view m_lump;
+		std::size_t m_cursor = 0;
+		std::pmr::vector<Entity> m_entities;
+		std::pmr::vector<Texture> m_textures;  // Only read for texture queries
+		std::string m_error;
+		void readEntityLump(const MapBuffer& map);
+		void readLump(const BspLump& lump);
+		void readBounds(const MapBuffer& map);
+		void readTextures(const MapBuffer& map);
+		[[nodiscard]] MatchContext matchContext() const;
+		void skipWhitespace();
 		void parse();
-		std::string readToken(int maxLength = c_MaxKeyLength);
-		Entity readEntity();
+		std::string_view tokenText(const Tokenizer::Token& token) const;
 		bool readComment();
 	};
 }
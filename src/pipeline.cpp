@@ -0,0 +1,395 @@
+#include <map>
+#include <format>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <optional>
+#include <unordered_map>
+#include <algorithm>
+#include "pipeline.h"
+#include "queue.h"
+#include "arena.h"
+#include "stats.h"
+#include "trace.h"
+#include "io.h"
+#include "devices.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+namespace
+{
+    // A map on its way through the pipeline, jobs are pooled so their arenas and buffers stay warm
+    struct MapJob
+    {
+        MapBuffer buffer;
+        MapArena arena;
+        std::optional<BSPFormat::Bsp> bsp;
+        const fs::path* duplicateOf = nullptr;
+        std::shared_future<std::string> originalError;  // Of the map this one duplicates, once it's parsed
+        std::string error;
+        Clock::time_point readStart;  // When the reader asked the engine for it, maps are timed from there to the end of matching
+    };
+
+    struct Fingerprint
+    {
+        std::uintmax_t fileSize;
+        std::uint64_t hash;
+
+        bool operator==(const Fingerprint&) const = default;
+    };
+
+    struct FingerprintHash
+    {
+        std::size_t operator()(const Fingerprint& print) const { return print.hash ^ print.fileSize; }
+    };
+
+    struct StageCounters
+    {
+        std::atomic<std::uint64_t> items = 0;
+        std::atomic<std::int64_t> busyNanos = 0;
+        std::atomic<unsigned> running = 0;
+
+        void add(const Clock::time_point start)
+        {
+            ++items;
+            busyNanos += std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+        }
+    };
+
+    StageMetrics stageMetrics(std::string name, const unsigned threads, const StageCounters& counters,
+        const std::size_t capacity, const QueueMetrics& input)
+    {
+        return {
+            std::move(name), threads, counters.items.load(), std::chrono::nanoseconds(counters.busyNanos.load()), capacity,
+            input.pushes ? static_cast<double>(input.occupancySum) / static_cast<double>(input.pushes) : 0.,
+            input.maxOccupancy, input.fullWaits, input.emptyWaits
+        };
+    }
+
+    void nameThread(const std::string& stage, const unsigned id)
+    {
+        if (g_trace.enabled)
+            g_trace.setThreadName(stage + " " + std::to_string(id));
+    }
+}
+
+
+/*
+    Maps that fingerprint alike are scanned once, the first one to get here is the one scanned. Copies can get here
+    while it's still being parsed, so they wait to hear whether it could be read, and share its error when it couldn't.
+*/
+class ScanPipeline::Fingerprints
+{
+public:
+    struct First
+    {
+        const fs::path* path;
+        std::shared_future<std::string> error;
+    };
+
+    // The map scanned in place of this one, none when it's the first
+    std::optional<First> firstWith(const fs::path* path, const MapBuffer& map)
+    {
+        std::error_code error;
+        const std::uintmax_t fileSize = fs::file_size(*path, error);
+        if (error)
+            return std::nullopt;
+
+        // Models and textures are only read when queries look at them, and then maps with the same entities differ on them
+        std::uint64_t hash = hashBytes({ reinterpret_cast<const char*>(&map.header), sizeof(map.header) });
+        hash = hashBytes({ map.lump.data(), map.lump.size() }, hash);
+        hash = hashBytes({ reinterpret_cast<const char*>(map.models.data()), map.models.size() * sizeof(BSPFormat::BspModel) }, hash);
+        hash = hashBytes({ reinterpret_cast<const char*>(map.textures.data()), map.textures.size() * sizeof(BSPFormat::BspMipTexture) }, hash);
+        const Fingerprint print{ fileSize, hash };
+
+        std::lock_guard lock{ m_mutex };
+        if (const auto first = m_first.find(print); first != m_first.end())
+            return first->second;
+
+        std::promise<std::string>& parsed = m_parsing[path];
+        m_first.emplace(print, First{ path, parsed.get_future().share() });
+        return std::nullopt;
+    }
+
+    // Called with every parsed map, settles the error of the copies of the first ones
+    void parsed(const fs::path* path, const std::string& error)
+    {
+        std::lock_guard lock{ m_mutex };
+        if (const auto parsing = m_parsing.find(path); parsing != m_parsing.end())
+        {
+            parsing->second.set_value(error);
+            m_parsing.erase(parsing);
+        }
+    }
+
+    // Only from the reporting thread, the number of matches of each scanned map for its copies
+    void matched(const fs::path* path, const std::size_t matches) { m_matches.insert_or_assign(path, matches); }
+    [[nodiscard]] std::optional<std::size_t> matchesOf(const fs::path* path) const
+    {
+        const auto matches = m_matches.find(path);
+        return matches != m_matches.end() ? std::optional{ matches->second } : std::nullopt;
+    }
+private:
+    std::mutex m_mutex;
+    std::unordered_map<Fingerprint, First, FingerprintHash> m_first;
+    std::unordered_map<const fs::path*, std::promise<std::string>> m_parsing;
+    std::unordered_map<const fs::path*, std::size_t> m_matches;
+};
+
+
+ScanPipeline::ScanPipeline(const PipelineSettings& settings)
+    : m_settings(settings), m_fingerprints(std::make_unique<Fingerprints>())
+{
+    // Tokenizing is most of the work, matching a single query chain is cheap in comparison
+    const unsigned hardware = std::max(1u, std::thread::hardware_concurrency());
+    if (!m_settings.ioThreads)
+        m_settings.ioThreads = 1;
+    if (!m_settings.matchThreads)
+        m_settings.matchThreads = std::max(1u, hardware / 8);
+    if (!m_settings.parseThreads)
+        m_settings.parseThreads = std::max(1u, hardware > m_settings.matchThreads + 1 ? hardware - m_settings.matchThreads - 1 : 1u);
+}
+
+ScanPipeline::~ScanPipeline() = default;
+
+void ScanPipeline::run(const std::vector<const fs::path*>& globs, const Reporter& report)
+{
+    std::vector<fs::path> paths;
+    paths.reserve(globs.size());
+    for (const fs::path* glob : globs)
+        paths.push_back(*glob);
+
+    // Every device reads its maps independently, at a queue depth that suits it
+    const std::vector<DeviceLane> lanes = Devices::groupByDevice(paths, m_settings.queueDepth);
+    const MapExtras extras = scanExtras();
+    std::vector<std::unique_ptr<IoEngine>> engines;
+    for (const DeviceLane& lane : lanes)
+    {
+        std::vector<fs::path> lanePaths;
+        lanePaths.reserve(lane.maps.size());
+        for (const std::size_t index : lane.maps)
+            lanePaths.push_back(std::move(paths[index]));
+
+        engines.push_back(std::make_unique<IoEngine>(std::move(lanePaths), lane.queueDepth, IoEngine::Backend::Auto, lane.rotational, extras));
+    }
+    if (!engines.empty())
+        g_stats.ioBackend = engines.front()->backendName();
+
+    const unsigned readers = m_settings.ioThreads * static_cast<unsigned>(lanes.size());
+    const unsigned parsers = m_settings.parseThreads;
+    const unsigned matchers = m_settings.matchThreads;
+
+    BoundedQueue<MapJob*> parseQueue{ 2 * parsers };
+    BoundedQueue<MapJob*> matchQueue{ 2 * matchers };
+    BoundedQueue<MapResult> reportQueue{ std::max<std::size_t>(64, 4 * matchers) };
+
+    // Enough jobs to fill every queue and keep every thread busy
+    const std::size_t jobCount = readers + parseQueue.capacity() + parsers + matchQueue.capacity() + matchers;
+    std::vector<std::unique_ptr<MapJob>> jobs;
+    BoundedQueue<MapJob*> freeJobs{ jobCount };
+    for (std::size_t i = 0; i < jobCount; ++i)
+    {
+        MapJob* job = jobs.emplace_back(std::make_unique<MapJob>()).get();
+        freeJobs.tryPush(job);
+    }
+
+    std::atomic<bool> stop = false;
+    std::vector<StageCounters> readCounters(lanes.size());
+    StageCounters parseCounters, matchCounters, reportCounters;
+    std::atomic<unsigned> readersRunning = readers;
+    parseCounters.running = parsers;
+    matchCounters.running = matchers;
+    if (!readers)
+        parseQueue.close();
+
+    std::vector<std::jthread> threads;
+    for (std::size_t laneIndex = 0; laneIndex < lanes.size(); ++laneIndex)
+    {
+        for (unsigned id = 1; id <= m_settings.ioThreads; ++id)
+        {
+            threads.emplace_back([&, laneIndex, id] {
+                const DeviceLane& lane = lanes[laneIndex];
+                IoEngine& engine = *engines[laneIndex];
+                nameThread("read " + lane.name, id);
+
+                MapJob* job;
+                while (freeJobs.pop(job, stop))
+                {
+                    const auto start = Clock::now();
+                    if (!engine.next(job->buffer))
+                    {
+                        freeJobs.tryPush(job);
+                        break;
+                    }
+                    job->buffer.index = lane.maps[job->buffer.index];
+                    job->readStart = start;
+                    readCounters[laneIndex].add(start);
+
+                    if (!parseQueue.push(job, stop))
+                        break;
+                }
+
+                if (--readersRunning == 0)
+                    parseQueue.close();
+            });
+        }
+    }
+
+    for (unsigned id = 1; id <= parsers; ++id)
+    {
+        threads.emplace_back([&, id] {
+            nameThread("parse", id);
+
+            MapJob* job;
+            while (parseQueue.pop(job, stop))
+            {
+                const auto start = Clock::now();
+                job->arena.reset();
+                if (m_settings.dedup && job->buffer.error.empty())
+                {
+                    if (auto first = m_fingerprints->firstWith(globs[job->buffer.index], job->buffer))
+                    {
+                        job->duplicateOf = first->path;
+                        job->originalError = std::move(first->error);
+                    }
+                }
+
+                try
+                {
+                    if (!job->duplicateOf)
+                        job->bsp.emplace(*globs[job->buffer.index], job->buffer, job->arena);
+                }
+                catch (const std::runtime_error& e)
+                {
+                    job->error = e.what();
+                }
+                // Settled before the map moves on, copies of it wait for this in the matchers
+                if (m_settings.dedup && !job->duplicateOf)
+                    m_fingerprints->parsed(globs[job->buffer.index], job->error);
+                parseCounters.add(start);
+
+                if (!matchQueue.push(job, stop))
+                    break;
+            }
+
+            if (--parseCounters.running == 0)
+                matchQueue.close();
+        });
+    }
+
+    for (unsigned id = 1; id <= matchers; ++id)
+    {
+        threads.emplace_back([&, id] {
+            nameThread("match", id);
+
+            MapJob* job;
+            while (matchQueue.pop(job, stop))
+            {
+                const auto start = Clock::now();
+                MapResult result;
+                result.index = job->buffer.index;
+
+                if (job->duplicateOf)
+                {
+                    // Copies of a map that couldn't be read can't be read either
+                    if (std::string error = job->originalError.get(); !error.empty())
+                        result.error = std::move(error);
+                    else
+                    {
+                        result.duplicateOf = job->duplicateOf;
+                        ++g_stats.mapsDeduplicated;
+                    }
+                    job->duplicateOf = nullptr;
+                    job->originalError = {};
+                }
+                else if (job->bsp)
+                {
+                    result.entries = job->bsp->match();
+                    result.error = job->bsp->error();
+                    if (m_inspector)
+                        m_inspector(result.index, *job->bsp);
+                    if (g_stats.enabled)
+                    {
+                        g_stats.addMapTiming({ g_options.displayPath(*globs[result.index]), Clock::now() - job->readStart,
+                            static_cast<std::int32_t>(job->bsp->lumpSize()), job->bsp->entityCount() });
+                    }
+                    job->bsp.reset();
+                }
+                else
+                    result.error = std::move(job->error);
+
+                // From the read to the end of matching, the same time the slowest maps are ranked by
+                if (g_trace.enabled)
+                    g_trace.addSpan("map", job->readStart, Clock::now(), globs[result.index]);
+
+                job->error.clear();
+                freeJobs.tryPush(job);
+                matchCounters.add(start);
+
+                if (!reportQueue.push(std::move(result), stop))
+                    break;
+            }
+
+            if (--matchCounters.running == 0)
+                reportQueue.close();
+        });
+    }
+
+
+    // Results arrive in completion order, hold early ones back to report in scan order
+    std::map<std::size_t, MapResult> early;
+    std::size_t nextIndex = 0;
+    MapResult result;
+    while (!stop && reportQueue.pop(result, stop))
+    {
+        if (m_settings.dedup && !result.duplicateOf)
+            m_fingerprints->matched(globs[result.index], result.entries.size());
+
+        early.emplace(result.index, std::move(result));
+        while (!early.empty() && early.begin()->first == nextIndex)
+        {
+            // The original of a copy is always parsed before it, so its result is bound to come
+            if (MapResult& next = early.begin()->second; next.duplicateOf)
+            {
+                const std::optional<std::size_t> matches = m_fingerprints->matchesOf(next.duplicateOf);
+                if (!matches)
+                    break;
+                next.duplicateMatches = *matches;
+            }
+
+            const auto start = Clock::now();
+            auto node = early.extract(early.begin());
+            ++nextIndex;
+
+            const bool proceed = report(node.mapped());
+            reportCounters.add(start);
+            if (!proceed)
+            {
+                stop = true;
+                break;
+            }
+        }
+    }
+
+    stop = true;
+    threads.clear();
+
+    if (g_stats.enabled)
+    {
+        for (std::size_t laneIndex = 0; laneIndex < lanes.size(); ++laneIndex)
+        {
+            const DeviceLane& lane = lanes[laneIndex];
+            g_stats.addStage(stageMetrics(std::format("read {}{}", lane.name, lane.rotational ? " (hdd)" : ""), m_settings.ioThreads,
+                readCounters[laneIndex], engines[laneIndex]->queueDepth(), engines[laneIndex]->metrics()));
+        }
+        g_stats.addStage(stageMetrics("parse", parsers, parseCounters, parseQueue.capacity(), parseQueue.metrics()));
+        g_stats.addStage(stageMetrics("match", matchers, matchCounters, matchQueue.capacity(), matchQueue.metrics()));
+        g_stats.addStage(stageMetrics("report", 1, reportCounters, reportQueue.capacity(), reportQueue.metrics()));
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <vector>
+#include <functional>
+#include <filesystem>
+#include "mer.h"
+
+
+struct MapResult
+{
+	std::size_t index = 0;  // Position of the map in the scan
+	std::vector<EntityEntry> entries;
+	std::string error;  // Entries are still those of the entities read before it
+	const std::filesystem::path* duplicateOf = nullptr;  // Identical map that was scanned instead
+	std::size_t duplicateMatches = 0;  // Of the map it duplicates, which can come later in the scan
+};
+
+// Thread counts of 0 are picked from the hardware concurrency
+struct PipelineSettings
+{
+	unsigned int ioThreads = 0;
+	unsigned int parseThreads = 0;
+	unsigned int matchThreads = 0;
+	unsigned int queueDepth = 0;
+	bool dedup = false;
+};
+
+/*
+	Scans maps in stages connected by bounded lock-free queues: readers pull lump buffers off the I/O engine,
+	parsers tokenize them into entities in per-map arenas, matchers evaluate the query chain and recycle
+	the map, and the calling thread reports results in scan order. Maps travel as pooled jobs, so the number
+	of maps in memory is bounded no matter how far the disks or CPUs get ahead of each other.
+	With dedup set, parsers first fingerprint each map by its file size and a hash of its header and entity
+	lump, and only the first map parsed with a fingerprint is scanned, the copies report which map they duplicate
+	and its number of matches. Which copy is first depends on the order the maps are read and parsed in, so copies
+	earlier in the scan hold back the results after them until the result of their original is in.
+	Fingerprints are kept across runs, so maps scanned in batches are deduplicated against earlier batches.
+*/
+class ScanPipeline
+{
+public:
+	// Called in scan order, returning false stops the scan
+	using Reporter = std::function<bool(MapResult& result)>;
+	// Called by the matchers with every parsed map, in any order and from several threads at once
+	using Inspector = std::function<void(std::size_t index, const BSPFormat::Bsp& bsp)>;
+
+	explicit ScanPipeline(const PipelineSettings& settings);
+	~ScanPipeline();
+
+	// The maps have to outlive the pipeline, results refer to them by index and duplicates by address
+	void run(const std::vector<const std::filesystem::path*>& globs, const Reporter& report);
+	void setInspector(Inspector inspector) { m_inspector = std::move(inspector); }
+	[[nodiscard]] const PipelineSettings& settings() const { return m_settings; }
+private:
+	class Fingerprints;
+
+	PipelineSettings m_settings;
+	Inspector m_inspector;
+	std::unique_ptr<Fingerprints> m_fingerprints;
+};
@@ -0,0 +1,179 @@
+#pragma once
+#include <bit>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <cstdint>
+#include <utility>
+
+
+struct QueueMetrics
+{
+	std::uint64_t pushes = 0;
+	std::uint64_t occupancySum = 0;
+	std::uint64_t maxOccupancy = 0;
+	std::uint64_t fullWaits = 0;
+	std::uint64_t emptyWaits = 0;
+};
+
+/*
+	Bounded lock-free multi-producer multi-consumer queue after Dmitry Vyukov's design, each cell carries a
+	sequence number telling producers and consumers whose turn it is. push and pop back off while the queue
+	is full or empty, and give up once the queue is closed (pop drains it first) or stop is raised.
+	Occupancy is sampled on every push for the pipeline statistics.
+*/
+template<typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(const std::size_t capacity)
+		: m_capacity(std::bit_ceil(capacity < 2 ? std::size_t{ 2 } : capacity)), m_cells(std::make_unique<Cell[]>(m_capacity))
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i)
+			m_cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	[[nodiscard]] std::size_t capacity() const { return m_capacity; }
+
+	[[nodiscard]] std::size_t size() const
+	{
+		const std::size_t dequeue = m_dequeue.load(std::memory_order_relaxed);
+		const std::size_t enqueue = m_enqueue.load(std::memory_order_relaxed);
+		return enqueue > dequeue ? enqueue - dequeue : 0;
+	}
+
+	bool tryPush(T& value)
+	{
+		std::size_t position = m_enqueue.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell& cell = m_cells[position & (m_capacity - 1)];
+			const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position);
+
+			if (difference == 0)
+			{
+				if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.value = std::move(value);
+					cell.sequence.store(position + 1, std::memory_order_release);
+					record(position + 1, m_dequeue.load(std::memory_order_relaxed));
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = m_enqueue.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool tryPop(T& value)
+	{
+		std::size_t position = m_dequeue.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell& cell = m_cells[position & (m_capacity - 1)];
+			const std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+			const auto difference = static_cast<std::intptr_t>(sequence) - static_cast<std::intptr_t>(position + 1);
+
+			if (difference == 0)
+			{
+				if (m_dequeue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					value = std::move(cell.value);
+					cell.sequence.store(position + m_capacity, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+				return false;
+			else
+				position = m_dequeue.load(std::memory_order_relaxed);
+		}
+	}
+
+	bool push(T value, const std::atomic<bool>& stop)
+	{
+		for (unsigned attempt = 0; !tryPush(value); ++attempt)
+		{
+			if (stop.load(std::memory_order_relaxed))
+				return false;
+			if (attempt == 0)
+				m_fullWaits.fetch_add(1, std::memory_order_relaxed);
+			backoff(attempt);
+		}
+		return true;
+	}
+
+	bool pop(T& value, const std::atomic<bool>& stop)
+	{
+		for (unsigned attempt = 0; !tryPop(value); ++attempt)
+		{
+			// Pushes happen before close, one more try after seeing it closed drains the queue
+			if (m_closed.load(std::memory_order_acquire))
+				return tryPop(value);
+			if (stop.load(std::memory_order_relaxed))
+				return false;
+			if (attempt == 0)
+				m_emptyWaits.fetch_add(1, std::memory_order_relaxed);
+			backoff(attempt);
+		}
+		return true;
+	}
+
+	void close() { m_closed.store(true, std::memory_order_release); }
+
+	[[nodiscard]] QueueMetrics metrics() const
+	{
+		return {
+			m_pushes.load(std::memory_order_relaxed),
+			m_occupancySum.load(std::memory_order_relaxed),
+			m_maxOccupancy.load(std::memory_order_relaxed),
+			m_fullWaits.load(std::memory_order_relaxed),
+			m_emptyWaits.load(std::memory_order_relaxed)
+		};
+	}
+private:
+	struct Cell
+	{
+		std::atomic<std::size_t> sequence;
+		T value{};
+	};
+
+	static constexpr std::size_t c_cacheLine = 64;
+
+	const std::size_t m_capacity;
+	std::unique_ptr<Cell[]> m_cells;
+	alignas(c_cacheLine) std::atomic<std::size_t> m_enqueue = 0;
+	alignas(c_cacheLine) std::atomic<std::size_t> m_dequeue = 0;
+	alignas(c_cacheLine) std::atomic<bool> m_closed = false;
+	std::atomic<std::uint64_t> m_pushes = 0;
+	std::atomic<std::uint64_t> m_occupancySum = 0;
+	std::atomic<std::uint64_t> m_maxOccupancy = 0;
+	std::atomic<std::uint64_t> m_fullWaits = 0;
+	std::atomic<std::uint64_t> m_emptyWaits = 0;
+
+	void record(const std::size_t enqueue, const std::size_t dequeue)
+	{
+		// Consumers may already have overtaken this push
+		const std::uint64_t occupancy = enqueue > dequeue ? enqueue - dequeue : 0;
+		m_pushes.fetch_add(1, std::memory_order_relaxed);
+		m_occupancySum.fetch_add(occupancy, std::memory_order_relaxed);
+
+		std::uint64_t max = m_maxOccupancy.load(std::memory_order_relaxed);
+		while (occupancy > max && !m_maxOccupancy.compare_exchange_weak(max, occupancy, std::memory_order_relaxed)) {}
+	}
+
+	// Spin briefly for a queue that's about to drain, then yield, then sleep for stages stalled on I/O
+	static void backoff(const unsigned attempt)
+	{
+		if (attempt < 64)
+			return;
+		if (attempt < 256)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(attempt < 1024 ? 20 : 200));
+	}
+};
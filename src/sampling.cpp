@@ -0,0 +1,159 @@
+#include <cmath>
+#include <limits>
+#include <format>
+#include <ranges>
+#include <charconv>
+#include <algorithm>
+#include "sampling.h"
+#include "mer.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+
+// Standard normal quantile of a two-sided 95% interval
+static constexpr double c_z95 = 1.96;
+
+
+std::string MapSample::stratumOf(const fs::path& map)
+{
+    return g_options.displayPath(map).parent_path().parent_path().generic_string();
+}
+
+void MapSample::choose(std::set<fs::path>& globs)
+{
+    std::map<std::string, std::vector<std::pair<std::uint64_t, const fs::path*>>> byStratum;
+    for (const auto& glob : globs)
+        byStratum[stratumOf(glob)].emplace_back(hashBytes(g_options.displayPath(glob).generic_string(), m_seed), &glob);
+
+    std::set<fs::path> chosen;
+    for (auto& [stratum, maps] : byStratum)
+    {
+        std::ranges::sort(maps, [](const auto& a, const auto& b) { return a.first != b.first ? a.first < b.first : *a.second < *b.second; });
+
+        const std::size_t keep = std::clamp<std::size_t>(static_cast<std::size_t>(std::llround(m_fraction * static_cast<double>(maps.size()))), 1, maps.size());
+        m_strata[stratum].total = maps.size();
+        for (std::size_t i = 0; i < keep; ++i)
+        {
+            m_order.emplace(*maps[i].second, (static_cast<double>(i) + .5) / static_cast<double>(keep));
+            chosen.insert(*maps[i].second);
+        }
+    }
+    globs = std::move(chosen);
+}
+
+void MapSample::arrange(std::vector<const fs::path*>& maps) const
+{
+    const auto order = [this](const fs::path* map) {
+        const auto found = m_order.find(*map);
+        return found != m_order.end() ? found->second : 1.;
+    };
+    std::ranges::sort(maps, [&order](const fs::path* a, const fs::path* b) {
+        const double orderA = order(a), orderB = order(b);
+        return orderA != orderB ? orderA < orderB : *a < *b;
+    });
+}
+
+void MapSample::add(const fs::path& map, const std::size_t matches)
+{
+    Stratum& stratum = m_strata[stratumOf(map)];
+    ++stratum.scanned;
+
+    const double count = static_cast<double>(matches);
+    stratum.matches.sum += count;
+    stratum.matches.sumSquares += count * count;
+    stratum.maps.sum += matches ? 1. : 0.;
+    stratum.maps.sumSquares += matches ? 1. : 0.;
+}
+
+MapSample::Interval MapSample::estimateTotal(Moments Stratum::* moments) const
+{
+    // Pooled over every scanned map, for mods with too few maps scanned to tell their own spread
+    double scanned = 0.;
+    Moments pooled;
+    for (const Stratum& stratum : m_strata | std::views::values)
+    {
+        scanned += static_cast<double>(stratum.scanned);
+        pooled.sum += (stratum.*moments).sum;
+        pooled.sumSquares += (stratum.*moments).sumSquares;
+    }
+    if (!scanned)
+        return {};
+
+    const double pooledMean = pooled.sum / scanned;
+    const double pooledVariance = scanned > 1. ? std::max(0., (pooled.sumSquares - scanned * pooledMean * pooledMean) / (scanned - 1.)) : pooledMean * pooledMean;
+
+    Interval interval;
+    double observed = 0., variance = 0.;
+    for (const Stratum& stratum : m_strata | std::views::values)
+    {
+        const Moments& moment = stratum.*moments;
+        const double total = static_cast<double>(std::max(stratum.total, stratum.scanned));
+        const double count = static_cast<double>(stratum.scanned);
+        observed += moment.sum;
+
+        // Mods nothing was scanned in yet are taken to be like the rest
+        if (!stratum.scanned)
+        {
+            interval.estimate += total * pooledMean;
+            variance += total * total * pooledVariance;
+            continue;
+        }
+
+        const double mean = moment.sum / count;
+        const double spread = count > 1. ? std::max(0., (moment.sumSquares - count * mean * mean) / (count - 1.)) : pooledVariance;
+        interval.estimate += total * mean;
+        variance += total * total * (1. - count / total) * spread / count;
+    }
+
+    const double margin = c_z95 * std::sqrt(variance);
+    interval.low = std::max(observed, interval.estimate - margin);
+    interval.high = std::max(interval.low, interval.estimate + margin);
+    return interval;
+}
+
+MapSample::Estimate MapSample::estimate() const
+{
+    Estimate estimate{ .matches = estimateTotal(&Stratum::matches), .maps = estimateTotal(&Stratum::maps), .mods = m_strata.size() };
+    for (const Stratum& stratum : m_strata | std::views::values)
+    {
+        estimate.scanned += stratum.scanned;
+        estimate.total += std::max(stratum.total, stratum.scanned);
+    }
+    estimate.maps.high = std::min(estimate.maps.high, static_cast<double>(estimate.total));
+    return estimate;
+}
+
+void MapSample::print(std::ostream& out) const
+{
+    const Estimate estimate = this->estimate();
+    out << std::format("Estimated matches in all {} .bsp files: {} (95% confidence {} to {})\n", estimate.total,
+        std::llround(estimate.matches.estimate), std::llround(estimate.matches.low), std::llround(estimate.matches.high))
+        << std::format("Estimated .bsp files with matches: {} (95% confidence {} to {})\n",
+        std::llround(estimate.maps.estimate), std::llround(estimate.maps.low), std::llround(estimate.maps.high))
+        << std::format("Estimated from {} of {} .bsp files in {} mods", estimate.scanned, estimate.total, estimate.mods) << std::endl;
+}
+
+std::string MapSample::progress() const
+{
+    const Estimate estimate = this->estimate();
+    return std::format("Estimated {} matches ({}-{}) in {} maps ({}-{}), {} of {} maps scanned",
+        std::llround(estimate.matches.estimate), std::llround(estimate.matches.low), std::llround(estimate.matches.high),
+        std::llround(estimate.maps.estimate), std::llround(estimate.maps.low), std::llround(estimate.maps.high), estimate.scanned, estimate.total);
+}
+
+double MapSample::parseFraction(std::string_view text)
+{
+    const bool percentage = text.ends_with('%');
+    if (percentage)
+        text.remove_suffix(1);
+
+    double fraction = 0.;
+    const auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), fraction);
+    if (text.empty() || error != std::errc{} || end != text.data() + text.size())
+        return std::numeric_limits<double>::quiet_NaN();
+
+    if (percentage)
+        fraction /= 100.;
+    return fraction > 0. && fraction <= 1. ? fraction : std::numeric_limits<double>::quiet_NaN();
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <filesystem>
+#include <unordered_map>
+
+
+/*
+	A share of the maps of every mod for --sample and --estimate, and what the matches in them say about all of the
+	maps. Maps are picked by a seeded hash of their display path, so the same sample is drawn wherever the Steam
+	directory is. They're scanned with the mods interleaved in proportion to their size, which keeps the estimate of
+	every mod refining together while the scan is still under way. Match counts are estimated per mod and summed,
+	with a normal 95% confidence interval, and are exact once every map was scanned.
+*/
+class MapSample
+{
+public:
+	struct Interval
+	{
+		double estimate = 0., low = 0., high = 0.;
+	};
+
+	struct Estimate
+	{
+		Interval matches;
+		Interval maps;  // With at least one match
+		std::size_t scanned = 0;
+		std::size_t total = 0;
+		std::size_t mods = 0;
+	};
+
+	MapSample(double fraction, std::uint64_t seed) : m_fraction(fraction), m_seed(seed) {}
+
+	// Keeps the sampled share of the maps of each mod, at least one, remembering how many maps each has
+	void choose(std::set<std::filesystem::path>& globs);
+	// Scan order of the chosen maps, mods interleaved
+	void arrange(std::vector<const std::filesystem::path*>& maps) const;
+	// Not thread-safe, as scan results come in
+	void add(const std::filesystem::path& map, std::size_t matches);
+
+	[[nodiscard]] Estimate estimate() const;
+	[[nodiscard]] double fraction() const { return m_fraction; }
+	// The matches in all of the maps as of now
+	void print(std::ostream& out) const;
+	// One line for the progress of the scan
+	[[nodiscard]] std::string progress() const;
+
+	// Fraction in (0, 1], or percentage followed by %, NaN when invalid
+	static double parseFraction(std::string_view text);
+private:
+	struct Moments
+	{
+		double sum = 0., sumSquares = 0.;
+	};
+
+	struct Stratum
+	{
+		std::size_t total = 0;
+		std::size_t scanned = 0;
+		Moments matches, maps;
+	};
+
+	double m_fraction;
+	std::uint64_t m_seed;
+	std::map<std::string, Stratum> m_strata;
+	std::unordered_map<std::filesystem::path, double> m_order;  // Of the chosen maps, position within their mod by its size
+
+	[[nodiscard]] static std::string stratumOf(const std::filesystem::path& map);
+	[[nodiscard]] Interval estimateTotal(Moments Stratum::* moments) const;
+};
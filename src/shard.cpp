@@ -0,0 +1,389 @@
+#include <format>
+#include <ranges>
+#include <string>
+#include <fstream>
+#include <cmath>
+#include <charconv>
+#include <stdexcept>
+#include <algorithm>
+#include "logging.h"
+#include "shard.h"
+#include "mer.h"
+#include "stats.h"
+#include "utils.h"
+
+
+namespace fs = std::filesystem;
+static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
+
+
+namespace
+{
+    struct JsonValue
+    {
+        enum class Type { Null, Bool, Number, String, Array, Object };
+
+        Type type = Type::Null;
+        bool boolean = false;
+        double number = 0.;
+        std::string string;
+        std::vector<JsonValue> items;
+        std::vector<std::pair<std::string, JsonValue>> members;
+
+        // Missing members read as null
+        const JsonValue& operator[](const std::string_view key) const
+        {
+            static const JsonValue c_null;
+            const auto member = std::ranges::find(members, key, &std::pair<std::string, JsonValue>::first);
+            return member == members.end() ? c_null : member->second;
+        }
+    };
+
+    // Just enough JSON for the partial results this file writes
+    class JsonParser
+    {
+    public:
+        explicit JsonParser(const std::string_view text) : m_text(text) {}
+
+        JsonValue parse()
+        {
+            JsonValue value = parseValue();
+            skipWhitespace();
+            if (m_cursor != m_text.size())
+                fail("trailing characters");
+            return value;
+        }
+    private:
+        std::string_view m_text;
+        std::size_t m_cursor = 0;
+
+        [[noreturn]] void fail(const std::string& reason) const
+        {
+            throw std::runtime_error(std::format("Malformed JSON at column {}: {}", m_cursor + 1, reason));
+        }
+
+        void skipWhitespace()
+        {
+            while (m_cursor < m_text.size() && std::isspace(static_cast<unsigned char>(m_text[m_cursor])))
+                ++m_cursor;
+        }
+
+        void expect(const char c)
+        {
+            skipWhitespace();
+            if (m_cursor >= m_text.size() || m_text[m_cursor] != c)
+                fail(std::format("expected '{}'", c));
+            ++m_cursor;
+        }
+
+        bool consume(const char c)
+        {
+            skipWhitespace();
+            if (m_cursor < m_text.size() && m_text[m_cursor] == c)
+            {
+                ++m_cursor;
+                return true;
+            }
+            return false;
+        }
+
+        JsonValue parseValue()
+        {
+            skipWhitespace();
+            if (m_cursor >= m_text.size())
+                fail("unexpected end");
+
+            JsonValue value;
+            const char c = m_text[m_cursor];
+            if (c == '{')
+            {
+                value.type = JsonValue::Type::Object;
+                ++m_cursor;
+                if (consume('}'))
+                    return value;
+                do
+                {
+                    skipWhitespace();
+                    std::string key = parseString();
+                    expect(':');
+                    value.members.emplace_back(std::move(key), parseValue());
+                } while (consume(','));
+                expect('}');
+            }
+            else if (c == '[')
+            {
+                value.type = JsonValue::Type::Array;
+                ++m_cursor;
+                if (consume(']'))
+                    return value;
+                do
+                    value.items.push_back(parseValue());
+                while (consume(','));
+                expect(']');
+            }
+            else if (c == '"')
+            {
+                value.type = JsonValue::Type::String;
+                value.string = parseString();
+            }
+            else if (m_text.substr(m_cursor).starts_with("true") || m_text.substr(m_cursor).starts_with("false"))
+            {
+                value.type = JsonValue::Type::Bool;
+                value.boolean = c == 't';
+                m_cursor += value.boolean ? 4 : 5;
+            }
+            else if (m_text.substr(m_cursor).starts_with("null"))
+                m_cursor += 4;
+            else
+            {
+                value.type = JsonValue::Type::Number;
+                const auto [end, error] = std::from_chars(m_text.data() + m_cursor, m_text.data() + m_text.size(), value.number);
+                if (error != std::errc{})
+                    fail("unexpected character");
+                m_cursor = end - m_text.data();
+            }
+            return value;
+        }
+
+        std::string parseString()
+        {
+            if (m_cursor >= m_text.size() || m_text[m_cursor] != '"')
+                fail("expected a string");
+            ++m_cursor;
+
+            std::string string;
+            while (m_cursor < m_text.size() && m_text[m_cursor] != '"')
+            {
+                char c = m_text[m_cursor++];
+                if (c != '\\')
+                {
+                    string += c;
+                    continue;
+                }
+                if (m_cursor >= m_text.size())
+                    break;
+
+                switch (c = m_text[m_cursor++])
+                {
+                case 'n': string += '\n'; break;
+                case 'r': string += '\r'; break;
+                case 't': string += '\t'; break;
+                case 'b': string += '\b'; break;
+                case 'f': string += '\f'; break;
+                case 'u': appendCodepoint(string); break;
+                default: string += c;
+                }
+            }
+            if (m_cursor >= m_text.size())
+                fail("unterminated string");
+            ++m_cursor;
+            return string;
+        }
+
+        void appendCodepoint(std::string& string)
+        {
+            unsigned int codepoint = 0;
+            const char* digits = m_text.data() + m_cursor;
+            if (m_text.size() - m_cursor < 4 || std::from_chars(digits, digits + 4, codepoint, 16).ptr != digits + 4)
+                fail("invalid \\u escape");
+            m_cursor += 4;
+
+            if (codepoint < 0x80)
+                string += static_cast<char>(codepoint);
+            else if (codepoint < 0x800)
+            {
+                string += static_cast<char>(0xC0 | codepoint >> 6);
+                string += static_cast<char>(0x80 | (codepoint & 0x3F));
+            }
+            else
+            {
+                string += static_cast<char>(0xE0 | codepoint >> 12);
+                string += static_cast<char>(0x80 | (codepoint >> 6 & 0x3F));
+                string += static_cast<char>(0x80 | (codepoint & 0x3F));
+            }
+        }
+    };
+
+    void writeString(std::ostream& out, const std::string_view str)
+    {
+        out << '"' << jsonEscape(str) << '"';
+    }
+
+    void writeMap(std::ostream& out, const fs::path& map, const std::vector<EntityEntry>& entries)
+    {
+        out << R"({"map":)";
+        writeString(out, map.generic_string());
+
+        if (const auto copies = g_options.duplicates.find(map); copies != g_options.duplicates.end())
+        {
+            out << R"(,"copies":[)";
+            for (std::size_t i = 0; i < copies->second.size(); ++i)
+            {
+                out << (i ? "," : "");
+                writeString(out, copies->second[i].generic_string());
+            }
+            out << ']';
+        }
+
+        out << R"(,"entries":[)";
+        for (std::size_t i = 0; i < entries.size(); ++i)
+        {
+            const EntityEntry& entry = entries[i];
+            out << (i ? "," : "") << R"({"index":)" << entry.index << R"(,"flags":)" << entry.flags << R"(,"classname":)";
+            writeString(out, entry.classname);
+            out << R"(,"targetname":)";
+            writeString(out, entry.targetname);
+            out << R"(,"matches":)";
+            writeString(out, entry.queryMatches);
+
+            if (!entry.fullEnt.empty())
+            {
+                out << R"(,"keyvalues":[)";
+                for (std::size_t j = 0; j < entry.fullEnt.size(); ++j)
+                {
+                    out << (j ? ",[" : "[");
+                    writeString(out, entry.fullEnt[j].first);
+                    out << ',';
+                    writeString(out, entry.fullEnt[j].second);
+                    out << ']';
+                }
+                out << ']';
+            }
+            out << '}';
+        }
+        out << "]}\n";
+    }
+
+    // Shard numbers are whole, not negative and below limit, anything else isn't from a partial
+    bool isShardNumber(const JsonValue& value, const double limit)
+    {
+        return value.type == JsonValue::Type::Number && value.number >= 0. && value.number < limit && value.number == std::floor(value.number);
+    }
+
+    void readMap(const JsonValue& line)
+    {
+        const fs::path map = line["map"].string;
+        if (map.empty())
+            throw std::runtime_error("Map line without a map path");
+
+        std::vector<EntityEntry>& entries = g_options.entries[map];
+        for (const JsonValue& item : line["entries"].items)
+        {
+            EntityEntry& entry = entries.emplace_back();
+            entry.matched = true;
+            entry.index = static_cast<unsigned int>(item["index"].number);
+            entry.flags = static_cast<unsigned int>(item["flags"].number);
+            entry.classname = item["classname"].string;
+            entry.targetname = item["targetname"].string;
+            entry.queryMatches = item["matches"].string;
+            for (const JsonValue& keyvalue : item["keyvalues"].items)
+            {
+                if (keyvalue.items.size() == 2)
+                    entry.fullEnt.emplace_back(keyvalue.items[0].string, keyvalue.items[1].string);
+            }
+        }
+
+        for (const JsonValue& copy : line["copies"].items)
+            g_options.duplicates[map].emplace_back(copy.string);
+    }
+}
+
+
+void Shards::writePartial(std::ostream& out)
+{
+    out << std::format(R"({{"shard":{},"shards":{},"maps":{},"matches":{},"failed":{},"deduplicated":{},"absolute":{},"listed":{},"full":{},"interrupted":{}}})",
+        g_options.shardIndex, g_options.shardCount, g_options.globs.size(), g_options.foundEntries, g_stats.mapsFailed.load(),
+        g_stats.mapsDeduplicated.load(), g_options.absoluteDir, g_options.listedMaps, g_options.printFullEnt, g_receivedSignal != -1) << '\n';
+
+    // Sorted so the same shard always writes the same file
+    std::vector<const fs::path*> maps;
+    maps.reserve(g_options.entries.size());
+    for (const auto& map : g_options.entries | std::views::keys)
+        maps.push_back(&map);
+    std::ranges::sort(maps, {}, [](const fs::path* map) { return *map; });
+
+    for (const fs::path* map : maps)
+        writeMap(out, *map, g_options.entries.at(*map));
+    out.flush();
+}
+
+std::size_t Shards::mergePartials(const std::vector<fs::path>& files)
+{
+    std::size_t mapsChecked = 0;
+    std::vector<const fs::path*> mergedFrom;  // Partial merged for each shard, none while it's missing
+    bool full = !files.empty();
+
+    for (const auto& file : files)
+    {
+        std::ifstream in{ file };
+        if (!in.is_open())
+            throw std::runtime_error("Could not open " + file.string() + " for reading");
+
+        bool headerRead = false, repeated = false;
+        std::string line;
+        for (std::size_t lineNumber = 1; std::getline(in, line); ++lineNumber)
+        {
+            if (line.empty())
+                continue;
+
+            JsonValue value;
+            try
+            {
+                value = JsonParser{ line }.parse();
+                if (headerRead)
+                {
+                    readMap(value);
+                    continue;
+                }
+            }
+            catch (const std::runtime_error& e)
+            {
+                throw std::runtime_error(std::format("{}:{}: {}", file.string(), lineNumber, e.what()));
+            }
+
+            if (!isShardNumber(value["shards"], c_maxShards + 1.) || !isShardNumber(value["shard"], value["shards"].number))
+                throw std::runtime_error(file.string() + " is not a partial result of mer --shard");
+
+            const auto shardCount = static_cast<unsigned int>(value["shards"].number);
+            const auto shardIndex = static_cast<unsigned int>(value["shard"].number);
+            if (!mergedFrom.empty() && mergedFrom.size() != shardCount)
+                throw std::runtime_error(std::format("{} is shard {}/{}, but the other partial results are of {} shards",
+                    file.string(), shardIndex, shardCount, mergedFrom.size()));
+
+            // A retried shard leaves its partial twice, merging both would count its maps and matches twice
+            mergedFrom.resize(shardCount);
+            if (mergedFrom[shardIndex])
+            {
+                logger.warning(std::format("Skipping {}, shard {}/{} was already merged from {}",
+                    file.string(), shardIndex, shardCount, mergedFrom[shardIndex]->string()));
+                repeated = true;
+                break;
+            }
+            mergedFrom[shardIndex] = &file;
+
+            if (value["interrupted"].boolean)
+                logger.warning(file.string() + " is the partial result of an interrupted scan");
+
+            mapsChecked += static_cast<std::size_t>(value["maps"].number);
+            g_options.foundEntries += static_cast<unsigned int>(value["matches"].number);
+            g_stats.mapsFailed += static_cast<std::uint64_t>(value["failed"].number);
+            g_stats.mapsDeduplicated += static_cast<std::uint64_t>(value["deduplicated"].number);
+            g_options.absoluteDir |= value["absolute"].boolean;
+            g_options.listedMaps |= value["listed"].boolean;
+            full &= value["full"].boolean;
+            headerRead = true;
+        }
+
+        if (!headerRead && !repeated)
+            throw std::runtime_error(file.string() + " is empty");
+    }
+
+    for (std::size_t i = 0; i < mergedFrom.size(); ++i)
+    {
+        if (!mergedFrom[i])
+            logger.warning(std::format("Partial result of shard {}/{} is missing", i, mergedFrom.size()));
+    }
+
+    g_options.printFullEnt = full;
+    return mapsChecked;
+}
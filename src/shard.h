@@ -0,0 +1,22 @@
+#pragma once
+#include <vector>
+#include <ostream>
+#include <filesystem>
+
+
+/*
+	Partial results of a --shard run, written as JSON lines: a header with the shard and its totals,
+	then one line per map with matches. Merging the partials of every shard gives the same report
+	as scanning all maps in one process.
+*/
+namespace Shards
+{
+	// More shards than this is a typo rather than a cluster, and a partial claiming it is corrupt
+	constexpr unsigned int c_maxShards = 65536;
+
+	// Writes the scan results in g_options as the partial result of its shard
+	void writePartial(std::ostream& out);
+
+	// Loads partial results into g_options for the report, returns the number of maps the shards checked
+	std::size_t mergePartials(const std::vector<std::filesystem::path>& files);
+}
@@ -0,0 +1,165 @@
+#include <cmath>
+#include <charconv>
+#include <algorithm>
+#include "spatial.h"
+
+
+// Cells are never smaller than this, a few player widths
+static constexpr double c_minCellSize = 64.;
+static constexpr int c_maxCellsPerAxis = 256;
+
+
+std::optional<Region> Region::parse(const std::string_view key, std::string_view value)
+{
+    std::vector<double> numbers;
+    while (!value.empty())
+    {
+        const std::size_t comma = value.find(',');
+        const std::string_view part = value.substr(0, comma);
+
+        double number = 0.;
+        const auto [end, error] = std::from_chars(part.data(), part.data() + part.size(), number);
+        if (part.empty() || error != std::errc{} || end != part.data() + part.size() || !std::isfinite(number))
+            return std::nullopt;
+        numbers.push_back(number);
+
+        if (comma == std::string_view::npos)
+            break;
+        value.remove_prefix(comma + 1);
+    }
+
+    Region region;
+    if (key == "near" && numbers.size() == 4 && numbers[3] >= 0.)
+    {
+        region.shape = Sphere;
+        region.radius = numbers[3];
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            region.center[axis] = numbers[axis];
+            region.min[axis] = numbers[axis] - region.radius;
+            region.max[axis] = numbers[axis] + region.radius;
+        }
+        return region;
+    }
+
+    if (key == "inbox" && numbers.size() == 6)
+    {
+        region.shape = Box;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            region.min[axis] = std::min(numbers[axis], numbers[axis + 3]);
+            region.max[axis] = std::max(numbers[axis], numbers[axis + 3]);
+            region.center[axis] = (region.min[axis] + region.max[axis]) / 2.;
+        }
+        return region;
+    }
+
+    return std::nullopt;
+}
+
+bool Region::contains(const Vec3& point) const
+{
+    if (shape == Box)
+    {
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            if (point[axis] < min[axis] || point[axis] > max[axis])
+                return false;
+        }
+        return true;
+    }
+
+    double distance = 0.;
+    for (int axis = 0; axis < 3; ++axis)
+        distance += (point[axis] - center[axis]) * (point[axis] - center[axis]);
+    return distance <= radius * radius;
+}
+
+
+SpatialGrid::SpatialGrid(const std::span<const std::optional<Vec3>> positions)
+{
+    std::size_t count = 0;
+    for (const auto& position : positions)
+    {
+        if (!position)
+            continue;
+
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            m_min[axis] = count ? std::min(m_min[axis], (*position)[axis]) : (*position)[axis];
+            m_max[axis] = count ? std::max(m_max[axis], (*position)[axis]) : (*position)[axis];
+        }
+        ++count;
+    }
+
+    // About two entities per cell over the volume the entities span
+    double volume = 1.;
+    for (int axis = 0; axis < 3; ++axis)
+        volume *= std::max(m_max[axis] - m_min[axis], c_minCellSize);
+    m_cellSize = std::max(c_minCellSize, std::cbrt(volume / std::max<double>(1., static_cast<double>(count) / 2.)));
+
+    std::size_t cellCount = 1;
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const double cells = std::floor((m_max[axis] - m_min[axis]) / m_cellSize) + 1.;
+        m_cells[axis] = static_cast<int>(std::clamp(cells, 1., static_cast<double>(c_maxCellsPerAxis)));
+        cellCount *= static_cast<std::size_t>(m_cells[axis]);
+    }
+
+    // Counting sort of the positions by cell
+    const auto cellIndex = [this](const Vec3& position) {
+        return (static_cast<std::size_t>(cellOf(position[2], 2)) * m_cells[1] + cellOf(position[1], 1)) * m_cells[0] + cellOf(position[0], 0);
+    };
+
+    m_cellStart.assign(cellCount + 1, 0);
+    for (const auto& position : positions)
+    {
+        if (position)
+            ++m_cellStart[cellIndex(*position) + 1];
+    }
+    for (std::size_t cell = 0; cell < cellCount; ++cell)
+        m_cellStart[cell + 1] += m_cellStart[cell];
+
+    m_points.resize(count);
+    std::vector<std::uint32_t> next{ m_cellStart.begin(), m_cellStart.end() - 1 };
+    for (std::uint32_t entity = 0; entity < positions.size(); ++entity)
+    {
+        if (positions[entity])
+            m_points[next[cellIndex(*positions[entity])]++] = { *positions[entity], entity };
+    }
+}
+
+int SpatialGrid::cellOf(const double coordinate, const int axis) const
+{
+    const double cell = std::floor((coordinate - m_min[axis]) / m_cellSize);
+    return static_cast<int>(std::clamp(cell, 0., static_cast<double>(m_cells[axis] - 1)));
+}
+
+void SpatialGrid::find(const Region& region, std::vector<bool>& inside) const
+{
+    if (m_points.empty())
+        return;
+
+    std::array<int, 3> first{}, last{};
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        // Regions entirely outside the grid on any axis can't have anything inside
+        if (region.max[axis] < m_min[axis] || region.min[axis] > m_max[axis])
+            return;
+        first[axis] = cellOf(region.min[axis], axis);
+        last[axis] = cellOf(region.max[axis], axis);
+    }
+
+    for (int z = first[2]; z <= last[2]; ++z)
+    {
+        for (int y = first[1]; y <= last[1]; ++y)
+        {
+            const std::size_t row = (static_cast<std::size_t>(z) * m_cells[1] + y) * m_cells[0];
+            for (std::uint32_t i = m_cellStart[row + first[0]]; i < m_cellStart[row + last[0] + 1]; ++i)
+            {
+                if (region.contains(m_points[i].position))
+                    inside[m_points[i].entity] = true;
+            }
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <span>
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+
+using Vec3 = std::array<double, 3>;
+
+// Sphere of near=x,y,z,r or box of inbox=x1,y1,z1,x2,y2,z2 queries
+struct Region
+{
+	enum Shape
+	{
+		Sphere,
+		Box
+	};
+
+	Shape shape = Sphere;
+	Vec3 min{}, max{};  // Bounds of the sphere too
+	Vec3 center{};
+	double radius = 0.;
+
+	[[nodiscard]] static bool isRegionKey(std::string_view key) { return key == "near" || key == "inbox"; }
+	// Nothing when the value isn't a region of the kind the key asks for
+	static std::optional<Region> parse(std::string_view key, std::string_view value);
+	[[nodiscard]] bool contains(const Vec3& point) const;
+};
+
+/*
+	Uniform grid over the positions of a map's entities, sized for a couple of entities per cell.
+	Finding the entities in a region only tests those in the cells the region's bounds overlap.
+*/
+class SpatialGrid
+{
+public:
+	explicit SpatialGrid(std::span<const std::optional<Vec3>> positions);
+
+	// Sets the flags of the entities inside the region, the flags have one per position
+	void find(const Region& region, std::vector<bool>& inside) const;
+private:
+	struct Point
+	{
+		Vec3 position;
+		std::uint32_t entity;
+	};
+
+	Vec3 m_min{}, m_max{};  // Bounds of the positions
+	double m_cellSize = 1.;
+	std::array<int, 3> m_cells{};
+	std::vector<std::uint32_t> m_cellStart;  // Offsets into m_points by cell, with one past the last cell at the end
+	std::vector<Point> m_points;  // Grouped by cell
+
+	[[nodiscard]] int cellOf(double coordinate, int axis) const;
+};
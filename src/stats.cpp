@@ -0,0 +1,182 @@
+#include <format>
+#include <algorithm>
+#include "stats.h"
+#include "trace.h"
+#include "memstats.h"
+#include "tokenizer.h"
+
+
+using Clock = std::chrono::steady_clock;
+
+ScanStats g_stats{};
+
+
+static constexpr auto c_greaterDuration = [](const MapTiming& a, const MapTiming& b) {
+    return a.duration > b.duration;
+};
+
+const char* phaseName(const Phase phase)
+{
+    switch (phase)
+    {
+    case Phase::Discovery: return "discovery";
+    case Phase::Open: return "open";
+    case Phase::Read: return "read";
+    case Phase::Tokenize: return "tokenize";
+    case Phase::Match: return "match";
+    case Phase::Report: return "report";
+    default: return "unknown";
+    }
+}
+
+void ScanStats::enable()
+{
+    enabled = true;
+    start = Clock::now();
+}
+
+void ScanStats::addPhaseTime(const Phase phase, const std::chrono::nanoseconds duration)
+{
+    m_phaseNanos[static_cast<size_t>(phase)] += duration.count();
+    ++m_phaseCalls[static_cast<size_t>(phase)];
+}
+
+void ScanStats::addMapTiming(MapTiming timing)
+{
+    std::lock_guard lock{ m_slowestMutex };
+
+    // Min-heap on duration, so the fastest of the slowest maps is always at the front
+    if (m_slowest.size() < c_slowestMaps)
+    {
+        m_slowest.push_back(std::move(timing));
+        std::ranges::push_heap(m_slowest, c_greaterDuration);
+        return;
+    }
+
+    if (timing.duration <= m_slowest.front().duration)
+        return;
+
+    std::ranges::pop_heap(m_slowest, c_greaterDuration);
+    m_slowest.back() = std::move(timing);
+    std::ranges::push_heap(m_slowest, c_greaterDuration);
+}
+
+void ScanStats::addStage(const StageMetrics& stage)
+{
+    std::lock_guard lock{ m_slowestMutex };
+    const auto existing = std::ranges::find(m_stages, stage.name, &StageMetrics::name);
+    if (existing == m_stages.end())
+    {
+        m_stages.push_back(stage);
+        return;
+    }
+
+    // Maps scanned in batches run the same stages once per batch
+    const std::uint64_t items = existing->items + stage.items;
+    if (items)
+        existing->averageOccupancy = (existing->averageOccupancy * existing->items + stage.averageOccupancy * stage.items) / items;
+    existing->items = items;
+    existing->busy += stage.busy;
+    existing->threads = std::max(existing->threads, stage.threads);
+    existing->queueCapacity = std::max(existing->queueCapacity, stage.queueCapacity);
+    existing->maxOccupancy = std::max(existing->maxOccupancy, stage.maxOccupancy);
+    existing->fullWaits += stage.fullWaits;
+    existing->emptyWaits += stage.emptyWaits;
+}
+
+void ScanStats::print(std::ostream& out) const
+{
+    const double wallSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    out << "\nScan statistics:\n"
+        << std::format("  {:<12}{:>12}{:>10}\n", "phase", "time (ms)", "calls");
+    for (size_t i = 0; i < m_phaseNanos.size(); ++i)
+    {
+        out << std::format("  {:<12}{:>12.2f}{:>10}\n", phaseName(static_cast<Phase>(i)),
+            static_cast<double>(m_phaseNanos[i].load()) / 1e6, m_phaseCalls[i].load());
+    }
+    out << std::format("  {:<12}{:>12.2f}\n\n", "wall", wallSeconds * 1e3);
+
+    const double megabytes = static_cast<double>(bytesRead.load()) / 1e6;
+    out << std::format("  maps read          {} ({} failed)\n", mapsRead.load(), mapsFailed.load())
+        << std::format("  bytes read         {:.2f} MB ({:.2f} MB/s)\n", megabytes, megabytes / wallSeconds)
+        << std::format("  entities parsed    {} ({:.0f}/s, {} tokenizer)\n", entitiesParsed.load(), entitiesParsed.load() / wallSeconds,
+            Tokenizer::isaName(Tokenizer::bestIsa()))
+        << std::format("  queries evaluated  {}\n", queriesEvaluated.load())
+        << std::format("  matches            {}\n", matches.load());
+    if (mapsDeduplicated)
+        out << std::format("  maps deduplicated  {}\n", mapsDeduplicated.load());
+    if (ioBackend)
+        out << std::format("  io backend         {}\n", ioBackend);
+
+    std::lock_guard lock{ m_slowestMutex };
+    if (!m_stages.empty())
+    {
+        out << "\nPipeline:\n"
+            << std::format("  {:<16}{:>8}{:>10}{:>12}{:>7}{:>8}{:>10}{:>6}{:>12}{:>12}\n",
+                "stage", "threads", "items", "busy (ms)", "util", "queue", "avg occ", "max", "full waits", "empty waits");
+        for (const auto& stage : m_stages)
+        {
+            const double busySeconds = std::chrono::duration<double>(stage.busy).count();
+            const double utilization = stage.threads ? busySeconds / (stage.threads * wallSeconds) * 100. : 0.;
+            out << std::format("  {:<16}{:>8}{:>10}{:>12.2f}{:>6.0f}%{:>8}{:>10.1f}{:>6}{:>12}{:>12}\n",
+                stage.name, stage.threads, stage.items, busySeconds * 1e3, utilization, stage.queueCapacity,
+                stage.averageOccupancy, stage.maxOccupancy, stage.fullWaits, stage.emptyWaits);
+        }
+    }
+
+    MemStats::print(out, entitiesParsed.load());
+
+    if (m_slowest.empty())
+        return;
+
+    std::vector<MapTiming> slowest = m_slowest;
+    std::ranges::sort(slowest, c_greaterDuration);
+
+    out << "\nSlowest maps:\n";
+    for (const auto& [path, duration, lumpSize, entities] : slowest)
+    {
+        out << std::format("  {:>9.2f} ms  {} (entity lump {} bytes, {} entities)\n",
+            std::chrono::duration<double, std::milli>(duration).count(), path.string(), lumpSize, entities);
+    }
+}
+
+
+void recordPhase(const Phase phase, const Clock::time_point start, const std::filesystem::path* path)
+{
+    if (!g_stats.enabled && !g_trace.enabled)
+        return;
+
+    const auto end = Clock::now();
+    if (g_stats.enabled)
+        g_stats.addPhaseTime(phase, end - start);
+    if (g_trace.enabled)
+        g_trace.addSpan(phaseName(phase), start, end, path);
+}
+
+PhaseTimer::PhaseTimer(const Phase phase, const std::filesystem::path* path)
+    : m_phase(phase), m_path(path), m_active(g_stats.enabled || g_trace.enabled)
+{
+    if (!m_active)
+        return;
+
+#ifdef MER_MEMSTATS
+    m_previousMemoryPhase = MemStats::setPhase(static_cast<int>(phase));
+#endif
+    m_start = Clock::now();
+}
+
+PhaseTimer::~PhaseTimer()
+{
+    if (!m_active)
+        return;
+
+#ifdef MER_MEMSTATS
+    MemStats::setPhase(m_previousMemoryPhase);
+#endif
+    const auto end = Clock::now();
+    if (g_stats.enabled)
+        g_stats.addPhaseTime(m_phase, end - m_start);
+    if (g_trace.enabled)
+        g_trace.addSpan(phaseName(m_phase), m_start, end, m_path);
+}
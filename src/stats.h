@@ -0,0 +1,100 @@
+#pragma once
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <ostream>
+#include <filesystem>
+
+
+enum class Phase
+{
+	Discovery,
+	Open,
+	Read,
+	Tokenize,
+	Match,
+	Report,
+	PhaseCount
+};
+
+// Work done by one pipeline stage and the occupancy of the queue feeding it
+struct StageMetrics
+{
+	std::string name;
+	unsigned threads = 0;
+	std::uint64_t items = 0;
+	std::chrono::nanoseconds busy{};
+	std::size_t queueCapacity = 0;
+	double averageOccupancy = 0.;
+	std::uint64_t maxOccupancy = 0;
+	std::uint64_t fullWaits = 0;
+	std::uint64_t emptyWaits = 0;
+};
+
+struct MapTiming
+{
+	std::filesystem::path path;
+	std::chrono::nanoseconds duration{};
+	std::int32_t lumpSize = 0;
+	std::size_t entities = 0;
+};
+
+
+/*
+	Counters and phase timings collected when running with --stats.
+	Everything is a no-op unless enabled is set before the scan starts.
+*/
+class ScanStats
+{
+public:
+	static constexpr std::size_t c_slowestMaps = 10;
+
+	bool enabled = false;
+	std::chrono::steady_clock::time_point start;
+	std::atomic<std::uint64_t> mapsRead = 0;
+	std::atomic<std::uint64_t> mapsFailed = 0;
+	std::atomic<std::uint64_t> mapsDeduplicated = 0;
+	std::atomic<std::uint64_t> bytesRead = 0;
+	std::atomic<std::uint64_t> entitiesParsed = 0;
+	std::atomic<std::uint64_t> queriesEvaluated = 0;
+	std::atomic<std::uint64_t> matches = 0;
+	const char* ioBackend = nullptr;
+
+	void enable();
+	void addPhaseTime(Phase phase, std::chrono::nanoseconds duration);
+	void addMapTiming(MapTiming timing);
+	void addStage(const StageMetrics& stage);
+	void print(std::ostream& out) const;
+private:
+	std::array<std::atomic<std::int64_t>, static_cast<size_t>(Phase::PhaseCount)> m_phaseNanos{};
+	std::array<std::atomic<std::uint64_t>, static_cast<size_t>(Phase::PhaseCount)> m_phaseCalls{};
+	mutable std::mutex m_slowestMutex;
+	std::vector<MapTiming> m_slowest;
+	std::vector<StageMetrics> m_stages;
+};
+extern ScanStats g_stats;
+
+
+class PhaseTimer
+{
+public:
+	explicit PhaseTimer(Phase phase, const std::filesystem::path* path = nullptr);
+	~PhaseTimer();
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+private:
+	Phase m_phase;
+	const std::filesystem::path* m_path;
+	bool m_active;
+	int m_previousMemoryPhase = 0;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+// What a PhaseTimer records, for work like io_uring reads that doesn't stay on one thread's stack
+void recordPhase(Phase phase, std::chrono::steady_clock::time_point start, const std::filesystem::path* path = nullptr);
+
+const char* phaseName(Phase phase);
@@ -0,0 +1,316 @@
+#include <bit>
+#include <array>
+#include <string>
+#include <cstring>
+#include <stdexcept>
+#include "logging.h"
+#include "tokenizer.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MER_TOKENIZER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define MER_TARGET_AVX2
+#else
+#define MER_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+
+using namespace Styling;
+using namespace Tokenizer;
+
+namespace
+{
+    constexpr std::size_t c_blockSize = 64;
+
+    struct BlockMasks
+    {
+        std::uint64_t open;       // {
+        std::uint64_t delimiter;  // " or }
+        std::uint64_t quote;
+        std::uint64_t newline;
+        std::uint64_t escape;     // \n or \r
+        std::uint64_t nonspace;
+    };
+
+    using ClassifyFunction = void(*)(const char* block, BlockMasks& masks);
+
+    bool isSpace(const unsigned char c)
+    {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    void classifyScalar(const char* block, BlockMasks& masks)
+    {
+        masks = {};
+        for (std::size_t i = 0; i < c_blockSize; ++i)
+        {
+            const auto c = static_cast<unsigned char>(block[i]);
+            const std::uint64_t bit = 1ull << i;
+            if (c == '{') masks.open |= bit;
+            if (c == '"' || c == '}') masks.delimiter |= bit;
+            if (c == '"') masks.quote |= bit;
+            if (c == '\n') masks.newline |= bit;
+            if (c == '\n' || c == '\r') masks.escape |= bit;
+            if (!isSpace(c)) masks.nonspace |= bit;
+        }
+    }
+
+#ifdef MER_TOKENIZER_X86
+    void classifySSE2(const char* block, BlockMasks& masks)
+    {
+        const __m128i open = _mm_set1_epi8('{');
+        const __m128i close = _mm_set1_epi8('}');
+        const __m128i quote = _mm_set1_epi8('"');
+        const __m128i newline = _mm_set1_epi8('\n');
+        const __m128i carriage = _mm_set1_epi8('\r');
+        const __m128i space = _mm_set1_epi8(' ');
+        const __m128i tab = _mm_set1_epi8('\t');
+        const __m128i controlRange = _mm_set1_epi8('\r' - '\t');
+
+        masks = {};
+        for (std::size_t i = 0; i < c_blockSize; i += 16)
+        {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block + i));
+            const __m128i isQuote = _mm_cmpeq_epi8(chunk, quote);
+            const __m128i isNewline = _mm_cmpeq_epi8(chunk, newline);
+
+            // \t through \r are whitespace too, c - \t <= \r - \t as unsigned bytes
+            const __m128i offset = _mm_sub_epi8(chunk, tab);
+            const __m128i isControlSpace = _mm_cmpeq_epi8(_mm_min_epu8(offset, controlRange), offset);
+            const __m128i isSpace = _mm_or_si128(_mm_cmpeq_epi8(chunk, space), isControlSpace);
+
+            const auto mask = [](const __m128i v) {
+                return static_cast<std::uint64_t>(static_cast<std::uint16_t>(_mm_movemask_epi8(v)));
+            };
+            masks.open |= mask(_mm_cmpeq_epi8(chunk, open)) << i;
+            masks.delimiter |= mask(_mm_or_si128(isQuote, _mm_cmpeq_epi8(chunk, close))) << i;
+            masks.quote |= mask(isQuote) << i;
+            masks.newline |= mask(isNewline) << i;
+            masks.escape |= mask(_mm_or_si128(isNewline, _mm_cmpeq_epi8(chunk, carriage))) << i;
+            masks.nonspace |= (~mask(isSpace) & 0xFFFFull) << i;
+        }
+    }
+
+    MER_TARGET_AVX2 std::uint64_t mask(const __m256i v)
+    {
+        return static_cast<std::uint64_t>(static_cast<std::uint32_t>(_mm256_movemask_epi8(v)));
+    }
+
+    MER_TARGET_AVX2 void classifyAVX2(const char* block, BlockMasks& masks)
+    {
+        const __m256i open = _mm256_set1_epi8('{');
+        const __m256i close = _mm256_set1_epi8('}');
+        const __m256i quote = _mm256_set1_epi8('"');
+        const __m256i newline = _mm256_set1_epi8('\n');
+        const __m256i carriage = _mm256_set1_epi8('\r');
+        const __m256i space = _mm256_set1_epi8(' ');
+        const __m256i tab = _mm256_set1_epi8('\t');
+        const __m256i controlRange = _mm256_set1_epi8('\r' - '\t');
+
+        masks = {};
+        for (std::size_t i = 0; i < c_blockSize; i += 32)
+        {
+            const __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(block + i));
+            const __m256i isQuote = _mm256_cmpeq_epi8(chunk, quote);
+            const __m256i isNewline = _mm256_cmpeq_epi8(chunk, newline);
+
+            const __m256i offset = _mm256_sub_epi8(chunk, tab);
+            const __m256i isControlSpace = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, controlRange), offset);
+            const __m256i isSpace = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, space), isControlSpace);
+
+            masks.open |= mask(_mm256_cmpeq_epi8(chunk, open)) << i;
+            masks.delimiter |= mask(_mm256_or_si256(isQuote, _mm256_cmpeq_epi8(chunk, close))) << i;
+            masks.quote |= mask(isQuote) << i;
+            masks.newline |= mask(isNewline) << i;
+            masks.escape |= mask(_mm256_or_si256(isNewline, _mm256_cmpeq_epi8(chunk, carriage))) << i;
+            masks.nonspace |= (~mask(isSpace) & 0xFFFFFFFFull) << i;
+        }
+    }
+#endif
+
+    ClassifyFunction classifyFunction(const Isa isa)
+    {
+#ifdef MER_TOKENIZER_X86
+        if (isa == Isa::AVX2)
+            return classifyAVX2;
+        if (isa == Isa::SSE2)
+            return classifySSE2;
+#endif
+        return classifyScalar;
+    }
+
+
+    // Walks the block masks, positions past the end of the lump are clamped to its size
+    class MaskCursor
+    {
+    public:
+        MaskCursor(const std::pmr::vector<BlockMasks>& blocks, const std::size_t size) : m_blocks(blocks), m_size(size) {}
+
+        std::size_t next(std::uint64_t BlockMasks::* mask, const std::size_t position) const
+        {
+            if (position >= m_size)
+                return m_size;
+
+            std::size_t block = position / c_blockSize;
+            std::uint64_t bits = m_blocks[block].*mask & (~0ull << (position % c_blockSize));
+            while (!bits)
+            {
+                if (++block == m_blocks.size())
+                    return m_size;
+                bits = m_blocks[block].*mask;
+            }
+
+            return std::min(block * c_blockSize + std::countr_zero(bits), m_size);
+        }
+
+        bool any(std::uint64_t BlockMasks::* mask, const std::size_t begin, const std::size_t end) const
+        {
+            return next(mask, begin) < end;
+        }
+    private:
+        const std::pmr::vector<BlockMasks>& m_blocks;
+        std::size_t m_size;
+    };
+}
+
+
+#ifdef MER_TOKENIZER_X86
+static bool cpuHasAVX2()
+{
+#ifdef _MSC_VER
+    std::array<int, 4> info{};
+    __cpuid(info.data(), 0);
+    if (info[0] < 7)
+        return false;
+
+    // AVX2 needs the OS to save the upper halves of the YMM registers
+    __cpuid(info.data(), 1);
+    constexpr int osxsave = 1 << 27, avx = 1 << 28;
+    if ((info[2] & (osxsave | avx)) != (osxsave | avx) || (_xgetbv(0) & 6) != 6)
+        return false;
+
+    __cpuidex(info.data(), 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+bool Tokenizer::isaSupported(const Isa isa)
+{
+    switch (isa)
+    {
+#ifdef MER_TOKENIZER_X86
+    case Isa::AVX2: return cpuHasAVX2();
+    case Isa::SSE2: return true;
+#else
+    case Isa::AVX2:
+    case Isa::SSE2: return false;
+#endif
+    default: return true;
+    }
+}
+
+Isa Tokenizer::bestIsa()
+{
+    static const Isa best = isaSupported(Isa::AVX2) ? Isa::AVX2 : isaSupported(Isa::SSE2) ? Isa::SSE2 : Isa::Scalar;
+    return best;
+}
+
+const char* Tokenizer::isaName(const Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::AVX2: return "AVX2";
+    case Isa::SSE2: return "SSE2";
+    default: return "scalar";
+    }
+}
+
+
+void Tokenizer::tokenize(const std::string_view lump, const std::size_t start, Result& result, const Isa isa)
+{
+    const std::size_t size = lump.size();
+
+    // Stage 1: classify every byte, the last partial block is padded with zeroes
+    std::pmr::vector<BlockMasks> blocks{ (size + c_blockSize - 1) / c_blockSize, result.tokens.get_allocator() };
+    const ClassifyFunction classify = classifyFunction(isaSupported(isa) ? isa : Isa::Scalar);
+    std::size_t quotes = 0;
+    for (std::size_t block = 0; block < blocks.size(); ++block)
+    {
+        const std::size_t offset = block * c_blockSize;
+        if (offset + c_blockSize <= size)
+            classify(lump.data() + offset, blocks[block]);
+        else
+        {
+            std::array<char, c_blockSize> padded{};
+            std::memcpy(padded.data(), lump.data() + offset, size - offset);
+            classify(padded.data(), blocks[block]);
+        }
+        quotes += std::popcount(blocks[block].quote);
+    }
+
+    result.tokens.reserve(quotes / 2 + 1);
+
+
+    // Stage 2: walk the structural characters
+    const MaskCursor cursor{ blocks, size };
+    const auto pushToken = [&](const std::size_t begin, const std::size_t end) {
+        result.tokens.push_back({
+            static_cast<std::uint32_t>(begin), static_cast<std::uint32_t>(end), cursor.any(&BlockMasks::escape, begin, end)
+        });
+    };
+
+    std::size_t position = start;
+    while (true)
+    {
+        // The last byte of the lump is its terminator
+        position = cursor.next(&BlockMasks::open, position);
+        if (position + 1 >= size)
+            return;
+
+        const std::size_t entityStart = ++position;
+        while (true)
+        {
+            position = cursor.next(&BlockMasks::delimiter, position);
+            if (position >= size || lump[position] == '}')
+            {
+                result.entityEnds.push_back(static_cast<std::uint32_t>(result.tokens.size()));
+                ++position;
+                break;
+            }
+
+            const std::size_t keyStart = position + 1;
+            const std::size_t keyEnd = cursor.next(&BlockMasks::quote, keyStart);
+
+            const std::size_t valueQuote = cursor.next(&BlockMasks::nonspace, keyEnd + 1);
+            if (valueQuote >= size)
+            {
+                // Lump ended after a key without a value
+                result.entityEnds.push_back(static_cast<std::uint32_t>(result.tokens.size()));
+                return;
+            }
+            if (lump[valueQuote] != '"')
+            {
+                // Print out the rest of the entity before the unexpected data was encountered
+                throw std::runtime_error("Unexpected entity data near " + style(info|dim)
+                    + std::string(lump.substr(entityStart, valueQuote + 1 - entityStart)) + style());
+            }
+
+            const std::size_t valueStart = valueQuote + 1;
+            const std::size_t valueEnd = cursor.next(&BlockMasks::quote, valueStart);
+            pushToken(keyStart, keyEnd);
+            pushToken(valueStart, valueEnd);
+            position = valueEnd + 1;
+
+            // Skip comments at end of line (occurs in certain SC maps)
+            if (position < size && lump[position] == '/')
+                position = cursor.next(&BlockMasks::newline, position) + 1;
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <string_view>
+#include <memory_resource>
+
+
+/*
+	Entity lump tokenizer in two stages. The first classifies the lump 64 bytes at a time into bitmasks
+	of braces, quotes, newlines and whitespace, using SSE2 or AVX2 when the CPU has it. The second
+	walks those masks to emit the key/value spans of every entity without looking at each byte.
+*/
+namespace Tokenizer
+{
+	enum class Isa
+	{
+		Scalar,
+		SSE2,
+		AVX2
+	};
+
+	// Span of a key or value in the lump, escaped if it contains newlines or carriage returns
+	struct Token
+	{
+		std::uint32_t begin, end;
+		bool escaped;
+	};
+
+	struct Result
+	{
+		std::pmr::vector<Token> tokens;
+		std::pmr::vector<std::uint32_t> entityEnds;  // Token count at the end of each entity
+
+		explicit Result(std::pmr::memory_resource* resource) : tokens(resource), entityEnds(resource) {}
+	};
+
+	Isa bestIsa();
+	const char* isaName(Isa isa);
+	bool isaSupported(Isa isa);
+
+	// Tokenizes lump from start, throws on a key that isn't followed by a quoted value
+	void tokenize(std::string_view lump, std::size_t start, Result& result, Isa isa = bestIsa());
+}
@@ -0,0 +1,102 @@
+#include <format>
+#include <fstream>
+#include "logging.h"
+#include "trace.h"
+#include "utils.h"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
+
+TraceRecorder g_trace{};
+
+
+void TraceRecorder::enable(const std::filesystem::path& filepath)
+{
+    enabled = true;
+    m_filepath = filepath;
+    m_start = Clock::now();
+}
+
+TraceRecorder::ThreadBuffer& TraceRecorder::threadBuffer()
+{
+    thread_local ThreadBuffer* buffer = nullptr;
+    if (!buffer)
+    {
+        std::lock_guard lock{ m_mutex };
+        buffer = m_buffers.emplace_back(std::make_unique<ThreadBuffer>()).get();
+        buffer->tid = static_cast<std::uint32_t>(m_buffers.size());
+        buffer->name = buffer->tid == 1 ? "main" : std::format("thread {}", buffer->tid);
+    }
+    return *buffer;
+}
+
+void TraceRecorder::addSpan(const char* name, const Clock::time_point start, const Clock::time_point end,
+    const std::filesystem::path* path)
+{
+    threadBuffer().events.push_back({
+        name,
+        std::chrono::duration_cast<std::chrono::nanoseconds>(start - m_start).count(),
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(),
+        path ? path->string() : std::string{}
+    });
+}
+
+void TraceRecorder::setThreadName(const std::string& name)
+{
+    if (enabled)
+        threadBuffer().name = name;
+}
+
+void TraceRecorder::write()
+{
+    std::ofstream file{ m_filepath, std::ios::trunc };
+    if (!file.is_open() || !file.good())
+    {
+        logger.error("Could not open trace file %s for writing", m_filepath.string().c_str());
+        return;
+    }
+
+    const int pid = getpid();
+
+    std::lock_guard lock{ m_mutex };
+    file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    bool first = true;
+    for (const auto& buffer : m_buffers)
+    {
+        file << (first ? "" : ",\n") << std::format(
+            R"({{"name":"thread_name","ph":"M","pid":{},"tid":{},"args":{{"name":"{}"}}}})",
+            pid, buffer->tid, jsonEscape(buffer->name));
+        first = false;
+
+        for (const auto& [name, start, duration, path] : buffer->events)
+        {
+            file << ",\n" << std::format(R"({{"name":"{}","cat":"scan","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{})",
+                name, start / 1e3, duration / 1e3, pid, buffer->tid);
+            if (!path.empty())
+                file << R"(,"args":{"path":")" << jsonEscape(path) << "\"}";
+            file << '}';
+        }
+    }
+    file << "\n]}\n";
+}
+
+
+TraceSpan::TraceSpan(const char* name, const std::filesystem::path* path)
+    : m_name(name), m_path(path), m_active(g_trace.enabled)
+{
+    if (m_active)
+        m_start = TraceRecorder::Clock::now();
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (m_active)
+        g_trace.addSpan(m_name, m_start, TraceRecorder::Clock::now(), m_path);
+}
@@ -0,0 +1,62 @@
+#pragma once
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <filesystem>
+
+
+/*
+	Records spans as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev) when running with --trace.
+	Spans are buffered per thread and only written out at exit, recording is a single branch when disabled.
+*/
+class TraceRecorder
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	bool enabled = false;
+
+	void enable(const std::filesystem::path& filepath);
+	void addSpan(const char* name, Clock::time_point start, Clock::time_point end, const std::filesystem::path* path = nullptr);
+	void setThreadName(const std::string& name);
+	void write();
+private:
+	struct Event
+	{
+		const char* name;
+		std::int64_t start, duration;  // Nanoseconds since m_start
+		std::string path;
+	};
+	struct ThreadBuffer
+	{
+		std::uint32_t tid;
+		std::string name;
+		std::vector<Event> events;
+	};
+
+	std::filesystem::path m_filepath;
+	Clock::time_point m_start;
+	std::mutex m_mutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+
+	ThreadBuffer& threadBuffer();
+};
+extern TraceRecorder g_trace;
+
+
+class TraceSpan
+{
+public:
+	explicit TraceSpan(const char* name, const std::filesystem::path* path = nullptr);
+	~TraceSpan();
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+private:
+	const char* m_name;
+	const std::filesystem::path* m_path;
+	bool m_active;
+	TraceRecorder::Clock::time_point m_start;
+};
@@ -3,6 +3,9 @@
 #include <iostream>
 #include <algorithm>
 #include <vector>
+#include <cstdio>
+#include <cstring>
+#include <bit>
 #include "logging.h"
 #include "utils.h"
 
@@ -212,6 +215,63 @@ void trim(std::string& str, const char* trim)
     str.erase(str.find_last_not_of(trim) + 1);
 }
 
+std::string jsonEscape(const std::string_view str)
+{
+    std::string escaped;
+    escaped.reserve(str.size());
+    for (const char c : str)
+    {
+        switch (c)
+        {
+        case '"': escaped += "\\\""; break;
+        case '\\': escaped += "\\\\"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '\t': escaped += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                escaped += buffer;
+            }
+            else
+                escaped.push_back(c);
+        }
+    }
+    return escaped;
+}
+
+// Not cryptographic, mixes 8 bytes per multiply the way xxHash and wyhash do
+std::uint64_t hashBytes(const std::string_view bytes, const std::uint64_t seed)
+{
+    constexpr std::uint64_t c_prime1 = 0x9E3779B185EBCA87ull;
+    constexpr std::uint64_t c_prime2 = 0xC2B2AE3D27D4EB4Full;
+
+    std::uint64_t hash = seed ^ (bytes.size() * c_prime1);
+    std::size_t i = 0;
+    for (; i + 8 <= bytes.size(); i += 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, bytes.data() + i, sizeof(word));
+        hash ^= std::rotl(word * c_prime2, 31) * c_prime1;
+        hash = std::rotl(hash, 27) * c_prime1 + c_prime2;
+    }
+    for (; i < bytes.size(); ++i)
+    {
+        hash ^= static_cast<unsigned char>(bytes[i]) * c_prime1;
+        hash = std::rotl(hash, 11) * c_prime2;
+    }
+
+    // Final avalanche from MurmurHash3
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
 std::vector<std::string> splitString(const std::string& str, const char delimiter)
 {
     std::istringstream strStream{ str };
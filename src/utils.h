@@ -1,7 +1,9 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <vector>
+#include <string_view>
 #include <filesystem>
 
 
@@ -17,4 +19,6 @@ std::string toLowerCase(std::string str);
 std::string toUpperCase(std::string str);
 std::string unSteampipe(std::string str);
 void trim(std::string& str, const char* trim = " \t\n\r");
+std::string jsonEscape(std::string_view str);
+std::uint64_t hashBytes(std::string_view bytes, std::uint64_t seed = 0);
 std::vector<std::string> splitString(const std::string& str, char delimiter = ' ');
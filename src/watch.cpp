@@ -0,0 +1,107 @@
+#include <map>
+#include <format>
+#include <cstring>
+#include <stdexcept>
+#include "logging.h"
+#include "watch.h"
+#include "utils.h"
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+
+namespace fs = std::filesystem;
+static inline Logging::Logger& logger = Logging::Logger::getLogger("mer");
+
+// How long the directories have to be quiet before the changes are handed out
+static constexpr int c_quietMillis = 300;
+// How often to look for a received signal while nothing happens
+static constexpr int c_idleMillis = 250;
+
+
+MapWatcher::MapWatcher(const std::vector<fs::path>& dirs)
+{
+#ifdef __linux__
+    m_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (m_fd < 0)
+        throw std::runtime_error(std::format("Could not watch for map changes: {}", std::strerror(errno)));
+
+    for (const auto& dir : dirs)
+    {
+        const int watch = inotify_add_watch(m_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM);
+        if (watch < 0)
+        {
+            logger.warning(std::format("Could not watch {}: {}", dir.string(), std::strerror(errno)));
+            continue;
+        }
+        m_dirs.emplace(watch, dir);
+    }
+
+    if (m_dirs.empty())
+        throw std::runtime_error("None of the maps directories could be watched");
+#else
+    (void)dirs;
+    throw std::runtime_error("--watch is only supported on Linux");
+#endif
+}
+
+MapWatcher::~MapWatcher()
+{
+#ifdef __linux__
+    if (m_fd >= 0)
+        close(m_fd);
+#endif
+}
+
+MapWatcher::Changes MapWatcher::wait(const std::atomic<int>& receivedSignal)
+{
+    Changes changes;
+#ifdef __linux__
+    std::map<fs::path, bool> pending;  // Whether each map was removed, the last event on a map wins
+    alignas(inotify_event) char buffer[16 * 1024];
+
+    while (receivedSignal == -1)
+    {
+        pollfd poller{ m_fd, POLLIN, 0 };
+        const int ready = poll(&poller, 1, pending.empty() ? c_idleMillis : c_quietMillis);
+        if (ready < 0 && errno != EINTR)
+            throw std::runtime_error(std::format("Could not watch for map changes: {}", std::strerror(errno)));
+        if (ready == 0 && !pending.empty())
+            break;
+        if (ready <= 0)
+            continue;
+
+        for (ssize_t length; (length = read(m_fd, buffer, sizeof(buffer))) > 0;)
+        {
+            for (const char* cursor = buffer; cursor < buffer + length;)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(cursor);
+                cursor += sizeof(inotify_event) + event->len;
+
+                if (event->mask & IN_Q_OVERFLOW)
+                    logger.warning("Too many changes at once, some maps may not be rescanned");
+
+                const auto dir = m_dirs.find(event->wd);
+                if (!event->len || dir == m_dirs.end())
+                    continue;
+
+                const fs::path name = event->name;
+                if (toLowerCase(name.extension().string()) == ".bsp")
+                    pending.insert_or_assign(dir->second / name, (event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0);
+            }
+        }
+    }
+
+    if (receivedSignal != -1)
+        return changes;
+
+    for (const auto& [map, removed] : pending)
+        (removed ? changes.removed : changes.modified).push_back(map);
+#else
+    (void)receivedSignal;
+#endif
+    return changes;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <filesystem>
+
+
+/*
+	Watches maps directories for .bsp files that get written, moved in or deleted, through inotify on Linux.
+	Events are gathered until the directories have been quiet for a moment, since a map being compiled
+	or copied is written in many chunks and often under a temporary name first.
+*/
+class MapWatcher
+{
+public:
+	struct Changes
+	{
+		std::vector<std::filesystem::path> modified;  // Created or rewritten
+		std::vector<std::filesystem::path> removed;
+	};
+
+	explicit MapWatcher(const std::vector<std::filesystem::path>& dirs);
+	~MapWatcher();
+	MapWatcher(const MapWatcher&) = delete;
+	MapWatcher& operator=(const MapWatcher&) = delete;
+
+	// Blocks until maps have changed, returns no changes once a signal has been received
+	Changes wait(const std::atomic<int>& receivedSignal);
+private:
+	int m_fd = -1;
+	std::unordered_map<int, std::filesystem::path> m_dirs;  // By watch descriptor
+};
@@ -0,0 +1,199 @@
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <sstream>
+#include "doctest.h"
+#include "aggregation.h"
+
+
+namespace fs = std::filesystem;
+
+static const fs::path c1a0 = "/steam/steamapps/common/Half-Life/valve/maps/c1a0.bsp";
+static const fs::path c1a0hd = "/steam/steamapps/common/Half-Life/valve_hd/maps/c1a0.bsp";
+
+static const std::vector<Entity> entities{
+	{ { "classname", "monster_scientist" }, { "body", "1" } },
+	{ { "classname", "monster_scientist" } },
+	{ { "classname", "monster_barney" }, { "body", "2" } },
+	{ { "classname", "worldspawn" } }
+};
+
+
+
+TEST_SUITE("aggregation")
+{
+	TEST_CASE("scopes are maps or mods")
+	{
+		CHECK(Aggregation{ "", false, Aggregation::Scope::Mod }.scopeOf(c1a0hd) == "Half-Life/valve");
+		CHECK(Aggregation{ "", false, Aggregation::Scope::Map }.scopeOf(c1a0hd) == "Half-Life/valve_hd/maps/c1a0.bsp");
+		CHECK(Aggregation{ "classname", false, Aggregation::Scope::All }.scopeOf(c1a0).empty());
+	}
+
+	TEST_CASE("merges the counts of every thread")
+	{
+		Aggregation aggregation{ "classname", false, Aggregation::Scope::All };
+		std::vector<std::thread> threads;
+		for (int thread = 0; thread < 4; ++thread)
+		{
+			threads.emplace_back([&aggregation] {
+				for (int i = 0; i < 100; ++i)
+				{
+					for (const Entity& entity : entities)
+						aggregation.add("", entity);
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+
+		const Aggregation::Counts counts = aggregation.merged();
+		REQUIRE(counts.size() == 1);
+		CHECK(counts.at("").at("monster_scientist") == 800);
+		CHECK(counts.at("").at("monster_barney") == 400);
+		CHECK(counts.at("").at("worldspawn") == 400);
+	}
+
+	TEST_CASE("entities without the key aren't counted")
+	{
+		Aggregation aggregation{ "body", false, Aggregation::Scope::All };
+		for (const Entity& entity : entities)
+			aggregation.add("", entity);
+
+		const Aggregation::Counts counts = aggregation.merged();
+		REQUIRE(counts.at("").size() == 2);
+		CHECK(counts.at("").at("1") == 1);
+		CHECK(counts.at("").at("2") == 1);
+	}
+
+	TEST_CASE("prints groups by count and distinct values by name")
+	{
+		Aggregation grouped{ "classname", false, Aggregation::Scope::All };
+		Aggregation distinct{ "classname", true, Aggregation::Scope::Mod };
+		for (const Entity& entity : entities)
+		{
+			grouped.add("", entity);
+			distinct.add(distinct.keyOf(c1a0), entity);
+		}
+
+		std::ostringstream out;
+		grouped.print(out, grouped.merged());
+		CHECK(out.str() == "  monster_scientist: 2\n  monster_barney: 1\n  worldspawn: 1\n");
+
+		out.str("");
+		distinct.print(out, distinct.merged());
+		CHECK(out.str() ==
+			"Half-Life/valve (3 distinct values of classname): [\n"
+			"  monster_barney\n"
+			"  monster_scientist\n"
+			"  worldspawn\n"
+			"]\n");
+	}
+
+	TEST_CASE("counts by scope alone")
+	{
+		Aggregation aggregation{ "", false, Aggregation::Scope::Map };
+		for (const Entity& entity : entities)
+			aggregation.add(aggregation.keyOf(c1a0), entity);
+		aggregation.add(aggregation.keyOf(c1a0hd), entities.front());
+
+		std::ostringstream out;
+		aggregation.print(out, aggregation.merged());
+		CHECK(out.str() == "Half-Life/valve/maps/c1a0.bsp: 4\nHalf-Life/valve_hd/maps/c1a0.bsp: 1\n");
+	}
+
+	TEST_CASE("counts the copies --dedup didn't scan like their original")
+	{
+		const fs::path c1a1 = "/steam/steamapps/common/Half-Life/valve/maps/c1a1.bsp";
+
+		Aggregation byMap{ "", false, Aggregation::Scope::Map, true };
+		for (const Entity& entity : entities)
+			byMap.add(byMap.keyOf(c1a0), entity);
+		byMap.add(byMap.keyOf(c1a1), entities.front());
+		byMap.addCopy(c1a0hd, c1a0);
+
+		std::ostringstream out;
+		byMap.print(out, byMap.merged());
+		CHECK(out.str() == "Half-Life/valve/maps/c1a0.bsp: 4\nHalf-Life/valve_hd/maps/c1a0.bsp: 4\nHalf-Life/valve/maps/c1a1.bsp: 1\n");
+
+		Aggregation byMod{ "classname", false, Aggregation::Scope::Mod, true };
+		for (const Entity& entity : entities)
+			byMod.add(byMod.keyOf(c1a0), entity);
+		byMod.addCopy(c1a0hd, c1a0);
+
+		const Aggregation::Counts counts = byMod.merged();
+		REQUIRE(counts.size() == 1);
+		CHECK(counts.at("Half-Life/valve").at("monster_scientist") == 4);
+		CHECK(counts.at("Half-Life/valve").at("worldspawn") == 2);
+	}
+}
+
+TEST_SUITE("top matches")
+{
+	// Offers every match to the heap the way Bsp::match does
+	static void rank(TopMatches& top, const fs::path& map, const std::vector<Entity>& ranked)
+	{
+		for (unsigned int i = 0; i < ranked.size(); ++i)
+		{
+			if (const auto value = top.valueOf(ranked[i]); value && top.wants(*value, map, i))
+				top.add(*value, map, EntityEntry{ .matched = true, .index = i });
+		}
+	}
+
+	TEST_CASE("ranks by a key or one of its elements")
+	{
+		CHECK(TopMatches{ 1, false, "health" }.valueOf(entities.front()) == std::nullopt);
+		CHECK(TopMatches{ 1, false, "body" }.valueOf(entities.front()) == 1.);
+		CHECK(TopMatches{ 1, false, "origin[2]" }.valueOf({ { "origin", "1 2 -30" } }) == -30.);
+		CHECK(TopMatches{ 1, false, "origin[-1]" }.valueOf({ { "origin", "1 2 -30" } }) == -30.);
+		CHECK(TopMatches{ 1, false, "origin[3]" }.valueOf({ { "origin", "1 2 -30" } }) == std::nullopt);
+		CHECK(TopMatches{ 1, false, "targetname" }.valueOf({ { "targetname", "door" } }) == std::nullopt);
+		CHECK_FALSE(TopMatches{ 1, false, "origin[x]" }.valid);
+		CHECK_FALSE(TopMatches{ 1, false, "[1]" }.valid);
+	}
+
+	TEST_CASE("keeps the best K of every thread")
+	{
+		std::vector<Entity> ranked;
+		std::vector<std::string> values;
+		for (int i = 0; i < 1000; ++i)
+			values.push_back(std::to_string((i * 7919) % 1000));
+		for (const std::string& value : values)
+			ranked.push_back({ { "health", value } });
+
+		for (const bool bottom : { false, true })
+		{
+			TopMatches top{ 10, bottom, "health" };
+			std::vector<std::thread> threads;
+			for (int thread = 0; thread < 4; ++thread)
+			{
+				threads.emplace_back([&top, &ranked, thread] {
+					rank(top, "map" + std::to_string(thread), ranked);
+				});
+			}
+			for (std::thread& thread : threads)
+				thread.join();
+
+			const std::vector<TopMatches::Match> matches = top.merged();
+			CHECK(top.rankedCount() == 4000);
+			REQUIRE(matches.size() == 10);
+
+			// Each value is in every map, ties go to the first map
+			for (std::size_t i = 0; i < matches.size(); ++i)
+			{
+				CHECK(matches[i].value == (bottom ? static_cast<double>(i / 4) : 999. - static_cast<double>(i / 4)));
+				CHECK(matches[i].map == "map" + std::to_string(i % 4));
+			}
+		}
+	}
+
+	TEST_CASE("keeps fewer than K when there aren't as many")
+	{
+		TopMatches top{ 10, false, "body" };
+		rank(top, c1a0, entities);
+
+		const std::vector<TopMatches::Match> matches = top.merged();
+		REQUIRE(matches.size() == 2);
+		CHECK(matches[0].entry.index == 2);
+		CHECK(matches[1].entry.index == 0);
+	}
+}
@@ -0,0 +1,65 @@
+#include <set>
+#include <random>
+#include <iterator>
+#include <algorithm>
+#include "doctest.h"
+#include "bitmap.h"
+
+
+// Sparse refs over a few containers, and one container dense enough to be a bitmap
+static std::vector<std::uint64_t> randomRefs(const unsigned int seed, const std::size_t dense)
+{
+	std::mt19937_64 random{ seed };
+	std::set<std::uint64_t> refs;
+	for (int i = 0; i < 3000; ++i)
+		refs.insert((random() % 4) << 32 | random() % 70000);
+	for (std::size_t i = 0; i < dense; ++i)
+		refs.insert(std::uint64_t{ 7 } << 32 | random() % 65536);
+	return { refs.begin(), refs.end() };
+}
+
+
+
+TEST_SUITE("entity bitmap")
+{
+	TEST_CASE("keeps sorted refs as they were")
+	{
+		const std::vector<std::uint64_t> refs = randomRefs(1, 9000);
+		const EntityBitmap bitmap = EntityBitmap::fromSorted(refs);
+
+		CHECK(bitmap.count() == refs.size());
+		CHECK(bitmap.toVector() == refs);
+		CHECK(std::ranges::any_of(bitmap.containers(), [](const auto& container) { return !container.bits.empty(); }));
+
+		const std::vector<std::uint64_t> twice{ 1, 1, 2, 5, 5 };
+		CHECK(EntityBitmap::fromSorted(twice).toVector() == std::vector<std::uint64_t>{ 1, 2, 5 });
+		CHECK(EntityBitmap{}.empty());
+	}
+
+	TEST_CASE("and, or and and not match the set operations")
+	{
+		for (const auto& [denseA, denseB] : { std::pair{ 0, 0 }, { 9000, 0 }, { 0, 9000 }, { 9000, 20000 } })
+		{
+			const std::vector<std::uint64_t> a = randomRefs(2, denseA), b = randomRefs(3, denseB);
+			std::vector<std::uint64_t> both, either, difference;
+			std::ranges::set_intersection(a, b, std::back_inserter(both));
+			std::ranges::set_union(a, b, std::back_inserter(either));
+			std::ranges::set_difference(a, b, std::back_inserter(difference));
+
+			EntityBitmap result = EntityBitmap::fromSorted(a);
+			result &= EntityBitmap::fromSorted(b);
+			CHECK(result.toVector() == both);
+
+			result = EntityBitmap::fromSorted(a);
+			result |= EntityBitmap::fromSorted(b);
+			CHECK(result.toVector() == either);
+
+			result = EntityBitmap::fromSorted(a);
+			result -= EntityBitmap::fromSorted(b);
+			CHECK(result.toVector() == difference);
+
+			result -= EntityBitmap::fromSorted(a);
+			CHECK(result.empty());
+		}
+	}
+}
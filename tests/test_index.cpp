@@ -0,0 +1,217 @@
+#include <deque>
+#include <memory>
+#include <random>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include "doctest.h"
+#include "mapindex.h"
+
+
+namespace fs = std::filesystem;
+
+static const std::vector<std::vector<Entity>> maps{
+	{
+		{ { "classname", "worldspawn" }, { "wad", "\\half-life\\valve\\halflife.wad" } },
+		{ { "classname", "monster_gman" }, { "origin", "32 -64 128" }, { "health", "500" } },
+		{ { "classname", "info_target" }, { "origin", "-2048 16 -2500" } },
+	},
+	{
+		{ { "classname", "monster_scientist" }, { "origin", "0 0" }, { "health", "20#2" } },
+		{ { "classname", "env_sprite" }, { "origin", "" }, { "scale", "0.25" }, { "renderamt", "nan" } },
+		{ { "classname", "func_door" }, { "origin", "1  3 9 27" }, { "health", "abc" } },
+	},
+};
+
+// Monsters with random flags, the keyvalues are views so their text is kept in the deque
+static std::vector<std::vector<Entity>> flagMaps()
+{
+	static std::deque<std::string> text;
+	std::mt19937 random{ 42 };
+	const char* classnames[] = { "monster_scientist", "monster_barney", "func_door" };
+
+	std::vector<std::vector<Entity>> generated(3);
+	for (auto& map : generated)
+	{
+		for (int i = 0; i < 300; ++i)
+		{
+			Entity& entity = map.emplace_back(Entity{ { "classname", classnames[random() % 3] } });
+			if (random() % 5)
+				entity.insert_or_assign("spawnflags", text.emplace_back(std::to_string(random() % 1024)));
+			else if (random() % 2)
+				entity.insert_or_assign("spawnflags_extra", "1");
+		}
+	}
+	generated[0][0].insert_or_assign("spawnflags", "-1");
+	return generated;
+}
+
+// What a full scan finds for the query chain, in the order of the index
+static std::vector<MapIndex::EntityRef> scanned(const Query& first, const std::vector<std::vector<Entity>>& maps = ::maps)
+{
+	std::vector<MapIndex::EntityRef> found;
+	for (std::uint32_t map = 0; map < maps.size(); ++map)
+	{
+		for (std::uint32_t entity = 0; entity < maps[map].size(); ++entity)
+		{
+			if (first.testChain(maps[map][entity]).matched)
+				found.push_back(static_cast<MapIndex::EntityRef>(map) << 32 | entity);
+		}
+	}
+	return found;
+}
+
+// Postings are sorted as the index is written, queries go to the index read back
+static std::unique_ptr<MapIndex> indexed(const std::vector<fs::path>& paths, const std::vector<std::vector<Entity>>& maps = ::maps)
+{
+	MapIndex index;
+	for (std::size_t map = 0; map < paths.size(); ++map)
+		index.add(paths[map], maps[map]);
+
+	const fs::path file = fs::temp_directory_path() / "mer_test_index.idx";
+	index.write(file);
+	auto loaded = std::make_unique<MapIndex>(file);
+	fs::remove(file);
+	return loaded;
+}
+
+static std::vector<std::unique_ptr<Query>> chain(const std::vector<std::string>& terms, const Query::QueryType type = Query::QueryOr)
+{
+	std::vector<std::unique_ptr<Query>> queries;
+	for (const auto& term : terms)
+	{
+		queries.push_back(std::make_unique<Query>(term));
+		if (queries.size() > 1)
+		{
+			queries[queries.size() - 2]->type = type;
+			queries[queries.size() - 2]->next = queries.back().get();
+		}
+	}
+	return queries;
+}
+
+
+
+TEST_SUITE("numeric index")
+{
+	TEST_CASE("range queries find what a full scan finds")
+	{
+		const auto index = indexed({ "/maps/a.bsp", "/maps/b.bsp" });
+
+		for (const std::string term : {
+			"health>=500", "health>20", "health<=20", "health<1", "health>abc", "health>",
+			"origin[2]<-2000", "origin[2]>-5", "origin[1]<=0", "origin[5]>=0", "origin[5]<0", "origin[1]>=0",
+			"origin[-1]>100", "origin[-1]<=0", "origin[-4]>0", "origin[-2]<100", "origin[12]>=0", "origin[2]<",
+			">100", "<0", ">=0.25", "scale<1", "renderamt>0", "renderamt<0" })
+		{
+			CAPTURE(term);
+			const Query query{ term };
+			REQUIRE(query.valid);
+
+			const auto candidates = index->candidates(query);
+			REQUIRE(candidates.has_value());
+			CHECK(candidates->toVector() == scanned(query));
+		}
+	}
+
+	TEST_CASE("empty elements are indexed as 0")
+	{
+		const std::vector<std::vector<Entity>> spaced{
+			{
+				{ { "classname", "info_target" }, { "origin", "0  16" } },
+				{ { "classname", "info_target" }, { "origin", " 8 -16" } },
+			},
+		};
+		const auto index = indexed({ "/maps/spaced.bsp" }, spaced);
+
+		for (const std::string term : { "origin[1]>-5", "origin[1]<1", "origin[0]>=0", "origin[0]<0", "origin[-2]<=0", "origin[2]>0" })
+		{
+			CAPTURE(term);
+			const Query query{ term };
+			const auto candidates = index->candidates(query);
+			REQUIRE(candidates.has_value());
+			CHECK(candidates->toVector() == scanned(query, spaced));
+		}
+		CHECK(index->candidates(Query{ "origin[1]>-5" })->count() == 2);
+	}
+
+	TEST_CASE("chains narrow down with AND and widen with OR")
+	{
+		const auto index = indexed({ "/maps/a.bsp", "/maps/b.bsp" });
+
+		const auto both = chain({ "origin[0]>-100", "origin[2]>0" }, Query::QueryAnd);
+		REQUIRE(index->candidates(*both.front()).has_value());
+		CHECK(index->candidates(*both.front())->toVector() == scanned(*both.front()));
+
+		const auto either = chain({ "health>=500", "origin[2]<-2000" });
+		REQUIRE(index->candidates(*either.front()).has_value());
+		CHECK(index->candidates(*either.front())->toVector() == scanned(*either.front()));
+
+		// Other operators need a scan, but still only of what the indexed terms leave
+		const auto mixed = chain({ "classname=monster", "health>100" }, Query::QueryAnd);
+		REQUIRE(index->candidates(*mixed.front()).has_value());
+		CHECK(index->candidates(*mixed.front())->count() == 1);
+
+		CHECK_FALSE(index->candidates(Query{ "classname=monster" }).has_value());
+		CHECK_FALSE(index->candidates(*chain({ "health>1", "classname=monster" }).front()).has_value());
+	}
+
+	TEST_CASE("spawnflags queries are bitmap operations that find what a full scan finds")
+	{
+		const auto maps = flagMaps();
+		const auto index = indexed({ "/maps/a.bsp", "/maps/b.bsp", "/maps/c.bsp" }, maps);
+
+		for (const std::string term : {
+			"spawnflags=256", "spawnflags=257", "spawnflags==257", "spawnflags==0", "spawnflags!=1", "spawnflags!=768",
+			"spawnflags=", "spawnflags>512", "spawnflags>=512", "spawnflags<3", "spawnflags<=3", "spawnflags>1023", "spawnflags=0" })
+		{
+			CAPTURE(term);
+			const Query query{ term };
+			const auto candidates = index->candidates(query);
+			REQUIRE(candidates.has_value());
+
+			// Entities with just a key like spawnflags_extra can match = on its value, the index keeps them all
+			const auto found = scanned(query, maps);
+			CHECK(std::ranges::includes(candidates->toVector(), found));
+			if (query.op != Query::QueryEquals || query.value.empty())
+				CHECK(candidates->toVector() == found);
+		}
+
+		// Every monster_scientist with flag 256 and without flag 1
+		const auto scientists = chain({ "classname==monster_scientist", "spawnflags==256", "spawnflags!=1" }, Query::QueryAnd);
+		const auto candidates = index->candidates(*scientists.front());
+		REQUIRE(candidates.has_value());
+		CHECK_FALSE(candidates->empty());
+		CHECK(candidates->toVector() == scanned(*scientists.front(), maps));
+
+		const auto either = chain({ "classname==func_door", "spawnflags>=1000" });
+		REQUIRE(index->candidates(*either.front()).has_value());
+		CHECK(index->candidates(*either.front())->toVector() == scanned(*either.front(), maps));
+
+		CHECK(index->candidates(Query{ "classname==monster_gman" })->empty());
+	}
+
+	TEST_CASE("only maps indexed as they are on disk are ruled out")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_index";
+		fs::create_directories(dir);
+		for (const char* name : { "a.bsp", "b.bsp" })
+			std::ofstream{ dir / name } << name;
+
+		const auto index = indexed({ dir / "a.bsp", dir / "b.bsp" });
+		CHECK(index->selectMaps(Query{ "health>=500" }) == 1);
+		CHECK_FALSE(index->rulesOut(dir / "a.bsp"));
+		CHECK(index->rulesOut(dir / "b.bsp"));
+		CHECK_FALSE(index->rulesOut(dir / "c.bsp"));
+
+		std::ofstream{ dir / "b.bsp", std::ios::app } << "changed";
+		CHECK_FALSE(index->rulesOut(dir / "b.bsp"));
+
+		CHECK(index->selectMaps(Query{ "classname=monster" }) == 2);
+
+		std::ofstream{ dir / "bad.idx" } << "MERINDEX";
+		CHECK_THROWS_AS(MapIndex{ dir / "bad.idx" }, std::runtime_error);
+		CHECK_THROWS_AS(MapIndex{ dir / "a.bsp" }, std::runtime_error);
+		fs::remove_all(dir);
+	}
+}
@@ -0,0 +1,470 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <filesystem>
+#include "doctest.h"
+#include "io.h"
+#include "devices.h"
+#include "pipeline.h"
+
+
+namespace fs = std::filesystem;
+using namespace BSPFormat;
+
+static void writeMap(const fs::path& path, const std::int32_t version, const std::string& lump, const std::int32_t lumpOffset = sizeof(BspHeader))
+{
+	BspHeader header{};
+	header.version = version;
+	header.lumps[Entities] = { lumpOffset, static_cast<std::int32_t>(lump.size()) };
+
+	std::ofstream file{ path, std::ios::binary };
+	file.write(reinterpret_cast<const char*>(&header), sizeof(BspHeader));
+	file << lump;
+}
+
+static std::vector<MapBuffer> readAll(const std::vector<fs::path>& paths, const unsigned queueDepth, const IoEngine::Backend backend)
+{
+	std::vector<MapBuffer> maps(paths.size());
+	IoEngine engine{ paths, queueDepth, backend };
+
+	MapBuffer map;
+	while (engine.next(map))
+	{
+		maps[map.index].index = map.index;
+		maps[map.index].header = map.header;
+		maps[map.index].lump = map.lump;
+		maps[map.index].error = map.error;
+	}
+	return maps;
+}
+
+
+
+TEST_SUITE("io engine")
+{
+	TEST_CASE("reads headers and entity lumps")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_io";
+		fs::create_directories(dir);
+
+		std::vector<fs::path> paths;
+		std::vector<std::string> lumps;
+		for (int i = 0; i < 40; ++i)
+		{
+			paths.push_back(dir / ("map" + std::to_string(i) + ".bsp"));
+			lumps.push_back("{\n\"classname\" \"worldspawn\"\n\"message\" \"" + std::string(i * 97, 'x') + "\"\n}\n");
+			writeMap(paths.back(), 30, lumps.back());
+		}
+		paths.push_back(dir / "version.bsp");
+		writeMap(paths.back(), 31, "{\n}\n");
+		paths.push_back(dir / "lump.bsp");
+		writeMap(paths.back(), 30, "{\n}\n", -1);
+		paths.push_back(dir / "missing.bsp");
+
+		for (const auto backend : { IoEngine::Backend::Auto, IoEngine::Backend::ThreadPool })
+		{
+			for (const unsigned depth : { 1u, 4u, 64u })
+			{
+				const std::vector<MapBuffer> maps = readAll(paths, depth, backend);
+
+				for (int i = 0; i < 40; ++i)
+				{
+					CHECK(maps[i].error.empty());
+					CHECK(maps[i].header.version == 30);
+					CHECK(std::string(maps[i].lump.begin(), maps[i].lump.end()) == lumps[i]);
+				}
+
+				CHECK(maps[40].error.empty());
+				CHECK(maps[40].header.version == 31);
+				CHECK(maps[41].error == "Invalid lump offset or length");
+				CHECK(maps[42].error == "Could not open file for reading");
+			}
+		}
+
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("matches the entities before malformed entity data")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_truncated";
+		fs::create_directories(dir);
+		const fs::path path = dir / "truncated.bsp";
+		writeMap(path, 30, "{\n\"classname\" \"worldspawn\"\n}\n{\n\"classname\" \"monster_gman\"\n}\n{\n\"classname\" \"monster_barney\"\n\"targetname\" barn");
+
+		Query query{ "classname=monster_" };
+		g_options.firstQuery = &query;
+		{
+			MapArena arena;
+			const MapBuffer map = IoEngine::readMap(path);
+			const Bsp bsp{ path, map, arena };
+			CHECK_FALSE(bsp.error().empty());
+			CHECK(bsp.entityCount() == 2);
+
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 1);
+			CHECK(entries[0].classname == "monster_gman");
+		}
+
+		// The scan reports them along with the error
+		const std::vector<const fs::path*> maps{ &path };
+		std::vector<MapResult> results;
+		ScanPipeline pipeline{ { 1, 1, 1, 2, false } };
+		pipeline.run(maps, [&results](MapResult& result) {
+			results.push_back(std::move(result));
+			return true;
+		});
+		REQUIRE(results.size() == 1);
+		CHECK_FALSE(results[0].error.empty());
+		REQUIRE(results[0].entries.size() == 1);
+		CHECK(results[0].entries[0].index == 1);
+
+		g_options.firstQuery = nullptr;
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("copies of a map that can't be read share its error")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_dedup";
+		fs::create_directories(dir);
+		const std::vector<fs::path> paths{ dir / "a.bsp", dir / "b.bsp", dir / "c.bsp", dir / "d.bsp" };
+		writeMap(paths[0], 31, "{\n}\n");
+		writeMap(paths[1], 31, "{\n}\n");
+		writeMap(paths[2], 30, "{\n}\n");
+		writeMap(paths[3], 30, "{\n}\n");
+
+		std::vector<const fs::path*> maps;
+		for (const fs::path& path : paths)
+			maps.push_back(&path);
+
+		std::vector<MapResult> results;
+		ScanPipeline pipeline{ { 1, 2, 2, 4, true } };
+		pipeline.run(maps, [&results](MapResult& result) {
+			results.push_back(std::move(result));
+			return true;
+		});
+		REQUIRE(results.size() == 4);
+		CHECK_FALSE(results[0].error.empty());
+		CHECK_FALSE(results[1].error.empty());
+		CHECK(results[0].duplicateOf == nullptr);
+		CHECK(results[1].duplicateOf == nullptr);
+		CHECK(results[2].error.empty());
+		CHECK(results[3].error.empty());
+		CHECK((results[2].duplicateOf != nullptr) != (results[3].duplicateOf != nullptr));
+
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("maps with the same entities are only copies when their models match too")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_dedup_models";
+		fs::create_directories(dir);
+		const std::vector<fs::path> paths{ dir / "tall.bsp", dir / "flat.bsp" };
+
+		const std::string lump = "{\n\"classname\" \"worldspawn\"\n}\n{\n\"classname\" \"func_door\"\n\"model\" \"*1\"\n}\n";
+		for (const float top : { 128.f, -8.f })
+		{
+			std::vector<BspModel> models(2);
+			models[1] = { .mins = { -64.f, -64.f, -16.f }, .maxs = { 64.f, 64.f, top } };
+
+			BspHeader header{};
+			header.version = 30;
+			header.lumps[Entities] = { sizeof(BspHeader), static_cast<std::int32_t>(lump.size()) };
+			header.lumps[Models] = { static_cast<std::int32_t>(sizeof(BspHeader) + lump.size()), static_cast<std::int32_t>(models.size() * sizeof(BspModel)) };
+
+			std::ofstream file{ top > 0.f ? paths[0] : paths[1], std::ios::binary };
+			file.write(reinterpret_cast<const char*>(&header), sizeof(BspHeader));
+			file << lump;
+			file.write(reinterpret_cast<const char*>(models.data()), static_cast<std::streamsize>(models.size() * sizeof(BspModel)));
+		}
+
+		std::vector<const fs::path*> maps;
+		for (const fs::path& path : paths)
+			maps.push_back(&path);
+
+		Query query{ "center[2]>0" };
+		g_options.firstQuery = &query;
+		std::vector<MapResult> results;
+		ScanPipeline pipeline{ { 1, 1, 1, 2, true } };
+		pipeline.run(maps, [&results](MapResult& result) {
+			results.push_back(std::move(result));
+			return true;
+		});
+		REQUIRE(results.size() == 2);
+		CHECK(results[0].duplicateOf == nullptr);
+		CHECK(results[1].duplicateOf == nullptr);
+		CHECK(results[0].entries.size() == 1);
+		CHECK(results[1].entries.empty());
+
+		g_options.firstQuery = nullptr;
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("copies carry the matches of their original whichever is reported first")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_dedup_matches";
+		fs::create_directories(dir);
+		std::vector<fs::path> paths;
+		for (int i = 0; i < 64; ++i)
+		{
+			paths.push_back(dir / ("map" + std::to_string(i) + ".bsp"));
+			writeMap(paths.back(), 30, "{\n\"classname\" \"worldspawn\"\n}\n{\n\"classname\" \"monster_gman\"\n}\n");
+		}
+
+		std::vector<const fs::path*> maps;
+		for (const fs::path& path : paths)
+			maps.push_back(&path);
+
+		Query query{ "classname==monster_gman" };
+		g_options.firstQuery = &query;
+		for (int run = 0; run < 4; ++run)
+		{
+			std::vector<MapResult> results;
+			ScanPipeline pipeline{ { 2, 4, 4, 8, true } };
+			pipeline.run(maps, [&results](MapResult& result) {
+				results.push_back(std::move(result));
+				return true;
+			});
+
+			REQUIRE(results.size() == paths.size());
+			std::size_t originals = 0;
+			for (std::size_t i = 0; i < results.size(); ++i)
+			{
+				CHECK(results[i].index == i);
+				if (results[i].duplicateOf)
+					CHECK(results[i].duplicateMatches == 1);
+				else
+				{
+					CHECK(results[i].entries.size() == 1);
+					++originals;
+				}
+			}
+			CHECK(originals == 1);
+		}
+
+		g_options.firstQuery = nullptr;
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("reads brush entity bounds only when queried")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_bounds";
+		fs::create_directories(dir);
+		const fs::path path = dir / "bounds.bsp";
+
+		const std::string lump = "{\n\"classname\" \"worldspawn\"\n}\n"
+			"{\n\"classname\" \"func_door\"\n\"model\" \"*1\"\n}\n"
+			"{\n\"classname\" \"func_rotating\"\n\"model\" \"*2\"\n\"origin\" \"100 0 0\"\n}\n"
+			"{\n\"classname\" \"func_wall\"\n\"model\" \"*9\"\n}\n";
+		std::vector<BspModel> models(3);
+		models[1] = { .mins = { -64.f, 0.f, 0.f }, .maxs = { 64.f, 32.f, 128.f } };
+		models[2] = { .mins = { -8.f, -8.f, -8.f }, .maxs = { 8.f, 8.f, 8.f } };
+		{
+			BspHeader header{};
+			header.version = 30;
+			header.lumps[Entities] = { sizeof(BspHeader), static_cast<std::int32_t>(lump.size()) };
+			header.lumps[Models] = { static_cast<std::int32_t>(sizeof(BspHeader) + lump.size()), static_cast<std::int32_t>(models.size() * sizeof(BspModel)) };
+
+			std::ofstream file{ path, std::ios::binary };
+			file.write(reinterpret_cast<const char*>(&header), sizeof(BspHeader));
+			file << lump;
+			file.write(reinterpret_cast<const char*>(models.data()), static_cast<std::streamsize>(models.size() * sizeof(BspModel)));
+		}
+
+		MapArena arena;
+		Query plain{ "classname=func_" };
+		g_options.firstQuery = &plain;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			CHECK_FALSE(bsp.entities()[1].contains("center"));
+		}
+
+		Query bounds{ "center[2]>0" };
+		g_options.firstQuery = &bounds;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			const auto& entities = bsp.entities();
+			CHECK_FALSE(entities[0].contains("mins"));
+			CHECK(entities[1].at("mins") == "-64 0 0");
+			CHECK(entities[1].at("maxs") == "64 32 128");
+			CHECK(entities[1].at("center") == "0 16 64");
+			CHECK(entities[2].at("center") == "100 0 0");
+			CHECK_FALSE(entities[3].contains("center"));
+
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 1);
+			CHECK(entries[0].index == 1);
+		}
+
+		Query near{ "near=0,0,0,70" };
+		g_options.firstQuery = &near;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 1);
+			CHECK(entries[0].queryMatches == "center=0 16 64");
+		}
+
+		// The readers fetch the models along with the entity lump, whichever backend they use
+		for (const auto backend : { IoEngine::Backend::Auto, IoEngine::Backend::ThreadPool })
+		{
+			IoEngine engine{ { path }, 1, backend, false, { .models = true } };
+			MapBuffer map;
+			REQUIRE(engine.next(map));
+			REQUIRE(map.models.size() == 3);
+			CHECK(map.models[1].maxs[2] == 128.f);
+			CHECK(map.textures.empty());
+		}
+
+		g_options.firstQuery = nullptr;
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("reads texture names only when queried")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_textures";
+		fs::create_directories(dir);
+		const fs::path path = dir / "textures.bsp";
+
+		// Two textures from WADs, one embedded with its pixels after the header, and an offset past the lump
+		std::vector<BspMipTexture> textures(3);
+		std::ranges::copy(std::string_view{ "C1A0_W1" }, textures[0].name);
+		std::ranges::copy(std::string_view{ "OUT_GRASS1" }, textures[1].name);
+		std::ranges::copy(std::string_view{ "{GRASSFENCE" }, textures[2].name);
+		textures[2] = { .width = 16, .height = 16, .offsets = { sizeof(BspMipTexture), 0, 0, 0 } };
+		std::ranges::copy(std::string_view{ "{GRASSFENCE" }, textures[2].name);
+
+		const std::int32_t count = 4;
+		const std::int32_t headerSize = sizeof(count) + count * sizeof(std::int32_t);
+		const std::int32_t offsets[count] = {
+			headerSize,
+			headerSize + static_cast<std::int32_t>(sizeof(BspMipTexture)),
+			headerSize + 2 * static_cast<std::int32_t>(sizeof(BspMipTexture)),
+			1 << 20
+		};
+		const std::string pixels(16 * 16, 'x');
+		// Texture terms don't look at entity keys that merely start with tex
+		const std::string lump = "{\n\"classname\" \"worldspawn\"\n\"wad\" \"grass.wad\"\n}\n"
+			"{\n\"classname\" \"env_sprite\"\n\"texture\" \"c1a0_w1 grass\"\n}\n";
+		{
+			BspHeader header{};
+			header.version = 30;
+			header.lumps[Entities] = { sizeof(BspHeader), static_cast<std::int32_t>(lump.size()) };
+			header.lumps[Textures] = { static_cast<std::int32_t>(sizeof(BspHeader) + lump.size()),
+				headerSize + static_cast<std::int32_t>(textures.size() * sizeof(BspMipTexture) + pixels.size()) };
+
+			std::ofstream file{ path, std::ios::binary };
+			file.write(reinterpret_cast<const char*>(&header), sizeof(BspHeader));
+			file << lump;
+			file.write(reinterpret_cast<const char*>(&count), sizeof(count));
+			file.write(reinterpret_cast<const char*>(offsets), sizeof(offsets));
+			file.write(reinterpret_cast<const char*>(textures.data()), static_cast<std::streamsize>(textures.size() * sizeof(BspMipTexture)));
+			file << pixels;
+		}
+
+		MapArena arena;
+		Query plain{ "classname=worldspawn" };
+		g_options.firstQuery = &plain;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			CHECK(bsp.textures().empty());
+			CHECK(bsp.entities().size() == 2);
+			CHECK(bsp.match().size() == 1);
+		}
+
+		Query grass{ "tex=*grass*" };
+		g_options.firstQuery = &grass;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			REQUIRE(bsp.textures().size() == 3);
+			CHECK(bsp.textures()[0].name == "C1A0_W1");
+			CHECK_FALSE(bsp.textures()[0].embedded);
+			CHECK(bsp.textures()[2].embedded);
+
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 2);
+			CHECK(entries[0].index == 1);
+			CHECK(entries[0].classname == "OUT_GRASS1");
+			CHECK(entries[0].queryMatches == "tex=out_grass1, external");
+			CHECK(entries[1].queryMatches == "tex={grassfence, embedded");
+		}
+
+		Query exact{ "tex==c1a0_w1" };
+		g_options.firstQuery = &exact;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 1);
+			CHECK(entries[0].index == 0);
+		}
+
+		// Terms without the tex key are only tested against the entities, value-only ones included
+		Query texture{ "tex=*grass*" };
+		Query anyValue{ "=*grass*" };
+		Query notValue{ "!=x" };
+		texture.next = &anyValue;
+		anyValue.type = Query::QueryAnd;
+		anyValue.next = &notValue;
+		g_options.firstQuery = &texture;
+		{
+			const MapBuffer map = IoEngine::readMap(path, scanExtras());
+			const Bsp bsp{ path, map, arena };
+			const std::vector<EntityEntry> entries = bsp.match();
+			REQUIRE(entries.size() == 4);
+			CHECK(entries[0].classname == "worldspawn");
+			CHECK(entries[1].classname == "env_sprite");
+			CHECK(entries[2].classname == "OUT_GRASS1");
+			CHECK(entries[3].classname == "{GRASSFENCE");
+		}
+
+		for (const auto backend : { IoEngine::Backend::Auto, IoEngine::Backend::ThreadPool })
+		{
+			IoEngine engine{ { path }, 1, backend, false, { .textures = true } };
+			MapBuffer map;
+			REQUIRE(engine.next(map));
+			REQUIRE(map.textures.size() == 4);
+			CHECK(std::string_view{ map.textures[1].name } == "OUT_GRASS1");
+			CHECK(map.textures[2].offsets[0] == sizeof(BspMipTexture));
+			CHECK(map.textures[3].name[0] == '\0');
+			CHECK(map.models.empty());
+		}
+
+		g_options.firstQuery = nullptr;
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("groups maps by device")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_devices";
+		fs::create_directories(dir);
+
+		std::vector<fs::path> paths;
+		for (int i = 0; i < 10; ++i)
+		{
+			paths.push_back(dir / ("map" + std::to_string(i) + ".bsp"));
+			writeMap(paths.back(), 30, "{\n}\n");
+		}
+		paths.push_back(dir / "missing.bsp");
+
+		// The missing map is on the device of its directory like the others
+		const std::vector<DeviceLane> lanes = Devices::groupByDevice(paths, 16);
+		REQUIRE(lanes.size() == 1);
+
+		std::vector<int> seen(paths.size());
+		for (const DeviceLane& lane : lanes)
+		{
+			CHECK(lane.queueDepth == (lane.rotational ? Devices::c_rotationalQueueDepth : 16u));
+			for (const std::size_t index : lane.maps)
+				++seen[index];
+		}
+		for (const int count : seen)
+			CHECK(count == 1);
+
+		fs::remove_all(dir);
+	}
+}
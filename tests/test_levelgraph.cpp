@@ -0,0 +1,128 @@
+#include <sstream>
+#include "doctest.h"
+#include "levelgraph.h"
+
+
+namespace fs = std::filesystem;
+
+static const fs::path c1a0 = "/steam/steamapps/common/Half-Life/valve/maps/c1a0.bsp";
+static const fs::path c1a0hd = "/steam/steamapps/common/Half-Life/valve_hd/maps/C1A0.bsp";
+static const fs::path c1a1 = "/steam/steamapps/common/Half-Life/valve/maps/c1a1.bsp";
+
+static const std::vector<Entity> c1a0Entities{
+	{ { "classname", "worldspawn" } },
+	{ { "classname", "trigger_changelevel" }, { "map", "C1A1" }, { "landmark", "c1a0c1a1" } },
+	{ { "classname", "info_landmark" }, { "targetname", "c1a1c1a0" } }
+};
+static const std::vector<Entity> c1a0hdEntities{
+	{ { "classname", "trigger_changelevel" }, { "map", "c1a1" }, { "landmark", "c1a0c1a1" } },
+	{ { "classname", "trigger_changelevel" }, { "map", "c1a9" }, { "landmark", "c1a0c1a9" } }
+};
+static const std::vector<Entity> c1a1Entities{
+	{ { "classname", "info_landmark" }, { "targetname", "c1a0c1a1" } },
+	{ { "classname", "trigger_changelevel" }, { "map", "c1a0" }, { "landmark", "c1a1c1a0" } },
+	{ { "classname", "trigger_changelevel" }, { "map", "c1a0" }, { "landmark", "wrongmark" } },
+	{ { "classname", "trigger_changelevel" }, { "map", "c1a0" } }
+};
+
+
+
+TEST_SUITE("level graph")
+{
+	TEST_CASE("copies of a map in SteamPipe folders are one level")
+	{
+		CHECK(LevelGraph::levelName(c1a0) == "Half-Life/valve/c1a0");
+		CHECK(LevelGraph::levelName(c1a0hd) == "Half-Life/valve/c1a0");
+	}
+
+	TEST_CASE("joins transitions with the landmarks of their destination")
+	{
+		LevelGraph graph;
+		graph.add(c1a1, c1a1Entities);
+		graph.add(c1a0hd, c1a0hdEntities);
+		graph.add(c1a0, c1a0Entities);
+		CHECK(graph.levelCount() == 2);
+
+		const std::vector<LevelGraph::Link> links = graph.links();
+		REQUIRE(links.size() == 5);
+
+		CHECK(links[0].from == "Half-Life/valve/c1a0");
+		CHECK(links[0].to == "Half-Life/valve/c1a1");
+		CHECK(links[0].landmark == "c1a0c1a1");
+		CHECK(links[0].status == LevelGraph::Link::Ok);
+		CHECK(links[1].to == "Half-Life/valve/c1a9");
+		CHECK(links[1].status == LevelGraph::Link::MissingMap);
+
+		CHECK(links[2].from == "Half-Life/valve/c1a1");
+		CHECK(links[2].landmark.empty());
+		CHECK(links[2].status == LevelGraph::Link::Ok);
+		CHECK(links[3].landmark == "c1a1c1a0");
+		CHECK(links[3].status == LevelGraph::Link::Ok);
+		CHECK(links[4].landmark == "wrongmark");
+		CHECK(links[4].status == LevelGraph::Link::MissingLandmark);
+	}
+
+	TEST_CASE("links to maps that couldn't be read aren't missing")
+	{
+		LevelGraph graph;
+		graph.add(c1a0hd, c1a0hdEntities);
+		graph.addUnreadable(c1a1);
+		CHECK(graph.levelCount() == 1);
+
+		const std::vector<LevelGraph::Link> links = graph.links();
+		REQUIRE(links.size() == 2);
+		CHECK(links[0].to == "Half-Life/valve/c1a1");
+		CHECK(links[0].status == LevelGraph::Link::UnreadableMap);
+		CHECK(links[1].to == "Half-Life/valve/c1a9");
+		CHECK(links[1].status == LevelGraph::Link::MissingMap);
+	}
+
+	TEST_CASE("copies that weren't parsed take the transitions of their original")
+	{
+		const fs::path gearboxC1a1 = "/steam/steamapps/common/Half-Life/gearbox/maps/c1a1.bsp";
+		const fs::path gearboxC1a0 = "/steam/steamapps/common/Half-Life/gearbox/maps/c1a0.bsp";
+
+		LevelGraph graph;
+		graph.add(c1a1, c1a1Entities);
+		graph.add(c1a0, c1a0Entities);
+		graph.addCopy(gearboxC1a1, c1a1);
+		graph.addCopy(gearboxC1a0, c1a0);
+		graph.addCopy(c1a0hd, c1a0);
+		CHECK(graph.levelCount() == 4);
+
+		const std::vector<LevelGraph::Link> links = graph.links();
+		REQUIRE(links.size() == 8);
+		CHECK(links[0].from == "Half-Life/gearbox/c1a0");
+		CHECK(links[0].to == "Half-Life/gearbox/c1a1");
+		CHECK(links[0].status == LevelGraph::Link::Ok);
+		CHECK(links[2].from == "Half-Life/gearbox/c1a1");
+		CHECK(links[2].to == "Half-Life/gearbox/c1a0");
+		CHECK(links[2].landmark == "c1a1c1a0");
+		CHECK(links[2].status == LevelGraph::Link::Ok);
+	}
+
+	TEST_CASE("writes DOT and JSON")
+	{
+		LevelGraph graph;
+		graph.add(c1a0, c1a0Entities);
+		graph.add(c1a0hd, c1a0hdEntities);
+
+		std::ostringstream dot;
+		graph.write(dot, LevelGraph::Format::Dot);
+		CHECK(dot.str() ==
+			"digraph levels {\n"
+			"  \"Half-Life/valve/c1a0\";\n"
+			"  \"Half-Life/valve/c1a1\" [style=dashed, color=red];\n"
+			"  \"Half-Life/valve/c1a9\" [style=dashed, color=red];\n"
+			"  \"Half-Life/valve/c1a0\" -> \"Half-Life/valve/c1a1\" [label=\"c1a0c1a1\", color=red, tooltip=\"missing map\"];\n"
+			"  \"Half-Life/valve/c1a0\" -> \"Half-Life/valve/c1a9\" [label=\"c1a0c1a9\", color=red, tooltip=\"missing map\"];\n"
+			"}\n");
+
+		std::ostringstream json;
+		graph.write(json, LevelGraph::Format::Json);
+		CHECK(json.str() ==
+			R"({"maps":["Half-Life/valve/c1a0"],"links":[)"
+			R"({"from":"Half-Life/valve/c1a0","to":"Half-Life/valve/c1a1","landmark":"c1a0c1a1","status":"missing map"},)"
+			R"({"from":"Half-Life/valve/c1a0","to":"Half-Life/valve/c1a9","landmark":"c1a0c1a9","status":"missing map"}]})" "\n");
+	}
+}
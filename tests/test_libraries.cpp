@@ -0,0 +1,148 @@
+#include <set>
+#include <fstream>
+#include <filesystem>
+#include "doctest.h"
+#include "libraries.h"
+#include "mer.h"
+
+
+namespace fs = std::filesystem;
+
+
+
+TEST_SUITE("steam libraries")
+{
+	TEST_CASE("current libraryfolders format")
+	{
+		const auto libraries = SteamLibraries::parseLibraryFolders(
+			"\"libraryfolders\"\n{\n"
+			"\t\"0\"\n\t{\n\t\t\"path\"\t\t\"C:\\\\Program Files (x86)\\\\Steam\"\n\t\t\"label\"\t\t\"\"\n"
+			"\t\t\"apps\"\n\t\t{\n\t\t\t\"70\"\t\t\"537178082\"\n\t\t}\n\t}\n"
+			"\t\"1\"\n\t{\n\t\t\"path\"\t\t\"D:\\\\SteamLibrary\"\n\t\t\"contentid\"\t\t\"12345\"\n\t}\n}\n");
+
+		REQUIRE(libraries.size() == 2);
+		CHECK(libraries[0] == fs::path("C:\\Program Files (x86)\\Steam"));
+		CHECK(libraries[1] == fs::path("D:\\SteamLibrary"));
+	}
+
+	TEST_CASE("legacy libraryfolders format")
+	{
+		const auto libraries = SteamLibraries::parseLibraryFolders(
+			"\"LibraryFolders\"\n{\n"
+			"\t\"TimeNextStatsReport\"\t\t\"1700000000\"\n\t\"ContentStatsID\"\t\t\"-123\"\n"
+			"\t\"1\"\t\t\"/mnt/games/SteamLibrary\"\n\t\"2\"\t\t\"/mnt/\\\"quoted\\\"\"\n}\n");
+
+		REQUIRE(libraries.size() == 2);
+		CHECK(libraries[0] == fs::path("/mnt/games/SteamLibrary"));
+		CHECK(libraries[1] == fs::path("/mnt/\"quoted\""));
+	}
+
+	TEST_CASE("comments, conditionals and unrelated paths are ignored")
+	{
+		const auto libraries = SteamLibraries::parseLibraryFolders(
+			"// written by Steam\n\"libraryfolders\" {\n"
+			"  \"0\" { \"path\" \"/one\" [$LINUX] // first\n \"stats\" { \"path\" \"/nested\" } }\n"
+			"  \"other\" { \"path\" \"/not-a-library\" }\n"
+			"}\n\"config\" { \"1\" \"/elsewhere\" }\n");
+
+		REQUIRE(libraries.size() == 1);
+		CHECK(libraries[0] == fs::path("/one"));
+
+		CHECK(SteamLibraries::parseLibraryFolders("").empty());
+		CHECK(SteamLibraries::parseLibraryFolders("\"libraryfolders\" { \"0\" { \"path\"").empty());
+	}
+
+	TEST_CASE("common directories of every library")
+	{
+		const fs::path root = fs::temp_directory_path() / "mer_test_libraries";
+		fs::remove_all(root);
+		const fs::path steam = root / "steam";
+		const fs::path second = root / "library";
+		fs::create_directories(steam / "steamapps/common");
+		fs::create_directories(second / "steamapps/common");
+
+		{
+			std::ofstream vdf{ steam / "steamapps/libraryfolders.vdf" };
+			vdf << "\"libraryfolders\"\n{\n"
+				<< "\t\"0\" { \"path\" \"" << steam.generic_string() << "\" }\n"
+				<< "\t\"1\" { \"path\" \"" << second.generic_string() << "\" }\n"
+				<< "\t\"2\" { \"path\" \"" << (root / "unplugged").generic_string() << "\" }\n}\n";
+		}
+
+		const auto commonDirs = SteamLibraries::findCommonDirs(steam);
+		REQUIRE(commonDirs.size() == 2);
+		CHECK(fs::equivalent(commonDirs[0], steam / "steamapps/common"));
+		CHECK(fs::equivalent(commonDirs[1], second / "steamapps/common"));
+
+		fs::remove(steam / "steamapps/libraryfolders.vdf");
+		CHECK(SteamLibraries::findCommonDirs(steam).size() == 1);
+
+		fs::remove_all(root);
+	}
+}
+
+
+TEST_SUITE("map discovery")
+{
+	TEST_CASE("effective maps follow SteamPipe precedence")
+	{
+		const fs::path steam = fs::temp_directory_path() / "mer_test_effective";
+		fs::remove_all(steam);
+		const fs::path halfLife = steam / "steamapps/common/Half-Life";
+		const auto addMap = [&halfLife](const std::string& modDir, const std::string& map) {
+			fs::create_directories(halfLife / modDir / "maps");
+			std::ofstream{ halfLife / modDir / "maps" / map };
+		};
+
+		addMap("valve", "c1a0.bsp");
+		std::ofstream{ halfLife / "valve/liblist.gam" };
+		addMap("valve", "c1a1.bsp");
+		addMap("valve", "c1a2.bsp");
+		addMap("valve_hd", "c1a0.bsp");
+		addMap("valve_hd", "c1a1.bsp");
+		addMap("valve_addon", "c1a1.bsp");
+		addMap("valve_downloads", "c1a2.bsp");
+		addMap("valve_downloads", "custom.bsp");
+
+		Options options;
+		options.globalSearch = true;
+		options.steamDir = steam;
+		options.steamCommonDir = steam / "steamapps/common";
+		options.findGlobs();
+		CHECK(options.globs.size() == 8);
+
+		options.globs.clear();
+		options.modDirs.clear();
+		options.effective = true;
+		options.findGlobs();
+		CHECK(options.globs == std::set<fs::path>{
+			halfLife / "valve/maps/c1a2.bsp",
+			halfLife / "valve_addon/maps/c1a1.bsp",
+			halfLife / "valve_downloads/maps/custom.bsp",
+			halfLife / "valve_hd/maps/c1a0.bsp"
+		});
+
+		fs::remove_all(steam);
+	}
+
+	TEST_CASE("maps directories without maps are found too")
+	{
+		const fs::path steam = fs::temp_directory_path() / "mer_test_maps_dirs";
+		fs::remove_all(steam);
+		const fs::path halfLife = steam / "steamapps/common/Half-Life";
+		fs::create_directories(halfLife / "valve/maps");
+		fs::create_directories(halfLife / "valve_addon/maps");
+		std::ofstream{ halfLife / "valve/liblist.gam" };
+		std::ofstream{ halfLife / "valve/maps/c1a0.bsp" };
+
+		Options options;
+		options.globalSearch = true;
+		options.steamDir = steam;
+		options.steamCommonDir = steam / "steamapps/common";
+		options.findGlobs();
+		CHECK(options.globs.size() == 1);
+		CHECK(options.mapsDirs == std::set<fs::path>{ halfLife / "valve/maps", halfLife / "valve_addon/maps" });
+
+		fs::remove_all(steam);
+	}
+}
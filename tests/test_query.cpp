@@ -71,6 +71,22 @@ TEST_SUITE("query parse")
 		CHECK(query.op == Query::QueryEquals);
 	}
 
+	TEST_CASE("parse key with multi-digit and negative index")
+	{
+		Query query{ "origin[12]>100" };
+		CHECK(query.key == "origin");
+		CHECK(query.valueIndex == 12);
+
+		Query negative{ "origin[-1]<-2000" };
+		CHECK(negative.valid);
+		CHECK(negative.key == "origin");
+		CHECK(negative.valueIndex == -1);
+		CHECK(negative.value == "-2000");
+
+		CHECK_FALSE(Query{ "origin[x]=1" }.valid);
+		CHECK_FALSE(Query{ "origin[]=1" }.valid);
+	}
+
 	TEST_CASE("parse value with asterisk")
 	{
 		Query query{ "key=*value" };
@@ -113,6 +129,27 @@ TEST_SUITE("query parse")
 		CHECK(query.valid == false);
 		CHECK(query.key == "valve");
 	}
+
+	TEST_CASE("parse regions")
+	{
+		Query near{ "near=0,-64,100,50" };
+		CHECK(near.valid == true);
+		REQUIRE(near.region.has_value());
+		CHECK(near.region->shape == Region::Sphere);
+		CHECK(near.region->radius == 50.);
+
+		Query inbox{ "inbox=64,0,0,0,-128,256" };
+		CHECK(inbox.valid == true);
+		REQUIRE(inbox.region.has_value());
+		CHECK(inbox.region->shape == Region::Box);
+		CHECK(inbox.region->min == Vec3{ 0., -128., 0. });
+		CHECK(inbox.region->max == Vec3{ 64., 0., 256. });
+
+		CHECK(Query{ "near=0,0,0" }.valid == false);
+		CHECK(Query{ "near=0,0,0,-1" }.valid == false);
+		CHECK(Query{ "inbox=0,0,0,1,1,x" }.valid == false);
+		CHECK(Query{ "near!=0,0,0,1" }.region.has_value() == false);
+	}
 }
 
 TEST_SUITE("query match")
@@ -466,6 +503,40 @@ TEST_SUITE("query match")
 			CHECK(entry.queryMatches == "spawnflags!=4");
 		}
 	}
+
+	TEST_CASE("match regions")
+	{
+		SUBCASE("match near")
+		{
+			Query query{ "near=32,-64,100,30" };
+			EntityEntry entry = query.testEntity(entity);
+			CHECK(entry.matched == true);
+			CHECK(entry.queryMatches == "origin=32 -64 128");
+		}
+
+		SUBCASE("fail near")
+		{
+			Query query{ "near=32,-64,100,20" };
+			CHECK(query.testEntity(entity).matched == false);
+		}
+
+		SUBCASE("match inbox")
+		{
+			Query query{ "inbox=0,0,0,64,-64,128" };
+			EntityEntry entry = query.testEntity(entity);
+			CHECK(entry.matched == true);
+			CHECK(entry.queryMatches == "origin=32 -64 128");
+		}
+
+		SUBCASE("use the regions of the map")
+		{
+			Query query{ "near=1000,1000,1000,1" };
+			MatchContext context;
+			context.inRegion.emplace_back(&query, std::vector<bool>{ false, true });
+			CHECK(query.testEntity(entity, 1, &context).matched == true);
+			CHECK(query.testEntity(entity, 0, &context).matched == false);
+		}
+	}
 }
 
 TEST_SUITE("query chain")
@@ -606,3 +677,80 @@ TEST_SUITE("query chain")
 		}
 	}
 }
+
+TEST_SUITE("query references")
+{
+	static const std::vector<Entity> map{
+		{ { "classname", "trigger_once" }, { "target", "gman_mm" } },
+		{ { "classname", "multi_manager" }, { "targetname", "gman_mm" }, { "argumentg", "0.5" }, { "argumentg#1", "2" }, { "door1", "1" } },
+		entity,
+		{ { "classname", "func_door" }, { "targetname", "door2" }, { "killtarget", "!activator" } },
+		{ { "classname", "monstermaker" }, { "targetname", "maker1" }, { "netname", "grunts" } },
+		{ { "classname", "trigger_relay" }, { "target", "grunts" } },
+		{ { "classname", "path_track" }, { "targetname", "track1" }, { "netname", "door3" } }
+	};
+
+	static MatchContext mapContext()
+	{
+		MatchContext context{ .entities = map };
+		for (unsigned int i = 0u; i < map.size(); ++i)
+			forEachTargetname(map[i], [&context, i](const std::string_view name) { context.targetnames[name].push_back(i); });
+		return context;
+	}
+
+	TEST_CASE("resolve references")
+	{
+		std::vector<std::string> names;
+		forEachReference(map[1], [&names](const std::string_view key, const std::string_view name) {
+			names.push_back(std::string(key) + ":" + std::string(name));
+		});
+		CHECK(names == std::vector<std::string>{ "argumentg:argumentg", "argumentg#1:argumentg", "door1:door1" });
+	}
+
+	TEST_CASE("match targets")
+	{
+		const MatchContext context = mapContext();
+
+		Query query{ "targets:classname==monster_gman" };
+		CHECK(query.valid == true);
+		REQUIRE(query.targetQuery != nullptr);
+
+		EntityEntry entry = query.testEntity(map[1], 1, &context);
+		CHECK(entry.matched == true);
+		CHECK(entry.queryMatches == "argumentg=argumentg (classname=monster_gman)");
+		CHECK(query.testEntity(map[0], 0, &context).matched == false);
+		CHECK(query.testEntity(map[1], 1).matched == false);
+
+		Query twice{ "targets:targets:classname==monster_gman" };
+		CHECK(twice.testEntity(map[0], 0, &context).matched == true);
+
+		CHECK(Query{ "targets:" }.valid == false);
+	}
+
+	TEST_CASE("find dangling targets")
+	{
+		const MatchContext context = mapContext();
+		CHECK(context.danglingTargets(map[0]).empty());
+		CHECK(context.danglingTargets(map[1]) == "door1=door1 (dangling)");
+		CHECK(context.danglingTargets(map[3]).empty());
+	}
+
+	TEST_CASE("resolve netname by class")
+	{
+		// A monstermaker's netname is the targetname of its monsters, a path_track's the entity it fires when passed
+		std::vector<std::string> names;
+		const auto collect = [&names](const std::string_view key, const std::string_view name) {
+			names.push_back(std::string(key) + ":" + std::string(name));
+		};
+		forEachReference(map[4], collect);
+		CHECK(names.empty());
+		forEachReference(map[6], collect);
+		CHECK(names == std::vector<std::string>{ "netname:door3" });
+
+		const MatchContext context = mapContext();
+		CHECK(context.targetnames.at("grunts") == std::vector<unsigned int>{ 4 });
+		CHECK(context.danglingTargets(map[5]).empty());
+		CHECK(context.danglingTargets(map[6]) == "netname=door3 (dangling)");
+		CHECK(Query{ "targets:classname==monstermaker" }.testEntity(map[5], 5, &context).matched == true);
+	}
+}
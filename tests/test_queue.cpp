@@ -0,0 +1,90 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "doctest.h"
+#include "queue.h"
+
+
+
+TEST_SUITE("bounded queue")
+{
+	TEST_CASE("capacity is bounded")
+	{
+		BoundedQueue<int> queue{ 3 };
+		CHECK(queue.capacity() == 4);
+
+		for (int i = 0; i < 4; ++i)
+			CHECK(queue.tryPush(i));
+		int value = 4;
+		CHECK_FALSE(queue.tryPush(value));
+
+		CHECK(queue.tryPop(value));
+		CHECK(value == 0);
+		CHECK(queue.size() == 3);
+	}
+
+	TEST_CASE("close drains before ending")
+	{
+		BoundedQueue<int> queue{ 8 };
+		const std::atomic<bool> stop = false;
+		queue.push(1, stop);
+		queue.push(2, stop);
+		queue.close();
+
+		int value = 0;
+		CHECK(queue.pop(value, stop));
+		CHECK(queue.pop(value, stop));
+		CHECK(value == 2);
+		CHECK_FALSE(queue.pop(value, stop));
+	}
+
+	TEST_CASE("stop unblocks a full queue")
+	{
+		BoundedQueue<int> queue{ 2 };
+		std::atomic<bool> stop = false;
+		queue.push(1, stop);
+		queue.push(2, stop);
+
+		stop = true;
+		CHECK_FALSE(queue.push(3, stop));
+	}
+
+	TEST_CASE("multiple producers and consumers")
+	{
+		constexpr int producers = 4, consumers = 3, perProducer = 20000;
+		BoundedQueue<int> queue{ 16 };
+		const std::atomic<bool> stop = false;
+		std::atomic<long long> sum = 0;
+		std::atomic<int> count = 0;
+		std::atomic<int> running = producers;
+
+		std::vector<std::thread> threads;
+		for (int p = 0; p < producers; ++p)
+		{
+			threads.emplace_back([&, p] {
+				for (int i = 1; i <= perProducer; ++i)
+					queue.push(p * perProducer + i, stop);
+				if (--running == 0)
+					queue.close();
+			});
+		}
+		for (int c = 0; c < consumers; ++c)
+		{
+			threads.emplace_back([&] {
+				int value;
+				while (queue.pop(value, stop))
+				{
+					sum += value;
+					++count;
+				}
+			});
+		}
+		for (auto& thread : threads)
+			thread.join();
+
+		constexpr long long total = static_cast<long long>(producers) * perProducer;
+		CHECK(count == total);
+		CHECK(sum == total * (total + 1) / 2);
+		CHECK(queue.metrics().pushes == static_cast<std::uint64_t>(total));
+	}
+}
@@ -0,0 +1,122 @@
+#include <cmath>
+#include <format>
+#include <algorithm>
+#include "doctest.h"
+#include "sampling.h"
+
+
+namespace fs = std::filesystem;
+
+static std::set<fs::path> maps(const std::string& mod, const int count)
+{
+	std::set<fs::path> found;
+	for (int i = 0; i < count; ++i)
+		found.insert(std::format("/steam/steamapps/common/Half-Life/{}/maps/map{:03}.bsp", mod, i));
+	return found;
+}
+
+static std::set<fs::path> archive()
+{
+	std::set<fs::path> globs = maps("valve", 100);
+	globs.merge(maps("cstrike", 20));
+	globs.merge(maps("gearbox", 1));
+	return globs;
+}
+
+
+
+TEST_SUITE("map sampling")
+{
+	TEST_CASE("parses fractions and percentages")
+	{
+		CHECK(MapSample::parseFraction("0.25") == 0.25);
+		CHECK(MapSample::parseFraction("5%") == 0.05);
+		CHECK(MapSample::parseFraction("1") == 1.);
+		CHECK(std::isnan(MapSample::parseFraction("0")));
+		CHECK(std::isnan(MapSample::parseFraction("150%")));
+		CHECK(std::isnan(MapSample::parseFraction("half")));
+		CHECK(std::isnan(MapSample::parseFraction("%")));
+	}
+
+	TEST_CASE("samples a share of every mod, the same one for the same seed")
+	{
+		std::set<fs::path> globs = archive();
+		MapSample sample{ 0.1, 7 };
+		sample.choose(globs);
+		CHECK(globs.size() == 10 + 2 + 1);
+		CHECK(std::ranges::count_if(globs, [](const fs::path& map) { return map.string().find("/valve/") != std::string::npos; }) == 10);
+		CHECK(std::ranges::count_if(globs, [](const fs::path& map) { return map.string().find("/gearbox/") != std::string::npos; }) == 1);
+
+		std::set<fs::path> again = archive();
+		MapSample{ 0.1, 7 }.choose(again);
+		CHECK(again == globs);
+
+		std::set<fs::path> reseeded = archive();
+		MapSample{ 0.1, 8 }.choose(reseeded);
+		CHECK(reseeded != globs);
+	}
+
+	TEST_CASE("interleaves mods in proportion to their size")
+	{
+		std::set<fs::path> globs = archive();
+		MapSample sample{ 0.5, 0 };
+		sample.choose(globs);
+
+		std::vector<const fs::path*> order;
+		for (const fs::path& glob : globs)
+			order.push_back(&glob);
+		sample.arrange(order);
+
+		// Every mod comes up within the first few maps rather than after all of valve
+		const auto firstOf = [&order](const std::string& mod) {
+			return std::ranges::find_if(order, [&mod](const fs::path* map) { return map->string().find(mod) != std::string::npos; }) - order.begin();
+		};
+		CHECK(firstOf("/valve/") < 5);
+		CHECK(firstOf("/cstrike/") < 5);
+		CHECK(firstOf("/gearbox/") < 40);
+	}
+
+	TEST_CASE("estimates are exact once every map is scanned")
+	{
+		std::set<fs::path> globs = archive();
+		MapSample sample{ 1., 0 };
+		sample.choose(globs);
+
+		std::size_t matches = 0;
+		for (const fs::path& map : globs)
+		{
+			const std::size_t count = map.stem().string().ends_with('0') ? 3 : 0;
+			sample.add(map, count);
+			matches += count;
+		}
+
+		const MapSample::Estimate estimate = sample.estimate();
+		CHECK(estimate.scanned == 121);
+		CHECK(estimate.total == 121);
+		CHECK(estimate.mods == 3);
+		CHECK(estimate.matches.estimate == doctest::Approx(static_cast<double>(matches)));
+		CHECK(estimate.matches.low == doctest::Approx(static_cast<double>(matches)));
+		CHECK(estimate.matches.high == doctest::Approx(static_cast<double>(matches)));
+		CHECK(estimate.maps.estimate == doctest::Approx(13.));
+	}
+
+	TEST_CASE("estimates cover the matches of the maps left out")
+	{
+		std::set<fs::path> globs = archive();
+		MapSample sample{ 0.2, 3 };
+		sample.choose(globs);
+
+		// Every tenth map has 10 matches, the rest none
+		for (const fs::path& map : globs)
+			sample.add(map, map.stem().string().ends_with('0') ? 10 : 0);
+
+		const MapSample::Estimate estimate = sample.estimate();
+		CHECK(estimate.scanned == globs.size());
+		CHECK(estimate.total == 121);
+		CHECK(estimate.matches.low <= estimate.matches.estimate);
+		CHECK(estimate.matches.estimate <= estimate.matches.high);
+		CHECK(estimate.maps.high <= 121.);
+		CHECK(estimate.matches.low <= 130.);
+		CHECK(estimate.matches.high >= 130.);
+	}
+}
@@ -0,0 +1,128 @@
+#include <fstream>
+#include <filesystem>
+#include "doctest.h"
+#include "shard.h"
+#include "stats.h"
+#include "mer.h"
+
+
+namespace fs = std::filesystem;
+
+static void resetResults()
+{
+	g_options.entries.clear();
+	g_options.duplicates.clear();
+	g_options.foundEntries = 0;
+	g_options.printFullEnt = false;
+	g_options.globs.clear();
+	g_stats.mapsDeduplicated = 0;
+	g_stats.mapsFailed = 0;
+}
+
+
+
+TEST_SUITE("shards")
+{
+	TEST_CASE("partial results merge back into the report")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_shard";
+		fs::create_directories(dir);
+		const fs::path c1a0 = "/steam/steamapps/common/Half-Life/valve/maps/c1a0.bsp";
+		const fs::path c1a0hd = "/steam/steamapps/common/Half-Life/valve_hd/maps/c1a0.bsp";
+		const fs::path c1a1 = "/steam/steamapps/common/Half-Life/valve/maps/c1a1.bsp";
+
+		resetResults();
+		g_options.printFullEnt = true;
+		g_options.shardCount = 2;
+		for (unsigned int shard = 0; shard < 2; ++shard)
+		{
+			g_options.shardIndex = shard;
+			g_options.globs = shard ? std::set<fs::path>{ c1a1 } : std::set<fs::path>{ c1a0, c1a0hd };
+			g_options.entries.clear();
+			g_options.duplicates.clear();
+
+			EntityEntry entry{ true, 55 + shard, 1, "monster_gman", "argumentg", "classname=monster_gman", {} };
+			entry.fullEnt = { { "classname", "monster_gman" }, { "message", "say \"hi\"\n\x01 \\ \xc3\xa9" } };
+			g_options.entries[shard ? c1a1 : c1a0] = { entry };
+			if (!shard)
+				g_options.duplicates[c1a0] = { c1a0hd };
+			g_options.foundEntries = 1;
+			g_stats.mapsDeduplicated = shard ? 0 : 1;
+
+			std::ofstream partial{ dir / ("part" + std::to_string(shard) + ".jsonl") };
+			Shards::writePartial(partial);
+		}
+
+		resetResults();
+		g_options.shardCount = 0;
+		const std::size_t mapsChecked = Shards::mergePartials({ dir / "part0.jsonl", dir / "part1.jsonl" });
+		CHECK(mapsChecked == 3);
+		CHECK(g_options.foundEntries == 2);
+		CHECK(g_stats.mapsDeduplicated == 1);
+		CHECK(g_options.printFullEnt);
+
+		REQUIRE(g_options.entries.contains(c1a0));
+		REQUIRE(g_options.entries.contains(c1a1));
+		CHECK(g_options.duplicates[c1a0] == std::vector<fs::path>{ c1a0hd });
+
+		const EntityEntry& entry = g_options.entries[c1a1].front();
+		CHECK(entry.index == 56);
+		CHECK(entry.flags == 1);
+		CHECK(entry.classname == "monster_gman");
+		CHECK(entry.targetname == "argumentg");
+		CHECK(entry.queryMatches == "classname=monster_gman");
+		REQUIRE(entry.fullEnt.size() == 2);
+		CHECK(entry.fullEnt[1].second == "say \"hi\"\n\x01 \\ \xc3\xa9");
+
+		{
+			std::ofstream notPartial{ dir / "report.txt" };
+			notPartial << "Number of matches found: 2\n";
+		}
+		CHECK_THROWS_AS(Shards::mergePartials({ dir / "report.txt" }), std::runtime_error);
+		CHECK_THROWS_AS(Shards::mergePartials({ dir / "missing.jsonl" }), std::runtime_error);
+
+		// Shard numbers that don't fit are rejected before they're used
+		for (const std::string header : { R"({"shard":0,"shards":-1})", R"({"shard":0,"shards":1e12})", R"({"shard":0.5,"shards":2})", R"({"shard":2,"shards":2})" })
+		{
+			CAPTURE(header);
+			std::ofstream{ dir / "bad.jsonl" } << header << '\n';
+			CHECK_THROWS_AS(Shards::mergePartials({ dir / "bad.jsonl" }), std::runtime_error);
+		}
+
+		resetResults();
+		fs::remove_all(dir);
+	}
+
+	TEST_CASE("a shard merged twice only counts once")
+	{
+		const fs::path dir = fs::temp_directory_path() / "mer_test_shard_repeated";
+		fs::create_directories(dir);
+		const fs::path c1a0 = "/steam/steamapps/common/Half-Life/valve/maps/c1a0.bsp";
+		const fs::path c1a1 = "/steam/steamapps/common/Half-Life/valve/maps/c1a1.bsp";
+
+		resetResults();
+		g_options.shardCount = 2;
+		for (unsigned int shard = 0; shard < 2; ++shard)
+		{
+			g_options.shardIndex = shard;
+			g_options.globs = { shard ? c1a1 : c1a0 };
+			g_options.entries.clear();
+			g_options.entries[shard ? c1a1 : c1a0] = { EntityEntry{ true, 55, 0, "monster_gman", "", "classname=monster_gman", {} } };
+			g_options.foundEntries = 1;
+
+			std::ofstream partial{ dir / ("part" + std::to_string(shard) + ".jsonl") };
+			Shards::writePartial(partial);
+		}
+
+		resetResults();
+		g_options.shardCount = 0;
+		const std::size_t mapsChecked = Shards::mergePartials({ dir / "part0.jsonl", dir / "part0.jsonl", dir / "part1.jsonl" });
+		CHECK(mapsChecked == 2);
+		CHECK(g_options.foundEntries == 2);
+		CHECK(g_options.entries[c1a0].size() == 1);
+		CHECK(g_options.entries[c1a1].size() == 1);
+
+		resetResults();
+		fs::remove_all(dir);
+	}
+}
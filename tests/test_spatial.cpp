@@ -0,0 +1,76 @@
+#include <format>
+#include <random>
+#include "doctest.h"
+#include "spatial.h"
+
+
+// Clusters of entities around a map, some without an origin
+static std::vector<std::optional<Vec3>> randomOrigins(const unsigned int seed, const std::size_t count)
+{
+	std::mt19937 random{ seed };
+	std::uniform_real_distribution<double> cluster{ -4096., 4096. }, offset{ -256., 256. };
+	std::vector<std::optional<Vec3>> origins;
+	Vec3 center{};
+	for (std::size_t i = 0; i < count; ++i)
+	{
+		if (i % 50 == 0)
+			center = { cluster(random), cluster(random), cluster(random) };
+		if (i % 7 == 0)
+			origins.emplace_back();
+		else
+			origins.push_back(Vec3{ center[0] + offset(random), center[1] + offset(random), center[2] + offset(random) });
+	}
+	return origins;
+}
+
+static std::vector<bool> bruteForce(const std::vector<std::optional<Vec3>>& origins, const Region& region)
+{
+	std::vector<bool> inside(origins.size());
+	for (std::size_t i = 0; i < origins.size(); ++i)
+		inside[i] = origins[i] && region.contains(*origins[i]);
+	return inside;
+}
+
+
+
+TEST_SUITE("spatial grid")
+{
+	TEST_CASE("finds the same entities as testing each of them")
+	{
+		for (const std::size_t count : { 0, 1, 40, 3000 })
+		{
+			const std::vector<std::optional<Vec3>> origins = randomOrigins(static_cast<unsigned int>(count), count);
+			const SpatialGrid grid{ origins };
+
+			std::mt19937 random{ 5 };
+			std::uniform_real_distribution<double> coordinate{ -5000., 5000. }, size{ 0., 1500. };
+			for (int i = 0; i < 200; ++i)
+			{
+				const Vec3 point{ coordinate(random), coordinate(random), coordinate(random) };
+				const std::optional<Region> region = i % 2
+					? Region::parse("near", std::format("{},{},{},{}", point[0], point[1], point[2], size(random)))
+					: Region::parse("inbox", std::format("{},{},{},{},{},{}", point[0], point[1], point[2],
+						point[0] - size(random), point[1] + size(random), point[2] - size(random)));
+				REQUIRE(region.has_value());
+
+				std::vector<bool> inside(origins.size());
+				grid.find(*region, inside);
+				CHECK(inside == bruteForce(origins, *region));
+			}
+		}
+	}
+
+	TEST_CASE("regions reaching past the entities")
+	{
+		const std::vector<std::optional<Vec3>> origins{ Vec3{ 0., 0., 0. }, std::nullopt, Vec3{ 10., 10., 10. } };
+		const SpatialGrid grid{ origins };
+
+		std::vector<bool> inside(origins.size());
+		grid.find(*Region::parse("inbox", "-1e9,-1e9,-1e9,1e9,1e9,1e9"), inside);
+		CHECK(inside == std::vector<bool>{ true, false, true });
+
+		inside.assign(origins.size(), false);
+		grid.find(*Region::parse("near", "100,100,100,5"), inside);
+		CHECK(inside == std::vector<bool>{ false, false, false });
+	}
+}
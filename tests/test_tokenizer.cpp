@@ -0,0 +1,116 @@
+#include <string>
+#include <vector>
+#include <utility>
+#include <stdexcept>
+#include "doctest.h"
+#include "tokenizer.h"
+
+
+using KeyValues = std::vector<std::vector<std::pair<std::string, std::string>>>;
+
+static KeyValues tokenize(const std::string_view lump, const Tokenizer::Isa isa)
+{
+	std::pmr::monotonic_buffer_resource resource;
+	Tokenizer::Result result{ &resource };
+	Tokenizer::tokenize(lump, 0, result, isa);
+
+	KeyValues entities;
+	std::size_t token = 0;
+	for (const std::uint32_t entityEnd : result.entityEnds)
+	{
+		auto& entity = entities.emplace_back();
+		for (; token + 1 < entityEnd; token += 2)
+		{
+			const auto& key = result.tokens[token];
+			const auto& value = result.tokens[token + 1];
+			entity.emplace_back(lump.substr(key.begin, key.end - key.begin), lump.substr(value.begin, value.end - value.begin));
+		}
+		token = entityEnd;
+	}
+
+	return entities;
+}
+
+static std::vector<Tokenizer::Isa> supportedIsas()
+{
+	std::vector<Tokenizer::Isa> isas;
+	for (const auto isa : { Tokenizer::Isa::Scalar, Tokenizer::Isa::SSE2, Tokenizer::Isa::AVX2 })
+	{
+		if (Tokenizer::isaSupported(isa))
+			isas.push_back(isa);
+	}
+	return isas;
+}
+
+
+
+TEST_SUITE("tokenizer")
+{
+	TEST_CASE("key values")
+	{
+		const std::string lump = "{\n\"classname\" \"worldspawn\"\n\"wad\" \"halflife.wad\"\n}\n{\n\"classname\" \"info_player_start\"\n}\n";
+
+		for (const auto isa : supportedIsas())
+		{
+			const KeyValues entities = tokenize(lump, isa);
+			REQUIRE(entities.size() == 2);
+			CHECK(entities[0].size() == 2);
+			CHECK(entities[0][1].first == "wad");
+			CHECK(entities[0][1].second == "halflife.wad");
+			CHECK(entities[1][0].second == "info_player_start");
+		}
+	}
+
+	TEST_CASE("trailing comments")
+	{
+		const std::string lump = "{\n\"classname\" \"func_door\"// \"speed\" \"100\"\n\"targetname\" \"door\"\n}\n";
+
+		for (const auto isa : supportedIsas())
+		{
+			const KeyValues entities = tokenize(lump, isa);
+			REQUIRE(entities.size() == 1);
+			REQUIRE(entities[0].size() == 2);
+			CHECK(entities[0][1].first == "targetname");
+		}
+	}
+
+	TEST_CASE("escaped tokens")
+	{
+		const std::string lump = "{\r\n\"message\" \"line one\r\nline two\"\r\n\"classname\" \"game_text\"\r\n}\r\n";
+
+		for (const auto isa : supportedIsas())
+		{
+			std::pmr::monotonic_buffer_resource resource;
+			Tokenizer::Result result{ &resource };
+			Tokenizer::tokenize(lump, 0, result, isa);
+
+			REQUIRE(result.tokens.size() == 4);
+			CHECK_FALSE(result.tokens[0].escaped);
+			CHECK(result.tokens[1].escaped);
+			CHECK_FALSE(result.tokens[3].escaped);
+		}
+	}
+
+	TEST_CASE("unexpected entity data")
+	{
+		const std::string lump = "{\n\"classname\" worldspawn\n}\n";
+
+		for (const auto isa : supportedIsas())
+			CHECK_THROWS_AS(tokenize(lump, isa), std::runtime_error);
+	}
+
+	TEST_CASE("isas agree across block boundaries")
+	{
+		std::string lump;
+		for (int i = 0; i < 200; ++i)
+		{
+			lump += "{\n\"classname\" \"monster_" + std::string(i % 61, 'x') + "\"\n";
+			lump += "\t\"origin\" \"" + std::to_string(i) + " -" + std::to_string(i * 7) + " 0\"" + (i % 5 ? "\n" : " // note\n") + "}\n";
+		}
+
+		const KeyValues expected = tokenize(lump, Tokenizer::Isa::Scalar);
+		CHECK(expected.size() == 200);
+		for (const auto isa : supportedIsas())
+			CHECK(tokenize(lump, isa) == expected);
+	}
+}